@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "bench.h"
+
+volatile long benchSink = 0;
+
+/*
+ * Seconds on a clock that never goes backwards
+ */
+double bench_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Print one result, param names what value is (size, threads...)
+ * or is NULL if the benchmark has no parameter
+ */
+void bench_report(const char* name, const char* param, long long value,
+		long long ops, double seconds) {
+	fprintf(stdout, "{\"bench\": \"%s\", ", name);
+	if(param != NULL) {
+		fprintf(stdout, "\"%s\": %lld, ", param, value);
+	}
+	fprintf(stdout, "\"ops\": %lld, \"seconds\": %.4f, \"ns_per_op\": %.1f}\n",
+			ops, seconds, ops ? seconds * 1e9 / ops : 0.0);
+	fflush(stdout);
+}
+
+/*
+ * Print what items of something took in memory
+ */
+void bench_report_bytes(const char* name, const char* param,
+		long long value, long long bytes, long long items) {
+	fprintf(stdout, "{\"bench\": \"%s\", ", name);
+	if(param != NULL) {
+		fprintf(stdout, "\"%s\": %lld, ", param, value);
+	}
+	fprintf(stdout, "\"bytes\": %lld, \"bytes_per_item\": %.1f}\n", bytes,
+			items ? (double)bytes / items : 0.0);
+	fflush(stdout);
+}
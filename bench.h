@@ -0,0 +1,27 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * Micro-benchmarks for the client and server (make bench).
+ *
+ * Each result is printed as one line of JSON so runs from different
+ * builds can be compared with a script:
+ *     {"bench": "find_user", "size": 1000, "ops": 52000,
+ *      "seconds": 0.2003, "ns_per_op": 3851.9}
+ * or, for what something takes in memory:
+ *     {"bench": "game_memory", "size": 1000, "bytes": 310000,
+ *      "bytes_per_item": 310.0}
+ */
+
+#define BENCH_SECONDS	0.2		// Minimum time spent on each benchmark
+#define BENCH_BATCH		64		// Operations between looks at the clock
+
+extern volatile long benchSink;	// Results go here so nothing is optimised out
+
+double bench_now(void);
+void bench_report(const char* name, const char* param, long long value,
+		long long ops, double seconds);
+void bench_report_bytes(const char* name, const char* param,
+		long long value, long long bytes, long long items);
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ * Micro-benchmarks for the client
+ * Usage: benchClient
+ *
+ * The client is built in with its main renamed so its own types and
+ * functions are measured, not copies of them.
+ */
+#define main nclient_main
+#include "nclient.c"
+#undef main
+
+#include "bench.h"
+
+#define SHIPS 100	// Ships on the large boards
+
+#define LINES 100000	// Lines in the stream the readers are timed on
+
+/*
+** Pulling the coordinates out of a $request, as sscanf did it before
+** the protocol module and as it does it now
+*/
+void bench_parse_request(void)
+{
+    unsigned int x, y;
+    const char* args;
+    long long ops = 0;
+    double start = bench_now(), elapsed;
+
+    do {
+		int i;
+		for (i = 0; i < BENCH_BATCH; ++i) {
+		    benchSink += (sscanf("$request 12 34\n", "$request %u %u\n",
+				&x, &y) == 2) + x + y;
+		}
+		ops += BENCH_BATCH;
+    } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+    bench_report("parse_request_sscanf", NULL, 0, ops, elapsed);
+
+    ops = 0;
+    start = bench_now();
+    do {
+		int i;
+		for (i = 0; i < BENCH_BATCH; ++i) {
+		    benchSink += (proto_command("$request 12 34\n", &args) ==
+				CMD_REQUEST && proto_coords(args, &x, &y)) + x + y;
+		}
+		ops += BENCH_BATCH;
+    } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+    bench_report("parse_request", NULL, 0, ops, elapsed);
+}
+
+/*
+** Naming each kind of message the client gets, by a chain of strcmp
+** and by keyword hash
+*/
+static const char* messages[] = {"$token 0123456789abcdef\n",
+	"$startrules\n", "$yourmove\n", "$response hit\n", "$response miss\n",
+	"$response over\n", "$bye\n", "$request 12 34\n"};
+#define N_MESSAGES (sizeof(messages) / sizeof(messages[0]))
+
+int strcmp_dispatch(const char* line)
+{
+    if (strncmp(line, "$token ", 7) == 0) return 1;
+    if (strcmp(line, "$startrules\n") == 0) return 2;
+    if (strcmp(line, "$yourmove\n") == 0) return 3;
+    if (strcmp(line, "$response hit\n") == 0) return 4;
+    if (strcmp(line, "$response miss\n") == 0) return 5;
+    if (strcmp(line, "$response over\n") == 0) return 6;
+    if (strcmp(line, "$bye\n") == 0) return 7;
+    if (strncmp(line, "$request ", 9) == 0) return 8;
+    return 0;
+}
+
+void bench_dispatch(void)
+{
+    const char* args;
+    long long ops = 0;
+    double start = bench_now(), elapsed;
+
+    do {
+		int i;
+		for (i = 0; i < BENCH_BATCH; ++i) {
+		    benchSink += strcmp_dispatch(messages[i % N_MESSAGES]);
+		}
+		ops += BENCH_BATCH;
+    } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+    bench_report("dispatch_strcmp", NULL, 0, ops, elapsed);
+
+    ops = 0;
+    start = bench_now();
+    do {
+		int i;
+		for (i = 0; i < BENCH_BATCH; ++i) {
+		    benchSink += proto_command(messages[i % N_MESSAGES], &args);
+		}
+		ops += BENCH_BATCH;
+    } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+    bench_report("dispatch_proto", NULL, 0, ops, elapsed);
+}
+
+/*
+** Finding the newline in a line of len bytes, by memchr and by
+** proto_find_newline
+*/
+void bench_find_newline(unsigned int len)
+{
+    char* line = (char*)malloc(len);
+    long long ops = 0;
+    double start, elapsed;
+
+    memset(line, 'x', len);
+    line[len - 1] = '\n';
+
+    start = bench_now();
+    do {
+		int i;
+		for (i = 0; i < BENCH_BATCH; ++i) {
+		    benchSink += (const char*)memchr(line, '\n', len) - line;
+		}
+		ops += BENCH_BATCH;
+    } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+    bench_report("find_newline_memchr", "len", len, ops, elapsed);
+
+    ops = 0;
+    start = bench_now();
+    do {
+		int i;
+		for (i = 0; i < BENCH_BATCH; ++i) {
+		    benchSink += proto_find_newline(line, len) - line;
+		}
+		ops += BENCH_BATCH;
+    } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+    bench_report("find_newline", "len", len, ops, elapsed);
+    free(line);
+}
+
+/*
+** Reading LINES messages off a file with fgets and with a LineReader
+*/
+void bench_read_lines(void)
+{
+    FILE* f = tmpfile();
+    char line[80];
+    LineReader reader;
+    long long ops = 0;
+    double start, elapsed;
+    unsigned int i;
+
+    for (i = 0; i < LINES; ++i) {
+		fputs(messages[i % N_MESSAGES], f);
+    }
+    fflush(f);
+
+    start = bench_now();
+    do {
+		rewind(f);
+		while (fgets(line, 80, f) != NULL) {
+		    benchSink += line[1];
+		    ops++;
+		}
+    } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+    bench_report("read_line_fgets", NULL, 0, ops, elapsed);
+
+    ops = 0;
+    start = bench_now();
+    do {
+		lseek(fileno(f), 0, SEEK_SET);
+		proto_reader_init(&reader, fileno(f));
+		while (proto_read_line(&reader, line, 80)) {
+		    benchSink += line[1];
+		    ops++;
+		}
+    } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+    bench_report("read_line", NULL, 0, ops, elapsed);
+    fclose(f);
+}
+
+/*
+** Stamping ships onto a width by width board, a fresh spot each time
+*/
+void bench_stamp_ship(unsigned int width)
+{
+    Board b;
+    Ship s = {width / 10, 'a', width / 10};
+    unsigned int spot = 0, spots = width * 10;
+    long long ops = 0;
+    double start, elapsed;
+
+    b.height = width;
+    b.width = width;
+    b.hidden = (char*)malloc((size_t)width * width);
+    memset(b.hidden, '.', (size_t)width * width);
+
+    start = bench_now();
+    do {
+		int i;
+		for (i = 0; i < BENCH_BATCH; ++i, ++spot) {
+		    if (spot == spots) {
+				memset(b.hidden, '.', (size_t)width * width);
+				spot = 0;
+		    }
+		    if (stamp_ship(&b, &s, 'E', (spot % 10) * s.length,
+					spot / 10) != OK) {
+				fprintf(stderr, "stamp_ship failed\n");
+				exit(1);
+		    }
+		}
+		ops += BENCH_BATCH;
+    } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+    bench_report("stamp_ship", "width", width, ops, elapsed);
+    free(b.hidden);
+}
+
+/*
+** Building a width by width board with SHIPS ships from rules and map,
+** with the rules parsed from text and loaded from the cache
+*/
+void bench_alloc_board(unsigned int width)
+{
+    FILE* text = tmpfile();
+    FILE* map = tmpfile();
+    char cacheDir[] = "/tmp/benchClientXXXXXX";
+    char hash[HASH_LEN + 1];
+    char path[PATH_LEN];
+    Rules rules;
+    Board b;
+    unsigned int i;
+    long long ops = 0;
+    double start, elapsed;
+
+    fprintf(text, "%u %u\n%u\n", width, width, SHIPS);
+    for (i = 0; i < SHIPS; ++i) {
+		fprintf(text, "%u\n", width / 2);
+		fprintf(map, "0 %u E\n", i * (width / SHIPS));
+    }
+
+    start = bench_now();
+    do {
+		rewind(text);
+		rewind(map);
+		if (parse_rules(&rules, text) != OK ||
+			alloc_board(&b, &rules, map) != OK) {
+		    fprintf(stderr, "alloc_board failed\n");
+		    exit(1);
+		}
+		dealloc_rules(&rules);
+		dealloc_board(&b);
+		ops++;
+    } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+    bench_report("alloc_board", "width", width, ops, elapsed);
+
+    /* The same rules through the cache */
+    rewind(text);
+    parse_rules(&rules, text);
+    mkdtemp(cacheDir);
+    cache_rules(cacheDir, NULL, "0123456789abcdef", &rules);
+    dealloc_rules(&rules);
+
+    ops = 0;
+    start = bench_now();
+    do {
+		rewind(map);
+		if (load_cached_rules(cacheDir, NULL, hash, &rules) != OK ||
+			alloc_board(&b, &rules, map) != OK) {
+		    fprintf(stderr, "alloc_board from cache failed\n");
+		    exit(1);
+		}
+		dealloc_rules(&rules);
+		dealloc_board(&b);
+		ops++;
+    } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+    bench_report("alloc_board_cached", "width", width, ops, elapsed);
+
+    snprintf(path, PATH_LEN, "%s/rules.%s", cacheDir, hash);
+    remove(path);
+    snprintf(path, PATH_LEN, "%s/last", cacheDir);
+    remove(path);
+    rmdir(cacheDir);
+    fclose(text);
+    fclose(map);
+}
+
+/*
+** Picking a guess on a width by width board with the standard fleet,
+** ten moves into a game, with each strategy. Monte Carlo gets a budget
+** of a millisecond and one thread, so it shows what a sample costs.
+*/
+void bench_strategy(unsigned int width)
+{
+    static const char* names[] = {"sweep", "parity", "density", "montecarlo"};
+    unsigned int lengths[] = {5, 4, 3, 2, 1};
+    char name[40];
+    unsigned int n, i, x, y;
+
+    for (n = 0; n < sizeof(names) / sizeof(names[0]); ++n) {
+		Strategy s;
+		long long ops = 0;
+		double start, elapsed;
+
+		strategy_init(&s, strategy_find(names[n]), width, width, 5, lengths,
+			1, 1);
+		for (i = 0; i < 10; ++i) {
+		    /* Ship i lies along row 2i from the left edge */
+		    strategy_guess(&s, &x, &y);
+		    strategy_result(&s, y % 2 == 0 && y / 2 < 5 &&
+			    x < lengths[y / 2]);
+		}
+
+		start = bench_now();
+		do {
+		    strategy_guess(&s, &x, &y);
+		    benchSink += x + y;
+		    ops++;
+		} while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+		snprintf(name, sizeof(name), "strategy_%s", names[n]);
+		bench_report(name, "width", width, ops, elapsed);
+		strategy_free(&s);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int width;
+
+    bench_parse_request();
+    bench_dispatch();
+    for (width = 16; width <= 1024; width *= 4) {
+		bench_find_newline(width);
+    }
+    bench_read_lines();
+    for (width = 100; width <= 10000; width *= 10) {
+		bench_stamp_ship(width);
+    }
+    for (width = 100; width <= 10000; width *= 10) {
+		bench_alloc_board(width);
+    }
+    for (width = 8; width <= 32; width *= 4) {
+		bench_strategy(width);
+    }
+    return 0;
+}
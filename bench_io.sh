@@ -0,0 +1,54 @@
+#!/bin/bash
+#
+# Load test of the server's two socket I/O backends (make benchIO)
+# Usage: bench_io.sh [copies ...]
+#
+# One game between two automated clients is recorded, then played back
+# copies times over at once by nreplay, flat out, against a fresh server
+# using threads and then io_uring (nserver -u). Prints nreplay's line of
+# JSON for each run with the server's CPU seconds and backend added.
+#
+
+cd "$(dirname "$0")"
+COPIES=${*:-50 400}
+DIR=$(mktemp -d)
+PORT=$((20000 + RANDOM % 10000))
+TICKS=$(getconf CLK_TCK)
+
+trap 'kill $SERVER 2>/dev/null; rm -rf "$DIR"' EXIT
+
+# CPU seconds a process has used, from /proc
+cpu_seconds() {
+	awk -v ticks="$TICKS" '{ printf "%.2f", ($14 + $15) / ticks }' \
+			/proc/"$1"/stat
+}
+
+start_server() {
+	./nserverLinux "$@" "$DIR/log" 100000 standard.rules $PORT \
+			> /dev/null 2>&1 &
+	SERVER=$!
+	sleep 0.3
+}
+
+# Record the game that is played back
+start_server -r "$DIR/game"
+./nclientLinux --quiet --strategy sweep a g map1.map $PORT > /dev/null &
+sleep 0.1
+./nclientLinux --quiet --strategy sweep b g map1.map $PORT > /dev/null
+wait $!
+kill -INT $SERVER; wait $SERVER 2>/dev/null
+
+for copies in $COPIES; do
+	for backend in threads io_uring; do
+		PORT=$((PORT + 1))
+		if [ $backend = io_uring ]; then
+			start_server -u
+		else
+			start_server
+		fi
+		result=$(./nreplayLinux "$DIR/game" load $PORT max $copies)
+		cpu=$(cpu_seconds $SERVER)
+		kill $SERVER; wait $SERVER 2>/dev/null
+		echo "${result%\}}, \"backend\": \"$backend\", \"server_cpu_s\": $cpu}"
+	done
+done
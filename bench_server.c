@@ -0,0 +1,202 @@
+/*
+ * Micro-benchmarks for the server
+ * Usage: benchServer [max_size]
+ *
+ * The server is built in with its main renamed so its own types and
+ * functions are measured, not copies of them.
+ */
+#define main nserver_main
+#include "nserver.c"
+#undef main
+
+#include "bench.h"
+
+/*
+ * Reading a handshake off a socket
+ */
+void bench_parse_handshake(void) {
+    int fds[2];
+    char* user = (char *)malloc(80);
+    char* game = (char *)malloc(80);
+    char token[TOKEN_LEN + 1];
+    unsigned int seen;
+    RuleSet* ruleSet;
+    int mapStatus;
+    const char* hello = "$handshake alice g1\n";
+    size_t len = strlen(hello);
+    long long ops = 0;
+    double start = bench_now(), elapsed;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    Conn* conn = conn_open(fds[1]);
+    do {
+        for(int i = 0; i < BENCH_BATCH; i++) {
+            if(write(fds[0], hello, len) != len ||
+                    parse_handshake(conn, &user, &game, token, &seen,
+                        &ruleSet, &mapStatus) != 1) {
+                fprintf(stderr, "parse_handshake failed\n");
+                exit(1);
+            }
+        }
+        ops += BENCH_BATCH;
+    } while((elapsed = bench_now() - start) < BENCH_SECONDS);
+    bench_report("parse_handshake", NULL, 0, ops, elapsed);
+
+    conn_close(conn);
+    close(fds[0]);
+    free(user);
+    free(game);
+}
+
+/*
+ * Looking up users in a list of size of them
+ */
+void bench_find_user(int size) {
+    User* head = NULL;
+    char id[80];
+    long long ops = 0;
+    double start, elapsed;
+
+    for(int i = 0; i < size; i++) {
+        sprintf(id, "user%d", i);
+        push_user(&head, id);
+    }
+    srandom(size);
+    start = bench_now();
+    do {
+        for(int i = 0; i < BENCH_BATCH; i++) {
+            sprintf(id, "user%ld", random() % size);
+            benchSink += find_user(id) != NULL;
+        }
+        ops += BENCH_BATCH;
+    } while((elapsed = bench_now() - start) < BENCH_SECONDS);
+    bench_report("find_user", "size", size, ops, elapsed);
+
+    while(head != NULL) {
+        User* next = head->next;
+        set_user(head->handle, NULL);
+        free_user(head);
+        head = next;
+    }
+    ladder_init(&ladder);   // Its nodes were in the users
+}
+
+/*
+ * Looking up games in a full table of size of them
+ */
+void bench_find_game(int size) {
+    GameTable table;
+    uint32_t* handles = (uint32_t *)malloc(sizeof(uint32_t) * size);
+    char id[80];
+    long long ops = 0;
+    double start, elapsed;
+
+    table_init(&table, size);
+    for(int i = 0; i < size; i++) {
+        sprintf(id, "game%d", i);
+        handles[i] = intern(id);
+        table_add(&table, handles[i], 0, 0);
+    }
+    srandom(size);
+    start = bench_now();
+    do {
+        for(int i = 0; i < BENCH_BATCH; i++) {
+            sprintf(id, "game%ld", random() % size);
+            benchSink += find_game(&table, id) != -1;
+        }
+        ops += BENCH_BATCH;
+    } while((elapsed = bench_now() - start) < BENCH_SECONDS);
+    bench_report("find_game", "size", size, ops, elapsed);
+
+    for(int i = 0; i < size; i++) {
+        intern_release(handles[i]);
+    }
+    free(handles);
+    table_free(&table);
+}
+
+/*
+ * What size games waiting for a second player take, and how fast they
+ * are made and removed
+ */
+void bench_game_memory(int size) {
+    char id[80];
+    RuleSet rules = {"standard", "", 0, 0, 0};
+    int* games = (int *)malloc(sizeof(int) * size);
+    size_t ids = intern_memory();
+    double start = bench_now();
+
+    maxGames = size;
+    table_init(&gameTable, size);
+    gameBytes = 0;
+    for(int i = 0; i < size; i++) {
+        sprintf(id, "game%d", i);
+        games[i] = push_game(&gameTable, id, &rules);
+    }
+    bench_report_bytes("game_memory", "size", size,
+            gameBytes + table_memory(&gameTable) + intern_memory() - ids,
+            size);
+    for(int i = 0; i < size; i++) {
+        remove_game(&gameTable, games[i]);
+    }
+    bench_report("push_remove_game", "size", size, size,
+            bench_now() - start);
+
+    free(games);
+    table_free(&gameTable);
+}
+
+/*
+ * Several threads logging at once
+ */
+#define LOG_LINES 20000     // Lines each thread logs
+
+void* log_lines(void* arg) {
+    for(int i = 0; i < LOG_LINES; i++) {
+        log_message(LOG_GOOD_CON, NULL, "alice", "g1", 0);
+    }
+    return NULL;
+}
+
+void bench_log_message(int threads) {
+    pthread_t ids[threads];
+    double start = bench_now();
+
+    for(int i = 0; i < threads; i++) {
+        pthread_create(&ids[i], NULL, log_lines, NULL);
+    }
+    for(int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    bench_report("log_message", "threads", threads,
+            (long long)threads * LOG_LINES, bench_now() - start);
+}
+
+int main(int argc, char* argv[]) {
+    int maxSize = 1000000;
+    if(argc > 2 || (argc == 2 && (sscanf(argv[1], "%d", &maxSize) != 1 ||
+            maxSize < 1))) {
+        fprintf(stderr, "Usage: benchServer [max_size]\n");
+        return 1;
+    }
+
+    bench_parse_handshake();
+    for(int size = 1000; size <= maxSize; size *= 10) {
+        bench_find_user(size);
+    }
+    for(int size = 1000; size <= maxSize; size *= 10) {
+        bench_find_game(size);
+    }
+    for(int size = 1000; size <= maxSize; size *= 10) {
+        bench_game_memory(size);
+    }
+
+    FILE* log = tmpfile();
+    log_message(0, log, NULL, NULL, 0);
+    pthread_mutex_init(&logMutex, NULL);
+    for(int threads = 1; threads <= 8; threads *= 2) {
+        bench_log_message(threads);
+    }
+    fclose(log);
+    return 0;
+}
@@ -0,0 +1,966 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
+
+#include "conn.h"
+#include "protocol.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+#ifdef IORING_RECV_MULTISHOT	// Kernel headers new enough for the backend
+#define HAVE_URING
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#endif
+
+#ifndef MSG_MORE
+#define MSG_MORE	0		// Not everywhere, pieces just go out alone
+#endif
+
+static bool uring = false;	// Using the io_uring backend
+static size_t memory = 0;	// Bytes every Conn holds, for stats
+
+static void count_memory(size_t before, size_t after) {
+	__atomic_add_fetch(&memory, after - before, __ATOMIC_RELAXED);
+}
+
+/* Input */
+
+/*
+ * Make room for another need bytes at the end of the input
+ */
+static void make_room(Conn* conn, size_t need) {
+	if(conn->inStart > 0) {
+		memmove(conn->in, conn->in + conn->inStart,
+				conn->inLen - conn->inStart);
+		conn->inLen -= conn->inStart;
+		conn->inStart = 0;
+	}
+	if(conn->inLen + need > conn->inSize) {
+		size_t before = conn->inSize;
+		while(conn->inLen + need > conn->inSize) {
+			conn->inSize *= 2;
+		}
+		conn->in = (char *)realloc(conn->in, conn->inSize);
+		count_memory(before, conn->inSize);
+	}
+}
+
+/*
+ * Copy the next line of input, as fgets would have read it, taking it
+ * off the input if take is set
+ * Returns false if there isn't a whole line yet
+ */
+static bool next_line(Conn* conn, char* line, size_t size, bool take) {
+	char* start = conn->in + conn->inStart;
+	size_t avail = conn->inLen - conn->inStart;
+	const char* newline = proto_find_newline(start, avail);
+	size_t len;
+
+	if(newline != NULL) {
+		len = newline - start + 1;
+	} else if(avail >= size - 1 || (conn->eof && avail > 0)) {
+		len = avail;
+	} else {
+		return false;
+	}
+	if(len > size - 1) {
+		len = size - 1;
+	}
+	memcpy(line, start, len);
+	line[len] = '\0';
+	if(take) {
+		conn->inStart += len;
+	}
+	return true;
+}
+
+/*
+ * Read whatever the socket has for us, blocking until something arrives
+ */
+static void read_more(Conn* conn) {
+	make_room(conn, CONN_BUF / 2);
+	ssize_t n = read(conn->fd, conn->in + conn->inLen,
+			conn->inSize - conn->inLen);
+	if(n > 0) {
+		conn->inLen += n;
+	} else if(n == 0 || errno != EINTR) {
+		conn->eof = true;
+	}
+}
+
+/* Output */
+
+/*
+ * Send all of data, waiting at most CONN_TIMEOUT for the peer each time
+ * the socket fills up. flags may add MSG_MORE.
+ * Returns false if that fails, in which case the socket is shut down
+ */
+static bool write_all(Conn* conn, const char* data, size_t len, int flags) {
+	size_t done = 0;
+
+	while(done < len && !conn->failed) {
+		ssize_t n = send(conn->fd, data + done, len - done,
+				MSG_DONTWAIT | flags);
+		if(n > 0) {
+			done += n;
+		} else if(n < 0 && errno == EINTR) {
+			continue;
+		} else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd out = {conn->fd, POLLOUT, 0};
+			if(poll(&out, 1, CONN_TIMEOUT * 1000) <= 0) {
+				conn->failed = true;
+			}
+		} else {
+			conn->failed = true;
+		}
+	}
+	if(conn->failed) {
+		shutdown(conn->fd, SHUT_RDWR);
+		return false;
+	}
+	return true;
+}
+
+/* io_uring backend */
+#ifdef HAVE_URING
+
+#define URING_ENTRIES	256		// Submission queue size
+#define RECV_BUFS		256		// Buffers shared by every recv, a power of two
+#define RECV_BUF_SIZE	2048
+#define RECV_GROUP		0		// Id the buffers are registered under
+
+/* What a completion is for, kept in the low bits of its user data */
+#define TAG_RECV	0	// Conn*
+#define TAG_SEND	1	// Conn*
+#define TAG_ACCEPT	2
+#define TAG_WAKE	3
+#define TAG_POKE	4	// Conn*, its handler is to be called
+#define TAG_OTHER	5	// Timeouts and cancels, nothing to do
+#define TAG_MASK	7
+
+#define LOAD(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/* The rings shared with the kernel */
+static int ringFd;
+static unsigned int* sqHead;
+static unsigned int* sqTail;
+static unsigned int sqMask;
+static unsigned int sqEntries;
+static struct io_uring_sqe* sqes;
+static unsigned int* cqHead;
+static unsigned int* cqTail;
+static unsigned int cqMask;
+static struct io_uring_cqe* cqes;
+
+/*
+ * Any thread may queue a request, only the I/O thread submits them and
+ * waits for them. Requests belong to the thread that submitted them, and
+ * the kernel cancels a thread's requests when it exits, so a game's
+ * thread must never submit another connection's recv.
+ */
+static pthread_mutex_t sqLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int unsubmitted = 0;	// Queued but not given to the kernel
+static struct io_uring_sqe* backlog = NULL;	// Queued while the ring was full
+static size_t nBacklog = 0;
+static size_t backlogSize = 0;
+static bool sleeping = false;	// I/O thread is waiting for completions
+static int wakeFd;				// Written to wake the I/O thread
+static uint64_t wakeValue;
+
+/* Buffers the kernel fills with whatever arrives on any connection */
+static struct io_uring_buf_ring* bufRing;
+static char* bufs;
+static unsigned short bufTail = 0;
+
+/* Connections accepted by the multishot accept */
+static pthread_mutex_t acceptLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t acceptCond = PTHREAD_COND_INITIALIZER;
+static int* accepted = NULL;	// Accepted but not yet picked up
+static size_t nAccepted = 0;
+static size_t acceptedSize = 0;
+static int listenFd = -1;
+
+static struct __kernel_timespec sendTimeout = {CONN_TIMEOUT, 0};
+
+static int enter(unsigned int toSubmit, unsigned int minComplete,
+		unsigned int flags) {
+	return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete,
+			flags, NULL, 0);
+}
+
+static void prep(struct io_uring_sqe* sqe, int op, int fd, uint64_t addr,
+		unsigned int len, uint64_t data) {
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = addr;
+	sqe->len = len;
+	sqe->user_data = data;
+}
+
+/*
+ * Queue n requests, sqLock must be held. Linked requests are queued
+ * together so they reach the kernel in the same submission. If the ring
+ * is full they wait in the backlog for the I/O thread to move them in.
+ */
+static void push_sqes(const struct io_uring_sqe* sqe, unsigned int n) {
+	unsigned int tail = *sqTail;
+
+	if(nBacklog == 0 && sqEntries - (tail - LOAD(sqHead)) >= n) {
+		for(unsigned int i = 0; i < n; i++) {
+			sqes[(tail + i) & sqMask] = sqe[i];
+		}
+		STORE(sqTail, tail + n);
+		unsubmitted += n;
+		return;
+	}
+	if(nBacklog + n > backlogSize) {
+		backlogSize = backlogSize ? backlogSize * 2 : 64;
+		while(nBacklog + n > backlogSize) {
+			backlogSize *= 2;
+		}
+		backlog = (struct io_uring_sqe *)realloc(backlog,
+				backlogSize * sizeof(*backlog));
+	}
+	memcpy(backlog + nBacklog, sqe, n * sizeof(*sqe));
+	nBacklog += n;
+}
+
+/*
+ * Move what the backlog holds into the ring as far as it has room, never
+ * splitting a linked pair. Only the I/O thread calls this, sqLock held.
+ */
+static void move_backlog(void) {
+	size_t moved = 0;
+
+	while(moved < nBacklog) {
+		unsigned int n = (backlog[moved].flags & IOSQE_IO_LINK) ? 2 : 1;
+		unsigned int tail = *sqTail;
+		if(sqEntries - (tail - LOAD(sqHead)) < n) {
+			break;
+		}
+		for(unsigned int i = 0; i < n; i++) {
+			sqes[(tail + i) & sqMask] = backlog[moved + i];
+		}
+		STORE(sqTail, tail + n);
+		unsubmitted += n;
+		moved += n;
+	}
+	memmove(backlog, backlog + moved, (nBacklog - moved) * sizeof(*backlog));
+	nBacklog -= moved;
+}
+
+/*
+ * Make sure the I/O thread submits what has been queued, sqLock must be
+ * held. If it is busy it will pick the requests up before it next waits.
+ */
+static void kick(void) {
+	if(sleeping) {
+		uint64_t one = 1;
+		sleeping = false;
+		if(write(wakeFd, &one, sizeof(one)) < 0) {
+			/* Counter is already set, it is awake anyway */
+		}
+	}
+}
+
+static void queue(const struct io_uring_sqe* sqe) {
+	pthread_mutex_lock(&sqLock);
+	push_sqes(sqe, 1);
+	kick();
+	pthread_mutex_unlock(&sqLock);
+}
+
+/*
+ * Hand a buffer back to the kernel, only the I/O thread may call this
+ */
+static void give_buffer(unsigned short bid) {
+	struct io_uring_buf* buf = &bufRing->bufs[bufTail & (RECV_BUFS - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(bufs + (size_t)bid * RECV_BUF_SIZE);
+	buf->len = RECV_BUF_SIZE;
+	buf->bid = bid;
+	bufTail++;
+	STORE(&bufRing->tail, bufTail);
+}
+
+static void start_recv(Conn* conn) {
+	struct io_uring_sqe sqe;
+	prep(&sqe, IORING_OP_RECV, conn->fd, 0, 0,
+			(uint64_t)(uintptr_t)conn | TAG_RECV);
+	sqe.flags = IOSQE_BUFFER_SELECT;
+	sqe.buf_group = RECV_GROUP;
+	sqe.ioprio = IORING_RECV_MULTISHOT;
+	conn->receiving = true;
+	queue(&sqe);
+}
+
+/*
+ * Send everything in out, conn->lock must be held
+ * The send is linked to a timeout so a peer that stops reading is cut off
+ */
+static void start_send(Conn* conn) {
+	struct io_uring_sqe sqe[2];
+
+	conn->busy = conn->out;
+	conn->busyLen = conn->outLen;
+	conn->busySize = conn->outSize;
+	conn->out = NULL;
+	conn->outLen = 0;
+	conn->outSize = 0;
+
+	prep(&sqe[0], IORING_OP_SEND, conn->fd, (uint64_t)(uintptr_t)conn->busy,
+			conn->busyLen, (uint64_t)(uintptr_t)conn | TAG_SEND);
+	sqe[0].msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+	sqe[0].flags = IOSQE_IO_LINK;
+	prep(&sqe[1], IORING_OP_LINK_TIMEOUT, -1,
+			(uint64_t)(uintptr_t)&sendTimeout, 1, TAG_OTHER);
+
+	pthread_mutex_lock(&sqLock);
+	push_sqes(sqe, 2);
+	kick();
+	pthread_mutex_unlock(&sqLock);
+}
+
+static void start_accept(void) {
+	struct io_uring_sqe sqe;
+	prep(&sqe, IORING_OP_ACCEPT, listenFd, 0, 0, TAG_ACCEPT);
+	sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+	queue(&sqe);
+}
+
+static void start_wake(void) {
+	struct io_uring_sqe sqe;
+	prep(&sqe, IORING_OP_READ, wakeFd, (uint64_t)(uintptr_t)&wakeValue,
+			sizeof(wakeValue), TAG_WAKE);
+	queue(&sqe);
+}
+
+/*
+ * Have the I/O thread call conn's handler once whether or not input
+ * arrives. The connection can't be released until it has.
+ */
+static void start_poke(Conn* conn) {
+	struct io_uring_sqe sqe;
+	prep(&sqe, IORING_OP_NOP, -1, 0, 0, (uint64_t)(uintptr_t)conn | TAG_POKE);
+	pthread_mutex_lock(&conn->lock);
+	conn->poked = true;
+	pthread_mutex_unlock(&conn->lock);
+	queue(&sqe);
+}
+
+/* Completions, all handled by the I/O thread */
+
+static void call_handler(Conn* conn, bool poke) {
+	pthread_mutex_lock(&conn->lock);
+	if(poke) {
+		conn->poked = false;
+		pthread_cond_broadcast(&conn->cond);
+	}
+	ConnHandler handler = conn->handler;
+	void* arg = conn->handlerArg;
+	pthread_mutex_unlock(&conn->lock);
+
+	if(handler != NULL) {
+		handler(conn, arg);
+	}
+}
+
+static void got_input(Conn* conn, int res, unsigned int flags) {
+	pthread_mutex_lock(&conn->lock);
+	if(res > 0) {
+		unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		make_room(conn, res);
+		memcpy(conn->in + conn->inLen, bufs + (size_t)bid * RECV_BUF_SIZE,
+				res);
+		conn->inLen += res;
+		give_buffer(bid);
+	}
+	if(!(flags & IORING_CQE_F_MORE)) {
+		if(!conn->eof && (res > 0 || res == -ENOBUFS)) {
+			start_recv(conn);	// Only stopped to catch its breath
+		} else {
+			conn->receiving = false;
+			conn->eof = true;
+		}
+	}
+	pthread_cond_broadcast(&conn->cond);
+	pthread_mutex_unlock(&conn->lock);
+	call_handler(conn, false);
+}
+
+static void sent_output(Conn* conn, int res) {
+	pthread_mutex_lock(&conn->lock);
+	if(res < 0 || (size_t)res < conn->busyLen) {
+		conn->failed = true;
+		shutdown(conn->fd, SHUT_RDWR);
+	}
+	free(conn->busy);
+	count_memory(conn->busySize, 0);
+	conn->busy = NULL;
+	if(conn->outLen > 0 && !conn->failed) {
+		start_send(conn);
+	}
+	pthread_cond_broadcast(&conn->cond);
+	pthread_mutex_unlock(&conn->lock);
+}
+
+static void got_connection(int res, unsigned int flags) {
+	pthread_mutex_lock(&acceptLock);
+	if(nAccepted == acceptedSize) {
+		acceptedSize = acceptedSize ? acceptedSize * 2 : 16;
+		accepted = (int *)realloc(accepted, acceptedSize * sizeof(int));
+	}
+	accepted[nAccepted++] = res;
+	if(!(flags & IORING_CQE_F_MORE) && res >= 0) {
+		start_accept();
+	}
+	pthread_cond_broadcast(&acceptCond);
+	pthread_mutex_unlock(&acceptLock);
+}
+
+static void reap(void) {
+	unsigned int head = *cqHead;
+
+	while(head != LOAD(cqTail)) {
+		struct io_uring_cqe* cqe = &cqes[head & cqMask];
+		uint64_t data = cqe->user_data;
+		int res = cqe->res;
+		unsigned int flags = cqe->flags;
+		STORE(cqHead, ++head);
+
+		Conn* conn = (Conn *)(uintptr_t)(data & ~(uint64_t)TAG_MASK);
+		switch(data & TAG_MASK) {
+			case TAG_RECV:
+				got_input(conn, res, flags);
+				break;
+			case TAG_SEND:
+				sent_output(conn, res);
+				break;
+			case TAG_ACCEPT:
+				got_connection(res, flags);
+				break;
+			case TAG_WAKE:
+				start_wake();
+				break;
+			case TAG_POKE:
+				call_handler(conn, true);
+				break;
+		}
+	}
+}
+
+static void* uring_thread(void* arg) {
+	while(1) {
+		pthread_mutex_lock(&sqLock);
+		move_backlog();
+		unsigned int n = unsubmitted;
+		bool more = nBacklog > 0;	// Submit, then come straight back
+		sleeping = !more;
+		pthread_mutex_unlock(&sqLock);
+
+		int done = enter(n, more ? 0 : 1, IORING_ENTER_GETEVENTS);
+
+		pthread_mutex_lock(&sqLock);
+		sleeping = false;
+		if(done > 0) {
+			unsubmitted -= done;
+		}
+		pthread_mutex_unlock(&sqLock);
+		reap();
+	}
+	return NULL;
+}
+
+static bool uring_setup(void) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	if((ringFd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+		return false;
+	}
+
+	/* Map the rings */
+	size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if(single) {
+		sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+	}
+	char* sq = (char *)mmap(NULL, sqSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+	char* cq = single ? sq : (char *)mmap(NULL, cqSize,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+			IORING_OFF_CQ_RING);
+	sqes = (struct io_uring_sqe *)mmap(NULL,
+			p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+	bufRing = (struct io_uring_buf_ring *)mmap(NULL,
+			RECV_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED ||
+			bufRing == MAP_FAILED) {
+		close(ringFd);
+		return false;
+	}
+	sqHead = (unsigned int *)(sq + p.sq_off.head);
+	sqTail = (unsigned int *)(sq + p.sq_off.tail);
+	sqMask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	sqEntries = p.sq_entries;
+	unsigned int* array = (unsigned int *)(sq + p.sq_off.array);
+	for(unsigned int i = 0; i < sqEntries; i++) {
+		array[i] = i;
+	}
+	cqHead = (unsigned int *)(cq + p.cq_off.head);
+	cqTail = (unsigned int *)(cq + p.cq_off.tail);
+	cqMask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* Register the buffers recvs pick from */
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+	reg.ring_entries = RECV_BUFS;
+	reg.bgid = RECV_GROUP;
+	if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING,
+				&reg, 1) < 0 || (wakeFd = eventfd(0, 0)) < 0) {
+		close(ringFd);
+		return false;
+	}
+	bufs = (char *)malloc((size_t)RECV_BUFS * RECV_BUF_SIZE);
+	for(unsigned int i = 0; i < RECV_BUFS; i++) {
+		give_buffer(i);
+	}
+
+	start_wake();
+	pthread_t thread;
+	pthread_create(&thread, NULL, uring_thread, NULL);
+	pthread_detach(thread);
+	return true;
+}
+
+static int uring_accept(int fdServer) {
+	pthread_mutex_lock(&acceptLock);
+	if(listenFd == -1) {
+		listenFd = fdServer;
+		start_accept();
+	}
+	while(nAccepted == 0) {
+		pthread_cond_wait(&acceptCond, &acceptLock);
+	}
+	int fd = accepted[0];
+	memmove(accepted, accepted + 1, --nAccepted * sizeof(int));
+	pthread_mutex_unlock(&acceptLock);
+	return fd;
+}
+
+/*
+ * Queue data, starting a send unless more is to follow straight away
+ */
+static bool uring_write(Conn* conn, const char* data, size_t len,
+		bool more) {
+	pthread_mutex_lock(&conn->lock);
+	if(conn->failed) {
+		pthread_mutex_unlock(&conn->lock);
+		return false;
+	}
+	if(conn->outLen + len > conn->outSize) {
+		size_t before = conn->outSize;
+		conn->outSize = conn->outSize ? conn->outSize : CONN_BUF;
+		while(conn->outLen + len > conn->outSize) {
+			conn->outSize *= 2;
+		}
+		conn->out = (char *)realloc(conn->out, conn->outSize);
+		count_memory(before, conn->outSize);
+	}
+	memcpy(conn->out + conn->outLen, data, len);
+	conn->outLen += len;
+	if(conn->busy == NULL && !more) {
+		start_send(conn);
+	}
+	pthread_mutex_unlock(&conn->lock);
+	return true;
+}
+
+/*
+ * Wait for output and any poke to finish and stop receiving
+ */
+static void uring_stop(Conn* conn) {
+	pthread_mutex_lock(&conn->lock);
+	while(conn->busy != NULL || conn->poked) {
+		pthread_cond_wait(&conn->cond, &conn->lock);
+	}
+	conn->eof = true;
+	if(conn->receiving) {
+		struct io_uring_sqe sqe;
+		prep(&sqe, IORING_OP_ASYNC_CANCEL, -1,
+				(uint64_t)(uintptr_t)conn | TAG_RECV, 0, TAG_OTHER);
+		queue(&sqe);
+		while(conn->receiving) {
+			pthread_cond_wait(&conn->cond, &conn->lock);
+		}
+	}
+	pthread_mutex_unlock(&conn->lock);
+}
+
+#endif
+
+/*
+ * Switch to the io_uring backend, before any connections are opened
+ * Returns false if it isn't available here
+ */
+bool conn_use_uring(void) {
+#ifdef HAVE_URING
+	uring = uring_setup();
+#endif
+	return uring;
+}
+
+/*
+ * Wait for the next connection to the listening socket
+ * Returns the new socket, negative on error
+ */
+int conn_accept(int fdServer) {
+#ifdef HAVE_URING
+	if(uring) {
+		return uring_accept(fdServer);
+	}
+#endif
+	int fd;
+	while((fd = accept(fdServer, NULL, NULL)) < 0 && errno == EINTR) {
+		continue;
+	}
+	return fd;
+}
+
+Conn* conn_open(int fd) {
+	Conn* conn = (Conn *)malloc(sizeof(Conn));
+
+	/* Every message is a short line the peer is waiting on, so none is
+	 * held back for Nagle. A socket pair has no Nagle to turn off. */
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	conn->fd = fd;
+	conn->inSize = CONN_BUF;
+	conn->in = (char *)malloc(conn->inSize);
+	conn->inStart = 0;
+	conn->inLen = 0;
+	conn->eof = false;
+	conn->failed = false;
+	pthread_mutex_init(&conn->lock, NULL);
+	pthread_cond_init(&conn->cond, NULL);
+	conn->receiving = false;
+	conn->out = NULL;
+	conn->outLen = 0;
+	conn->outSize = 0;
+	conn->busy = NULL;
+	conn->busyLen = 0;
+	conn->busySize = 0;
+	conn->handler = NULL;
+	conn->handlerArg = NULL;
+	conn->poked = false;
+	count_memory(0, sizeof(Conn) + conn->inSize);
+#ifdef HAVE_URING
+	if(uring) {
+		start_recv(conn);
+	}
+#endif
+	return conn;
+}
+
+/*
+ * Read a line (at most size - 1 characters) into line, like fgets
+ * Returns false once the connection has nothing more
+ */
+bool conn_read_line(Conn* conn, char* line, size_t size) {
+	bool got;
+
+	pthread_mutex_lock(&conn->lock);
+	while(!(got = next_line(conn, line, size, true)) && !conn->eof) {
+		if(uring) {
+			pthread_cond_wait(&conn->cond, &conn->lock);
+		} else {
+			read_more(conn);
+		}
+	}
+	pthread_mutex_unlock(&conn->lock);
+	return got;
+}
+
+/*
+ * Copy the next line (at most size - 1 characters) into line without
+ * waiting for one, taking it off the input if take is set. A line looked
+ * at without taking it is the same line the next call gets.
+ * Returns 1 if there was a line, 0 if there isn't a whole one yet and -1
+ * if the connection has nothing more
+ */
+int conn_next_line(Conn* conn, char* line, size_t size, bool take) {
+	int got;
+
+	pthread_mutex_lock(&conn->lock);
+	got = next_line(conn, line, size, take) ? 1 : conn->eof ? -1 : 0;
+	pthread_mutex_unlock(&conn->lock);
+	return got;
+}
+
+/*
+ * Have the I/O thread call handler(conn, arg) every time input arrives
+ * on conn, or ends, instead of a thread waiting for it. Handlers are only
+ * ever called by the I/O thread, so once one clears them no more calls
+ * follow. NULL stops them. Only the io_uring backend calls handlers.
+ */
+void conn_set_handler(Conn* conn, ConnHandler handler, void* arg) {
+	pthread_mutex_lock(&conn->lock);
+	conn->handler = handler;
+	conn->handlerArg = arg;
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/*
+ * Have the I/O thread call conn's handler soon whether or not input
+ * arrives, for what is there already or has changed elsewhere
+ */
+void conn_poke(Conn* conn) {
+#ifdef HAVE_URING
+	if(uring) {
+		start_poke(conn);
+	}
+#endif
+}
+
+/*
+ * Send len bytes of data. With io_uring this only queues them.
+ * Returns false if the connection has failed
+ */
+bool conn_write(Conn* conn, const char* data, size_t len) {
+#ifdef HAVE_URING
+	if(uring) {
+		return uring_write(conn, data, len, false);
+	}
+#endif
+	return write_all(conn, data, len, 0);
+}
+
+/*
+ * Send len bytes of data that another write will follow straight away,
+ * so the two can go out in the same packet. The last of a run of writes
+ * must be a conn_write, or this data may sit until the kernel gives up
+ * waiting for more.
+ * Returns false if the connection has failed
+ */
+bool conn_write_more(Conn* conn, const char* data, size_t len) {
+#ifdef HAVE_URING
+	if(uring) {
+		return uring_write(conn, data, len, true);
+	}
+#endif
+	return write_all(conn, data, len, MSG_MORE);
+}
+
+/*
+ * Hold partial packets back while corked, so what is written in the
+ * meantime goes out in as few packets as it fills. Uncorking sends what
+ * is left. Only TCP sockets on Linux can be corked.
+ */
+void conn_cork(Conn* conn, bool on) {
+#ifdef TCP_CORK
+	int value = on;
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+#endif
+}
+
+/*
+ * Finish with a connection but leave its socket open
+ * Any input not yet read is lost
+ */
+void conn_release(Conn* conn) {
+#ifdef HAVE_URING
+	if(uring) {
+		uring_stop(conn);
+	}
+#endif
+	pthread_mutex_destroy(&conn->lock);
+	pthread_cond_destroy(&conn->cond);
+	count_memory(sizeof(Conn) + conn->inSize + conn->outSize, 0);
+	free(conn->in);
+	free(conn->out);
+	free(conn);
+}
+
+void conn_close(Conn* conn) {
+	int fd = conn->fd;
+	conn_release(conn);
+	close(fd);
+}
+
+/*
+ * Returns the bytes held by every open Conn
+ */
+size_t conn_memory(void) {
+	return __atomic_load_n(&memory, __ATOMIC_RELAXED);
+}
+
+/* Handing sockets to other processes */
+
+/*
+ * Look at the first line waiting on fd without taking it. avail is set to
+ * the bytes waiting, so a caller can tell if more have come.
+ * Returns the length of the line, 0 if it isn't all there yet and -1 if
+ * it never will be: the peer has gone or the line is too long
+ */
+int conn_peek_line(int fd, char* line, size_t size, size_t* avail) {
+	ssize_t n = recv(fd, line, size - 1, MSG_PEEK | MSG_DONTWAIT);
+
+	*avail = 0;
+	if(n < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ?
+				0 : -1;
+	}
+	if(n == 0) {
+		return -1;
+	}
+	*avail = n;
+	const char* newline = proto_find_newline(line, n);
+	if(newline == NULL) {
+		return (size_t)n == size - 1 ? -1 : 0;
+	}
+	line[newline - line + 1] = '\0';
+	return newline - line + 1;
+}
+
+/*
+ * Throw away len bytes already known to be waiting on fd
+ */
+void conn_skip(int fd, size_t len) {
+	char buf[256];
+
+	while(len > 0) {
+		ssize_t n = recv(fd, buf, len < sizeof(buf) ? len : sizeof(buf), 0);
+		if(n <= 0 && errno != EINTR) {
+			return;
+		}
+		if(n > 0) {
+			len -= n;
+		}
+	}
+}
+
+/*
+ * Send data on fd only as far as it goes without waiting, for a process
+ * that can't be held up by one slow reader
+ * Returns false if it didn't all fit in the socket's buffer
+ */
+bool conn_write_now(int fd, const char* data, size_t len) {
+	while(len > 0) {
+		ssize_t n = send(fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(n > 0) {
+			data += n;
+			len -= n;
+		} else if(n < 0 && errno != EINTR) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Send len bytes of data as one message over a unix socket, with fd if it
+ * isn't -1, the receiver getting its own copy of fd
+ * Returns false if it couldn't be sent
+ */
+bool conn_send_msg(int channel, const void* data, size_t len, int fd) {
+	struct iovec iov = {(void *)data, len};
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if(fd >= 0) {
+		msg.msg_control = control.space;
+		msg.msg_controllen = sizeof(control.space);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	ssize_t n;
+	while((n = sendmsg(channel, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+		continue;
+	}
+	return n == (ssize_t)len;
+}
+
+/*
+ * Wait for a message sent by conn_send_msg, putting up to size bytes of
+ * it in data. fd is set to the socket it carried, -1 if none.
+ * Returns its length, 0 or less once the sender has gone
+ */
+ssize_t conn_recv_msg(int channel, void* data, size_t size, int* fd) {
+	struct iovec iov = {data, size};
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg;
+	ssize_t n;
+
+	do {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.space;
+		msg.msg_controllen = sizeof(control.space);
+	} while((n = recvmsg(channel, &msg, 0)) < 0 && errno == EINTR);
+
+	*fd = -1;
+	struct cmsghdr* cmsg = n >= 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_RIGHTS) {
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	return n;
+}
+
+/*
+ * Pass fd over a unix socket, the receiver getting its own copy
+ * Returns false if it couldn't be sent
+ */
+bool conn_send_fd(int channel, int fd) {
+	char byte = 0;
+	return conn_send_msg(channel, &byte, 1, fd);
+}
+
+/*
+ * Wait for a socket sent by conn_send_fd
+ * Returns it, -1 once the sender has gone
+ */
+int conn_recv_fd(int channel) {
+	char byte;
+	int fd;
+
+	while(conn_recv_msg(channel, &byte, 1, &fd) > 0) {
+		if(fd >= 0) {
+			return fd;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,86 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * Line based I/O on a connected socket.
+ *
+ * By default each call reads or writes the socket itself, blocking the
+ * calling thread. With the io_uring backend (Linux only, nserver -u) one
+ * thread does all the socket I/O for every game: connections come from a
+ * multishot accept, input arrives through a multishot recv into a ring
+ * of buffers shared by all connections, and output goes out as sends
+ * linked to a timeout. Whatever the threads queue while it is busy is
+ * handed to the kernel in a single io_uring_enter. A connection may also
+ * be given a handler, which the I/O thread calls as input arrives, so
+ * nothing has to wait on it at all.
+ *
+ * Sockets are opened with Nagle off, as every message is a short line
+ * the peer is waiting on. Where several messages go out together they
+ * are written with conn_write_more, or the socket corked around them,
+ * so they share packets instead.
+ *
+ * A preforked server (nserver -p) reads the first line of a connection
+ * without taking it off the socket, then passes the socket to the worker
+ * that will read it for real. A server handing over to a new one sends
+ * it sockets the same way, with a message saying what each is for.
+ */
+
+#define CONN_BUF		1024	// Initial size of the input buffer
+#define CONN_TIMEOUT	10		// Seconds a peer may leave output unread
+
+struct Conn;
+typedef void (*ConnHandler)(struct Conn* conn, void* arg);
+
+typedef struct Conn {
+	int fd;
+	char* in;				// Input not yet returned as lines
+	size_t inStart;			// Unread input is in[inStart .. inLen)
+	size_t inLen;
+	size_t inSize;
+	bool eof;				// No more input will arrive
+	bool failed;			// Output failed, the socket has been shut down
+
+	/* Only used by the io_uring backend */
+	pthread_mutex_t lock;	// Guards everything above
+	pthread_cond_t cond;	// Input arrived or a request finished
+	bool receiving;			// The recv is still running
+	char* out;				// Output waiting for the current send
+	size_t outLen;
+	size_t outSize;
+	char* busy;				// Output being sent, NULL if none
+	size_t busyLen;
+	size_t busySize;
+	ConnHandler handler;	// Called as input arrives, NULL if none
+	void* handlerArg;
+	bool poked;				// A call of the handler is on its way
+} Conn;
+
+bool conn_use_uring(void);
+int conn_accept(int fdServer);
+Conn* conn_open(int fd);
+bool conn_read_line(Conn* conn, char* line, size_t size);
+int conn_next_line(Conn* conn, char* line, size_t size, bool take);
+void conn_set_handler(Conn* conn, ConnHandler handler, void* arg);
+void conn_poke(Conn* conn);
+bool conn_write(Conn* conn, const char* data, size_t len);
+bool conn_write_more(Conn* conn, const char* data, size_t len);
+void conn_cork(Conn* conn, bool on);
+void conn_release(Conn* conn);
+void conn_close(Conn* conn);
+size_t conn_memory(void);
+
+/* Handing sockets to other processes */
+int conn_peek_line(int fd, char* line, size_t size, size_t* avail);
+void conn_skip(int fd, size_t len);
+bool conn_write_now(int fd, const char* data, size_t len);
+bool conn_send_fd(int channel, int fd);
+int conn_recv_fd(int channel);
+bool conn_send_msg(int channel, const void* data, size_t len, int fd);
+ssize_t conn_recv_msg(int channel, void* data, size_t size, int* fd);
+
+#endif
@@ -0,0 +1,202 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "intern.h"
+
+typedef struct Id {
+	char* name;					// NULL while the handle is free
+	uint32_t hash;
+	unsigned int refs;			// Holders
+	unsigned int nextFree;		// Free handle after this one, while free
+} Id;
+
+static Id* chunks[INTERN_CHUNKS];
+static unsigned int nextHandle = 1;	// First handle never given out
+static unsigned int freeHandles = INTERN_NONE;	// Given back, to reuse
+static uint32_t* slots = NULL;		// Handles by hash of id, 0 if empty
+static unsigned int mask = 0;		// Slots less one
+static unsigned int count = 0;		// Ids held
+static size_t bytes = 0;			// Chunks, slots and names
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_id(const char* id) {
+	uint32_t hash = 2166136261u;
+	for(; *id != '\0'; id++) {
+		hash ^= (unsigned char)*id;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static Id* get(unsigned int handle) {
+	Id* chunk = __atomic_load_n(&chunks[handle / INTERN_CHUNK],
+			__ATOMIC_ACQUIRE);
+	return &chunk[handle % INTERN_CHUNK];
+}
+
+/*
+ * Returns the slot holding id or, if it isn't held, the empty slot it
+ * would go in
+ */
+static unsigned int find_slot(const char* id, uint32_t hash) {
+	unsigned int slot = hash & mask;
+	for(; slots[slot] != INTERN_NONE; slot = (slot + 1) & mask) {
+		Id* held = get(slots[slot]);
+		if(held->hash == hash && strcmp(held->name, id) == 0) {
+			break;
+		}
+	}
+	return slot;
+}
+
+/*
+ * Double the slots, keeping at most half of them full
+ */
+static void grow(void) {
+	uint32_t* old = slots;
+	unsigned int oldSize = old ? mask + 1 : 0;
+	unsigned int size = old ? oldSize * 2 : 1024;
+
+	slots = (uint32_t *)calloc(size, sizeof(uint32_t));
+	mask = size - 1;
+	for(unsigned int i = 0; i < oldSize; i++) {
+		if(old[i] != INTERN_NONE) {
+			unsigned int slot = get(old[i])->hash & mask;
+			while(slots[slot] != INTERN_NONE) {
+				slot = (slot + 1) & mask;
+			}
+			slots[slot] = old[i];
+		}
+	}
+	free(old);
+	__atomic_store_n(&bytes, bytes + sizeof(uint32_t) * (size - oldSize),
+			__ATOMIC_RELAXED);
+}
+
+/*
+ * Returns a handle no one holds
+ */
+static unsigned int new_handle(void) {
+	unsigned int handle = freeHandles;
+	if(handle != INTERN_NONE) {
+		freeHandles = get(handle)->nextFree;
+		return handle;
+	}
+
+	/* Memory runs out long before handles do */
+	handle = nextHandle++;
+	if(chunks[handle / INTERN_CHUNK] == NULL) {
+		Id* chunk = (Id *)calloc(INTERN_CHUNK, sizeof(Id));
+		__atomic_store_n(&chunks[handle / INTERN_CHUNK], chunk,
+				__ATOMIC_RELEASE);
+		__atomic_store_n(&bytes, bytes + sizeof(Id) * INTERN_CHUNK,
+				__ATOMIC_RELAXED);
+	}
+	return handle;
+}
+
+/*
+ * Hold id, interning it if no one does yet
+ * Returns its handle
+ */
+unsigned int intern(const char* id) {
+	uint32_t hash = hash_id(id);
+
+	pthread_mutex_lock(&lock);
+	if(slots == NULL || 2 * (count + 1) > mask + 1) {
+		grow();
+	}
+	unsigned int slot = find_slot(id, hash);
+	unsigned int handle = slots[slot];
+	if(handle != INTERN_NONE) {
+		get(handle)->refs++;
+		pthread_mutex_unlock(&lock);
+		return handle;
+	}
+
+	handle = new_handle();
+	Id* fresh = get(handle);
+	size_t len = strlen(id) + 1;
+	fresh->name = (char *)malloc(len);
+	memcpy(fresh->name, id, len);
+	fresh->hash = hash;
+	fresh->refs = 1;
+	slots[slot] = handle;
+	count++;
+	__atomic_store_n(&bytes, bytes + len, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&lock);
+	return handle;
+}
+
+/*
+ * Returns the handle of id without holding it, INTERN_NONE if no one
+ * holds it. The handle can only be trusted while something that holds
+ * it can't let go.
+ */
+unsigned int intern_find(const char* id) {
+	uint32_t hash = hash_id(id);
+	unsigned int handle = INTERN_NONE;
+
+	pthread_mutex_lock(&lock);
+	if(slots != NULL) {
+		handle = slots[find_slot(id, hash)];
+	}
+	pthread_mutex_unlock(&lock);
+	return handle;
+}
+
+/*
+ * Let go of a handle, freeing the id if no one else holds it
+ */
+void intern_release(unsigned int handle) {
+	if(handle == INTERN_NONE) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	Id* held = get(handle);
+	if(--held->refs > 0) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	/* Take it out, shifting back whatever was probed past it */
+	unsigned int slot = held->hash & mask;
+	while(slots[slot] != handle) {
+		slot = (slot + 1) & mask;
+	}
+	unsigned int next = (slot + 1) & mask;
+	while(slots[next] != INTERN_NONE) {
+		unsigned int home = get(slots[next])->hash & mask;
+		if(((next - home) & mask) >= ((next - slot) & mask)) {
+			slots[slot] = slots[next];
+			slot = next;
+		}
+		next = (next + 1) & mask;
+	}
+	slots[slot] = INTERN_NONE;
+
+	__atomic_store_n(&bytes, bytes - (strlen(held->name) + 1),
+			__ATOMIC_RELAXED);
+	free(held->name);
+	held->name = NULL;
+	held->nextFree = freeHandles;
+	freeHandles = handle;
+	count--;
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Returns the id a held handle stands for
+ */
+const char* intern_name(unsigned int handle) {
+	return get(handle)->name;
+}
+
+/*
+ * Returns the bytes taken by interned ids
+ */
+size_t intern_memory(void) {
+	return __atomic_load_n(&bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,30 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+
+/*
+ * User and game ids as small numbers.
+ *
+ * An id is interned once, when a client names it, and is known by its
+ * handle from then on, so users and games are compared and indexed by
+ * handle rather than by string. Every holder of a handle counts itself
+ * in and lets go when it is done; the last out frees the id and its
+ * handle is given out again. The same string always has the same handle
+ * while anyone holds it, whether it names a user or a game.
+ *
+ * Ids are kept in chunks that never move, so a held id's name can be
+ * read without the lock. Interning and letting go take the lock.
+ */
+
+#define INTERN_CHUNK	4096	// Ids a chunk holds
+#define INTERN_CHUNKS	65536	// Most chunks, far more ids than fit in memory
+#define INTERN_NONE		0		// Never a handle
+
+unsigned int intern(const char* id);
+unsigned int intern_find(const char* id);
+void intern_release(unsigned int handle);
+const char* intern_name(unsigned int handle);
+size_t intern_memory(void);
+
+#endif
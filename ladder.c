@@ -0,0 +1,221 @@
+#include <string.h>
+#include <math.h>
+
+#include "ladder.h"
+
+static unsigned int size_of(const LadderNode* node) {
+	return node ? node->size : 0;
+}
+
+static void update(LadderNode* node) {
+	node->size = size_of(node->left) + 1 + size_of(node->right);
+}
+
+/*
+ * Returns true if a is ranked above b
+ */
+static int above(const LadderNode* a, const LadderNode* b) {
+	if(a->rating != b->rating) {
+		return a->rating > b->rating;
+	}
+	return strcmp(a->id, b->id) < 0;
+}
+
+/*
+ * Split tree into the nodes ranked above key and the rest
+ */
+static void split(LadderNode* tree, const LadderNode* key, LadderNode** high,
+		LadderNode** low) {
+	if(tree == NULL) {
+		*high = NULL;
+		*low = NULL;
+	} else if(above(tree, key)) {
+		split(tree->right, key, &tree->right, low);
+		update(tree);
+		*high = tree;
+	} else {
+		split(tree->left, key, high, &tree->left);
+		update(tree);
+		*low = tree;
+	}
+}
+
+/*
+ * Join two trees, every node of high being ranked above every node of low
+ */
+static LadderNode* merge(LadderNode* high, LadderNode* low) {
+	if(high == NULL) {
+		return low;
+	}
+	if(low == NULL) {
+		return high;
+	}
+	if(high->priority > low->priority) {
+		high->right = merge(high->right, low);
+		update(high);
+		return high;
+	}
+	low->left = merge(high, low->left);
+	update(low);
+	return low;
+}
+
+static LadderNode* insert(LadderNode* tree, LadderNode* node) {
+	if(tree == NULL) {
+		return node;
+	}
+	if(node->priority > tree->priority) {
+		split(tree, node, &node->left, &node->right);
+		update(node);
+		return node;
+	}
+	if(above(node, tree)) {
+		tree->left = insert(tree->left, node);
+	} else {
+		tree->right = insert(tree->right, node);
+	}
+	update(tree);
+	return tree;
+}
+
+static LadderNode* remove_node(LadderNode* tree, LadderNode* node) {
+	if(tree == NULL) {
+		return NULL;
+	}
+	if(tree == node) {
+		return merge(tree->left, tree->right);
+	}
+	if(above(node, tree)) {
+		tree->left = remove_node(tree->left, node);
+	} else {
+		tree->right = remove_node(tree->right, node);
+	}
+	update(tree);
+	return tree;
+}
+
+void ladder_init(Ladder* ladder) {
+	ladder->root = NULL;
+	ladder->seed = 2463534242u;
+}
+
+/*
+ * Rank a new player. id must outlive their place on the ladder.
+ */
+void ladder_insert(Ladder* ladder, LadderNode* node, const char* id,
+		int rating) {
+	/* xorshift, good enough to keep the tree shallow */
+	ladder->seed ^= ladder->seed << 13;
+	ladder->seed ^= ladder->seed >> 17;
+	ladder->seed ^= ladder->seed << 5;
+
+	node->left = NULL;
+	node->right = NULL;
+	node->priority = ladder->seed;
+	node->size = 1;
+	node->rating = rating;
+	node->id = id;
+	ladder->root = insert(ladder->root, node);
+}
+
+void ladder_remove(Ladder* ladder, LadderNode* node) {
+	ladder->root = remove_node(ladder->root, node);
+}
+
+/*
+ * Move a player to wherever rating puts them
+ */
+void ladder_set_rating(Ladder* ladder, LadderNode* node, int rating) {
+	ladder_remove(ladder, node);
+	ladder_insert(ladder, node, node->id, rating);
+}
+
+/*
+ * Returns the points a player rated winner takes from one rated loser by
+ * beating them, more the less they were expected to win
+ */
+int elo_change(int winner, int loser) {
+	double expected = 1.0 / (1.0 + pow(10.0, (loser - winner) / 400.0));
+	return (int)floor(ELO_K * (1.0 - expected) + 0.5);
+}
+
+/*
+ * Rate a game. The winner gains what the loser loses.
+ */
+void ladder_result(Ladder* ladder, LadderNode* winner, LadderNode* loser) {
+	int change = elo_change(winner->rating, loser->rating);
+
+	ladder_set_rating(ladder, winner, winner->rating + change);
+	ladder_set_rating(ladder, loser, loser->rating - change);
+}
+
+/* Queries */
+
+unsigned int ladder_size(const Ladder* ladder) {
+	return size_of(ladder->root);
+}
+
+/*
+ * Returns node's place, 1 for the top, 0 if it isn't on the ladder
+ */
+unsigned int ladder_rank(const Ladder* ladder, const LadderNode* node) {
+	unsigned int rank = 0;
+	const LadderNode* tree = ladder->root;
+
+	while(tree != NULL) {
+		if(tree == node) {
+			return rank + size_of(tree->left) + 1;
+		}
+		if(above(node, tree)) {
+			tree = tree->left;
+		} else {
+			rank += size_of(tree->left) + 1;
+			tree = tree->right;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns the player in place n, 1 for the top, NULL if there isn't one
+ */
+LadderNode* ladder_nth(const Ladder* ladder, unsigned int n) {
+	LadderNode* tree = ladder->root;
+
+	while(tree != NULL) {
+		unsigned int left = size_of(tree->left);
+		if(n == left + 1) {
+			return tree;
+		}
+		if(n <= left) {
+			tree = tree->left;
+		} else {
+			n -= left + 1;
+			tree = tree->right;
+		}
+	}
+	return NULL;
+}
+
+static void collect(LadderNode* tree, LadderNode** out, unsigned int k,
+		unsigned int* got) {
+	if(tree == NULL || *got == k) {
+		return;
+	}
+	collect(tree->left, out, k, got);
+	if(*got < k) {
+		out[(*got)++] = tree;
+	}
+	collect(tree->right, out, k, got);
+}
+
+/*
+ * Put the top k players in out, best first
+ * Returns how many there were, fewer than k if the ladder is short
+ */
+unsigned int ladder_top(const Ladder* ladder, LadderNode** out,
+		unsigned int k) {
+	unsigned int got = 0;
+	collect(ladder->root, out, k, &got);
+	return got;
+}
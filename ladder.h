@@ -0,0 +1,48 @@
+#ifndef LADDER_H
+#define LADDER_H
+
+/*
+ * Players ranked by Elo rating.
+ *
+ * The ladder is a treap ordered by rating, highest first, then by id.
+ * Every node counts the nodes below it, so a player's place and the
+ * player in any place are found in O(log n) expected, and the top k in
+ * O(k + log n), however many players there are. Nodes are kept inside
+ * whatever they rank, so the ladder never allocates.
+ *
+ * The ladder has no lock of its own, callers share one.
+ */
+
+#define ELO_START	1500	// Rating of a new player
+#define ELO_K		32		// Most a rating moves in one game
+
+typedef struct LadderNode {
+	struct LadderNode* left;	// Ranked above
+	struct LadderNode* right;	// Ranked below
+	unsigned int priority;		// Heap order, keeps the tree balanced
+	unsigned int size;			// Nodes in this subtree, itself included
+	int rating;
+	const char* id;				// Breaks ties, must not change while ranked
+} LadderNode;
+
+typedef struct Ladder {
+	LadderNode* root;
+	unsigned int seed;			// For priorities
+} Ladder;
+
+void ladder_init(Ladder* ladder);
+void ladder_insert(Ladder* ladder, LadderNode* node, const char* id,
+		int rating);
+void ladder_remove(Ladder* ladder, LadderNode* node);
+void ladder_set_rating(Ladder* ladder, LadderNode* node, int rating);
+void ladder_result(Ladder* ladder, LadderNode* winner, LadderNode* loser);
+int elo_change(int winner, int loser);
+
+/* Queries */
+unsigned int ladder_size(const Ladder* ladder);
+unsigned int ladder_rank(const Ladder* ladder, const LadderNode* node);
+LadderNode* ladder_nth(const Ladder* ladder, unsigned int n);
+unsigned int ladder_top(const Ladder* ladder, LadderNode** out,
+		unsigned int k);
+
+#endif
@@ -0,0 +1,127 @@
+#include <stdint.h>
+#include <time.h>
+
+#include "limit.h"
+
+#define LOAD(p)			__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v)		__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ADD(p, v)		__atomic_add_fetch(p, v, __ATOMIC_RELAXED)
+#define CAS(p, old, v)	__atomic_compare_exchange_n(p, old, v, false, \
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+typedef struct Bucket {
+	uint64_t key;			// Hash of the address, 0 if never used
+	uint64_t full;			// When the bucket is full again, in ns
+	unsigned int refused;	// Connections refused since it was last full
+} Bucket;
+
+static Bucket buckets[LIMIT_SLOTS];
+static uint64_t interval;	// ns for a token to come back
+static uint64_t tolerance;	// Furthest full may be ahead with a token left
+static unsigned long admitted, refused, untracked;
+
+static uint64_t now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+static uint64_t hash_addr(const unsigned char* addr, size_t len) {
+	uint64_t hash = 14695981039346656037u;
+	for(size_t i = 0; i < len; i++) {
+		hash ^= addr[i];
+		hash *= 1099511628211u;
+	}
+	return hash ? hash : 1;
+}
+
+/*
+ * Allow rate connections a second from each address, and up to burst at
+ * once. Returns false if they make no sense.
+ */
+bool limit_init(double rate, unsigned int burst) {
+	if(!(rate > 0) || rate > 1e9 || burst < 1) {
+		return false;
+	}
+	interval = (uint64_t)(1e9 / rate);
+	tolerance = interval * (burst - 1);
+	return true;
+}
+
+/*
+ * Returns the bucket for key, taking a full one if it hasn't got one,
+ * NULL if there is none to take
+ */
+static Bucket* find_bucket(uint64_t key, uint64_t now) {
+	for(int probe = 0; probe < LIMIT_PROBES; probe++) {
+		Bucket* bucket = &buckets[(key + probe) & (LIMIT_SLOTS - 1)];
+		if(LOAD(&bucket->key) == key) {
+			return bucket;
+		}
+	}
+
+	/*
+	 * Its old owner may take a token between the check and the swap, in
+	 * which case the new one starts a token short. Near enough.
+	 */
+	for(int probe = 0; probe < LIMIT_PROBES; probe++) {
+		Bucket* bucket = &buckets[(key + probe) & (LIMIT_SLOTS - 1)];
+		uint64_t old = LOAD(&bucket->key);
+		if(old == key) {
+			return bucket;	// Taken for key by someone else
+		}
+		if((old == 0 || LOAD(&bucket->full) <= now) &&
+				CAS(&bucket->key, &old, key)) {
+			STORE(&bucket->refused, 0);
+			return bucket;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take a token for a connection from the len byte address addr. first is
+ * set if this is the address's first refusal since its bucket was full.
+ * Returns false if the connection should be refused
+ */
+bool limit_admit(const void* addr, size_t len, bool* first) {
+	uint64_t now = now_ns();
+	Bucket* bucket = find_bucket(hash_addr(addr, len), now);
+	uint64_t full, from;
+
+	*first = false;
+	if(bucket == NULL) {
+		ADD(&untracked, 1);
+		ADD(&admitted, 1);
+		return true;
+	}
+	full = LOAD(&bucket->full);
+	do {
+		from = full > now ? full : now;
+		if(from - now > tolerance) {
+			*first = ADD(&bucket->refused, 1) == 1;
+			ADD(&refused, 1);
+			return false;
+		}
+	} while(!CAS(&bucket->full, &full, from + interval));
+
+	if(full <= now) {
+		STORE(&bucket->refused, 0);
+	}
+	ADD(&admitted, 1);
+	return true;
+}
+
+void limit_stats(LimitStats* stats) {
+	uint64_t now = now_ns();
+
+	stats->admitted = LOAD(&admitted);
+	stats->refused = LOAD(&refused);
+	stats->untracked = LOAD(&untracked);
+	stats->limited = 0;
+	for(int i = 0; i < LIMIT_SLOTS; i++) {
+		if(LOAD(&buckets[i].refused) > 0 && LOAD(&buckets[i].full) > now) {
+			stats->limited++;
+		}
+	}
+}
@@ -0,0 +1,36 @@
+#ifndef LIMIT_H
+#define LIMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Connection rate limits per source address (nserver -l).
+ *
+ * Every address has a token bucket. A connection takes a token, tokens
+ * come back at rate a second up to burst, and a connection that finds
+ * the bucket empty is refused. A bucket is kept as the time at which it
+ * will be full again, so taking a token is one compare and swap and the
+ * table needs no lock.
+ *
+ * Buckets live in a fixed table found by a hash of the address. A full
+ * bucket is no different from a new one, so its slot can be taken by any
+ * address. An address that finds no slot is let in.
+ */
+
+#define LIMIT_SLOTS		4096	// Buckets, a power of two
+#define LIMIT_PROBES	16		// Slots an address may use
+#define LIMIT_BURST		8		// Burst when none is given
+
+typedef struct LimitStats {
+	unsigned long admitted;
+	unsigned long refused;
+	unsigned long untracked;	// Let in for want of a slot
+	unsigned int limited;		// Addresses refused since last full
+} LimitStats;
+
+bool limit_init(double rate, unsigned int burst);
+bool limit_admit(const void* addr, size_t len, bool* first);
+void limit_stats(LimitStats* stats);
+
+#endif
@@ -3,12 +3,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+/* Terminal */
+#include <sys/ioctl.h>
 
 /* Networking */
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
+/* Messages */
+#include "protocol.h"
+
+/* Tracing moves */
+#include "trace.h"
+
+/* Automated players */
+#include "strategy.h"
+
 typedef enum {
 	OK = 0,         // USE
 	BAD_CMD = 10,   // USE
@@ -48,6 +66,73 @@ typedef struct {
 	Ship **ships;			// Details of each ship
 } Board;
 
+typedef struct {
+	unsigned int height;	// Height of the grids
+	unsigned int width;		// Width of the grids
+	unsigned int nShips;	// How many ships are in the game
+	unsigned int *lengths;	// Length of each ship
+} Rules;
+
+typedef struct {
+	char *frame;			// Preallocated output buffer for one frame
+	size_t size;			// Capacity of frame
+	char *shown;			// Both grids as they were last drawn
+	int tty;				// Draw changed rows only using ANSI escapes
+	int drawn;				// A full frame is already on the screen
+	int quiet;				// Draw nothing at all (for bots)
+} View;
+
+/*
+ * Constants
+ */
+#define SHORT_LEN 20	// Max length of an input line
+#define TOKEN_LEN 16	// Hex digits in a resume token
+#define OUTBOX_SIZE 16	// Messages kept in case they must be sent again
+#define RESUME_TRIES 10	// Seconds to keep trying to resume
+#define HASH_LEN 16		// Hex digits in a rules hash
+#define PATH_LEN 1024	// Longest path into the rules cache
+#define SIDE_MAX 10000	// Widest or tallest board the rules may give
+#define SHIPS_MAX 100	// Most ships the rules may give
+
+typedef struct {
+	LineReader get;			// Server output
+	FILE *send;				// Server input
+	int port;				// Where the server is
+	int tag;				// Frames are tagged with it, -1 if not sharing
+	char token[TOKEN_LEN + 1];	// Quoted to resume after dropping out
+	unsigned int received;	// Messages received since the token
+	unsigned int sent;		// Messages sent since the token
+	char outbox[OUTBOX_SIZE][80];	// Last messages sent
+} Conn;
+
+/*
+** How guesses are picked when nobody is asked for them
+*/
+typedef struct {
+	int kind;				// Strategy (see strategy.h), -1 to ask the user
+	unsigned int budget;	// Milliseconds a guess may take
+	unsigned int threads;	// Threads a guess may use
+} Picker;
+
+/*
+** One of many games played over a single connection (--games). Each
+** is a channel of its own, so they don't wait on each other.
+*/
+typedef struct {
+	Conn conn;				// Sends on the shared socket, tagged
+	char game[80];			// Game id
+	Board b;
+	int haveBoard;			// b is allocated
+	char hash[HASH_LEN + 1];	// Names the rules b was laid out by
+	FILE *rules;			// Rules still arriving, NULL if none are
+	int resuming;			// Waiting to hear if $resume worked
+	Strategy strategy;		// Picks the guesses
+	int haveStrategy;		// strategy is started
+	ErrCond result;			// OK while the game is on
+} Match;
+
+#define GAMES_MAX 256	// Games one connection may carry
+
 /*
  * Return the name corresponding to the error condition c
  */
@@ -57,7 +142,7 @@ const char* get_str(ErrCond c)
 		case OK:
 		    return "";
 		case BAD_CMD:
-		    return "Usage: nclient id game map port\n";
+		    return "Usage: nclient [--quiet] [--trace file] [--cache dir] [--rules name] [--games n [--batch us]] [--strategy name [--budget ms] [--threads n]] id game map port\n";
         case BAD_PARAM:
             return "I: Param error.\n";
 		case NO_MAP:
@@ -90,11 +175,6 @@ const char* get_str(ErrCond c)
 #define MAP(S, y, x) S->width * y + x
 #define INRANGE(S, y, x) ((x < S->width) && (y < S->height))
 
-/*
- * Constants
- */
-#define SHORT_LEN 20	// Max length of an input line
-
 /* 
 ** Read a line from the file f.
 ** Do not free the memory returned from this function.
@@ -126,27 +206,104 @@ const char* get_short_line(FILE* f)
 }
     
 /*
-** For debug purposes only 
-** Prints both boards in b to the screen.
+** Allocates the frame buffer for drawing b.
+** Rows are only redrawn in place when stdout is a terminal big enough
+** to hold both boards, otherwise every frame is written out in full.
 */
-void show_boards(Board* b)
+void alloc_view(View* v, Board* b, int quiet)
 {
-    int i, j;
-    
-	for (i = 0; i < b->height; ++i) {
-		for (j = 0; j < b->width; ++j) {
-		    printf("%c", b->hidden[MAP(b, i, j)]);
-		}
-		printf("\n");
+    struct winsize ws;
+    size_t cells = (size_t)b->height * b->width;
+
+    v->quiet = quiet;
+    v->drawn = 0;
+    v->tty = isatty(STDOUT_FILENO);
+    if (v->tty && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 &&
+            ws.ws_row < b->height * 2 + 2) {
+		v->tty = 0;	/* won't fit, so cursor positioning is useless */
     }
-    printf("\n");
-    
-	for (i = 0; i < b->height; ++i) {
-		for (j = 0; j < b->width; ++j) {
-		    printf("%c", b->guess[MAP(b, i, j)]);
+
+	/* Worst case is every row redrawn, each with a cursor move */
+    v->size = 2 * (size_t)b->height * (b->width + 16) + 32;
+    v->frame = (char*)malloc(v->size);
+    v->shown = (char*)malloc(2 * cells);
+}
+
+/*
+** Frees all memory associated with v.
+*/
+void dealloc_view(View* v)
+{
+    free(v->frame);
+    free(v->shown);
+}
+
+/*
+** Appends row y of grid to the frame at position len.
+** Returns the new length of the frame.
+*/
+size_t put_row(char* frame, size_t len, Board* b, const char* grid,
+        unsigned int y)
+{
+    memcpy(frame + len, grid + MAP(b, y, 0), b->width);
+    len += b->width;
+    frame[len++] = '\n';
+    return len;
+}
+
+/*
+** Prints both boards in b to the screen with a single write.
+** After the first frame on a terminal, only rows that differ from
+** what is already on the screen are redrawn.
+*/
+void show_boards(View* v, Board* b)
+{
+    unsigned int i;
+    size_t len = 0;
+    size_t cells = (size_t)b->height * b->width;
+    const char* grid[2] = {b->hidden, b->guess};
+
+    if (v->quiet) {
+		return;
+    }
+
+    if (!v->tty || !v->drawn) {
+		if (v->tty) {
+		    memcpy(v->frame, "\033[H\033[2J", 7);	/* home and clear */
+		    len = 7;
 		}
-		printf("\n");
+		for (i = 0; i < b->height; ++i) {
+		    len = put_row(v->frame, len, b, b->hidden, i);
+		}
+		v->frame[len++] = '\n';
+		for (i = 0; i < b->height; ++i) {
+		    len = put_row(v->frame, len, b, b->guess, i);
+		}
+		v->drawn = 1;
+    } else {
+		unsigned int g, row = 1;
+		for (g = 0; g < 2; ++g) {
+		    const char* shown = v->shown + g * cells;
+		    for (i = 0; i < b->height; ++i, ++row) {
+				if (memcmp(shown + MAP(b, i, 0), grid[g] + MAP(b, i, 0),
+						b->width) != 0) {
+				    len += sprintf(v->frame + len, "\033[%u;1H", row);
+				    len = put_row(v->frame, len, b, grid[g], i);
+				}
+		    }
+		    if (g == 0) {
+				row++;	/* blank line between the boards */
+		    }
+		}
+		/* Back to the prompt line, under the last grid as in a full
+		 * frame, and clear the old input */
+		len += sprintf(v->frame + len, "\033[%u;1H\033[J", row);
     }
+    memcpy(v->shown, b->hidden, cells);
+    memcpy(v->shown + cells, b->guess, cells);
+
+    fwrite(v->frame, 1, len, stdout);
+    fflush(stdout);
 }
 
 /*
@@ -212,23 +369,26 @@ ErrCond stamp_ship(Board* b, Ship* s, char orientation, int xPos, int yPos)
 }
 
 /*
-** Prompts the user for a guess (which is returned via
-** reference params x, y).
+** Asks the user for a guess, unless quiet is set.
+*/
+void prompt_guess(int quiet)
+{
+    if (!quiet) {
+		printf("(x,y)>");
+		fflush(stdout);
+    }
+}
+
+/*
+** Reads the guess in line, a whole line from the user (which is returned
+** via reference params x, y).
 ** Returns 1 on success, 0 otherwise
 */
-int read_guess(Board* b, unsigned int* x, unsigned int* y)
+int read_guess(Board* b, const char* line, unsigned int* x, unsigned int* y)
 {
     int res;
-    const char* line;
     char dummy;
     
-	printf("(x,y)>");
-    
-	line=get_short_line(stdin);
-    if (line==0) {
-		return 0;	/* hit eof or a long line */
-    }
-    
 	res = sscanf(line, "%u %u%c", x, y, &dummy);	/* no trailing chars */
     if ((res != 3) || (dummy != '\n')) {
 		return 0;
@@ -240,29 +400,17 @@ int read_guess(Board* b, unsigned int* x, unsigned int* y)
     return 1;
 }
 
-/* 
-** Takes a Board which has been allocated and populated its fields
-** from the file describing the rules for the game and the map file
-** describing the position of the ships.
-** Returns error code or OK
-** Note: This function is set up so that either things are completely
-** allocated or not at all
-** if error returned... no need to dealloc (not even the board).
+/*
+** Reads the file describing the rules for the game into r.
+** Returns error code or OK, in which case nothing needs freeing.
 */
-ErrCond alloc_board(Board* b, FILE* rules, FILE* map) {
+ErrCond parse_rules(Rules* r, FILE* rules)
+{
     unsigned int h, w, n;   /* height, width and number of ships */
     unsigned int i, j;    /* loop counters */
     const char *line;
     char dummy;
     int res;
-    char id = 'a';     /* starting point for ids */
-    
-	b->hidden = 0;     /* ensure that even if we exit we have sane object */
-    b->guess = 0;
-    b->height = 0;
-    b->width = 0;
-    b->nShips = 0;
-    b->ships = 0;
 
     line = get_short_line(rules);
     if (line == 0) {
@@ -280,44 +428,69 @@ ErrCond alloc_board(Board* b, FILE* rules, FILE* map) {
 		return BAD_RULES;
     }
 
-    if ((h < 1) || (w < 1) || (n < 1))
+    if ((h < 1) || (w < 1) || (n < 1) || (h > SIDE_MAX) ||
+	    (w > SIDE_MAX) || (n > SHIPS_MAX))
     {
 		return BAD_RULES;
     }
+
+    r->height = h;
+    r->width = w;
+    r->nShips = n;
+    r->lengths = (unsigned int*)malloc(sizeof(unsigned int) * n);
+	for (i = 0; i < n; ++i) {	/* For each ship */
+		line = get_short_line(rules);
 	
+		/* Find out how long the ship is */
+		if ((line == 0) || (sscanf(line, "%u", &j) == 0)) {	
+			free(r->lengths);
+			return BAD_RULES;
+		}
+		r->lengths[i] = j;
+    }
+    return OK;
+}
+
+/*
+** Frees all memory associated with r.
+*/
+void dealloc_rules(Rules* r)
+{
+    free(r->lengths);
+}
+
+/* 
+** Takes a Board which has been allocated and populated its fields
+** from the rules for the game and the map file describing the position
+** of the ships.
+** Returns error code or OK
+** Note: This function is set up so that either things are completely
+** allocated or not at all
+** if error returned... no need to dealloc (not even the board).
+*/
+ErrCond alloc_board(Board* b, const Rules* r, FILE* map) {
+    unsigned int h = r->height, w = r->width, n = r->nShips;
+    unsigned int i;    /* loop counter */
+    const char *line;
+    char id = 'a';     /* starting point for ids */
+    
 	/* blank both boards with . */
     b->hidden = (char*)malloc(sizeof(char) * h * w);
-    for (i = 0; i < h * w; ++i) {
-		b->hidden[i] = '.';
-    }
+    memset(b->hidden, '.', (size_t)h * w);
 
     b->guess = (char*)malloc(sizeof(char) * h * w);
-    for (i = 0; i < h * w; ++i) {
-		b->guess[i] = '.';
-    }
+    memset(b->guess, '.', (size_t)h * w);
 
     b->height = h;
     b->width = w;
     b->nShips = n;
     
 	b->ships=(Ship**)malloc(sizeof(Ship*) * n);
-    for (i = 0; i < n; ++i) {
-		b->ships[i] = 0;	/* So we know what to dealloc later */
-    }
-    
 	for (i = 0; i < n; ++i) {	/* For each ship */
 		b->ships[i] = (Ship*)malloc(sizeof(Ship));
-		line = get_short_line(rules);
-	
-		/* Find out how long the ship is */
-		if ((line == 0) || (sscanf(line, "%u", &j) == 0)) {	
-			dealloc_board(b);
-			return BAD_RULES;
-		}
-
 		b->ships[i]->id = id;
-		b->ships[i]->length = j;
-		b->ships[i]->lives = j;
+		b->ships[i]->length = r->lengths[i];
+		b->ships[i]->lives = r->lengths[i];
 		id++;
     }
     b->alive = b->nShips;
@@ -346,7 +519,84 @@ ErrCond alloc_board(Board* b, FILE* rules, FILE* map) {
 }
 
 int parse_cmd_line(int argc, char* argv[], char** idC, char** idG, FILE** map, 
-        int* port) {
+        int* port, int* quiet, char** tracePath, char** cacheDir,
+        char** ruleName, int* games, int* batch, Picker* picker) {
+    /* Optional --quiet, --trace file, --cache dir, --rules name,
+     * --games n, --batch us, --strategy name, --budget ms and
+     * --threads n before the positional params */
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    picker->kind = -1;
+    picker->budget = STRATEGY_BUDGET;
+    picker->threads = cpus > 0 ? cpus : 1;
+    *quiet = 0;
+    *tracePath = NULL;
+    *cacheDir = NULL;
+    *ruleName = NULL;
+    *games = 0;
+    *batch = 0;
+    while (argc > 1) {
+        if (strcmp(argv[1], "--quiet") == 0) {
+            *quiet = 1;
+        } else if (strcmp(argv[1], "--games") == 0 && argc > 2) {
+            if (sscanf(argv[2], "%d", games) != 1 || *games < 1 ||
+                    *games > GAMES_MAX) {
+                printf("%s", get_str(BAD_PARAM));
+                return BAD_PARAM;
+            }
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--batch") == 0 && argc > 2) {
+            if (sscanf(argv[2], "%d", batch) != 1 || *batch < 0 ||
+                    *batch >= 1000000) {
+                printf("%s", get_str(BAD_PARAM));
+                return BAD_PARAM;
+            }
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--strategy") == 0 && argc > 2) {
+            if ((picker->kind = strategy_find(argv[2])) < 0) {
+                printf("%s", get_str(BAD_PARAM));
+                return BAD_PARAM;
+            }
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--budget") == 0 && argc > 2) {
+            if (sscanf(argv[2], "%u", &picker->budget) != 1 ||
+                    picker->budget < 1 || picker->budget > 60000) {
+                printf("%s", get_str(BAD_PARAM));
+                return BAD_PARAM;
+            }
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--threads") == 0 && argc > 2) {
+            if (sscanf(argv[2], "%u", &picker->threads) != 1 ||
+                    picker->threads < 1 ||
+                    picker->threads > STRATEGY_THREADS) {
+                printf("%s", get_str(BAD_PARAM));
+                return BAD_PARAM;
+            }
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--trace") == 0 && argc > 2) {
+            *tracePath = argv[2];
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--cache") == 0 && argc > 2) {
+            *cacheDir = argv[2];
+            argc--;
+            argv++;
+        } else if (strcmp(argv[1], "--rules") == 0 && argc > 2 &&
+                strpbrk(argv[2], " /") == NULL) {
+            *ruleName = argv[2];
+            argc--;
+            argv++;
+        } else {
+            break;
+        }
+        argc--;
+        argv++;
+    }
+
     /* 5 and only 5 params */
     if (argc < 5 || argc > 5) {
 		printf("%s", get_str(BAD_CMD));
@@ -377,10 +627,14 @@ int parse_cmd_line(int argc, char* argv[], char** idC, char** idG, FILE** map,
     return 0;
 }
 
-int connect_to_server(int* fd, int port) {
-    if((*fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        printf("%s", get_str(CONN_REF));
-        return CONN_REF;
+/*
+** Open a connection to the server.
+** Returns the socket, -1 on failure
+*/
+int open_connection(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+        return -1;
     }
 
     struct sockaddr_in servaddr;    // Address info of server
@@ -388,7 +642,19 @@ int connect_to_server(int* fd, int port) {
     servaddr.sin_port = htons(port);
     inet_aton("127.0.0.1", &servaddr.sin_addr);
 
-    if(connect(*fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+    if(connect(fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    /* Each message is a short line the server is waiting on */
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+int connect_to_server(int* fd, int port) {
+    if((*fd = open_connection(port)) < 0) {
         printf("%s", get_str(CONN_REF));
         return CONN_REF;
     }
@@ -396,52 +662,668 @@ int connect_to_server(int* fd, int port) {
     return 0;
 }
 
-int check_map(FILE* serverGet, FILE* serverSend, FILE* map, Board* b) {
-    char buffer[80];    // Server output
-    int fdRules[2];
-    pipe(fdRules);  //Assume it will work
-    FILE *readRules = fdopen(fdRules[0], "r");
-    FILE *writeRules = fdopen(fdRules[1], "w");
+/*
+** Send a message to the server, keeping a copy once there is a
+** token in case it has to be sent again after resuming. Games sharing
+** a connection leave it to play_games to flush, so their messages go
+** out together.
+*/
+void send_message(Conn* c, const char* message) {
+    if(c->token[0] != '\0') {
+        strncpy(c->outbox[c->sent % OUTBOX_SIZE], message, 79);
+        c->outbox[c->sent % OUTBOX_SIZE][79] = '\0';
+        c->sent++;
+    }
+    if(c->tag >= 0) {
+        fprintf(c->send, "%c%d ", PROTO_TAG, c->tag);
+    }
+    fputs(message, c->send);
+    if(c->tag < 0) {
+        fflush(c->send);
+    }
+}
 
-    /* Send rules into rules pipe */
-    while(1) {
-        if(fgets(buffer, 80, serverGet) == NULL) {
-            printf("%s", get_str(CONN_LOST));
-            return CONN_LOST;
+/*
+** Answer a request, with the same tag if it was traced
+*/
+void send_response(Conn* c, const char* message, uint64_t traceId) {
+    char tagged[80];
+
+    TRACE("respond", traceId, FLOW_STEP);
+    send_message(c, trace_join(message, tagged, 80, traceId));
+}
+
+/*
+** Ask the opponent about x, y, starting a traced move
+*/
+void send_request(Conn* c, unsigned int x, unsigned int y) {
+    char request[40];
+    char tagged[80];
+    uint64_t traceId = traceOn ? trace_new_id() : 0;
+
+    sprintf(request, "$request %u %u\n", x, y);
+    TRACE("request", traceId, FLOW_START);
+    send_message(c, trace_join(request, tagged, 80, traceId));
+}
+
+/*
+** Start a strategy of kind for the game laid out on b
+*/
+void start_strategy(Strategy* s, int kind, const Picker* picker, Board* b)
+{
+    unsigned int* lengths = (unsigned int*)malloc(sizeof(unsigned int) *
+            b->nShips + 1);
+    unsigned int i;
+
+    for (i = 0; i < b->nShips; ++i) {
+		lengths[i] = b->ships[i]->length;
+    }
+    strategy_init(s, kind, b->width, b->height, b->nShips, lengths,
+	    picker->budget, picker->threads);
+    free(lengths);
+}
+
+/*
+** Reads one of our own moves the server is catching us up on after it
+** restarted, "hit x y" or "miss x y" after $response (see resend_moves).
+** Returns 1 if args is one, 0 otherwise
+*/
+int read_past_guess(const char* args, unsigned int* x, unsigned int* y,
+        int* hit) {
+    if(strncmp(args, "hit ", 4) == 0) {
+        *hit = 1;
+        args += 4;
+    } else if(strncmp(args, "miss ", 5) == 0) {
+        *hit = 0;
+        args += 5;
+    } else {
+        return 0;
+    }
+    return proto_coords(args, x, y);
+}
+
+/*
+** Reconnect after losing the server and carry on the same game,
+** swapping missed messages both ways. This is one try, the caller
+** waits between them.
+** Returns 1 if the game can carry on, 0 if it can't, -1 if the server
+** couldn't be reached
+*/
+int resume_game(Conn* c) {
+    char line[80];
+    unsigned int seen, i;
+    int fd;
+
+    if((fd = open_connection(c->port)) < 0) {
+        return -1;
+    }
+    proto_reader_init(&c->get, fd);
+    c->send = fdopen(fd, "w");
+    fprintf(c->send, "$resume %s %u\n", c->token, c->received);
+    fflush(c->send);
+
+    if(proto_read_line(&c->get, line, 80)) {
+        if(sscanf(line, "$resume ok %u", &seen) == 1) {
+            /* The server tells us what it got, send the rest */
+            for(i = seen; i < c->sent; ++i) {
+                fputs(c->outbox[i % OUTBOX_SIZE], c->send);
+            }
+            fflush(c->send);
+            return 1;
         }
-        if(strcmp(buffer, "$endrules\n") == 0) {
-            break;
+        fclose(c->send);
+        c->send = NULL;
+        return 0;	/* seat is gone */
+    }
+    fclose(c->send);
+    c->send = NULL;
+    return -1;
+}
+
+/*
+** Waits until the server or the user has sent something, or until
+** deadline if it isn't 0, and reads what has arrived into get and in.
+** get is NULL while there is no server. The user's input is read ahead
+** of when it is wanted, as far as in has room.
+*/
+void wait_for_input(LineReader* get, LineReader* in, time_t deadline) {
+    struct pollfd fds[2];
+    LineReader* readers[2];
+    int n = 0, timeout = -1, i;
+
+    if(get != NULL) {
+        fds[n].fd = get->fd;
+        fds[n].events = POLLIN;
+        readers[n++] = get;
+    }
+    if(!in->eof && in->len - in->start < PROTO_BUF) {
+        fds[n].fd = in->fd;
+        fds[n].events = POLLIN;
+        readers[n++] = in;
+    }
+    if(deadline != 0) {
+        timeout = deadline > time(NULL) ? (deadline - time(NULL)) * 1000 : 0;
+    }
+
+    if(poll(fds, n, timeout) <= 0) {
+        return;
+    }
+    for(i = 0; i < n; ++i) {
+        if(fds[i].revents != 0) {
+            proto_fill(readers[i]);
         }
-        fprintf(writeRules, buffer);
-        fflush(writeRules);
     }
-            
-    ErrCond err = alloc_board(b, readRules, map);
-    if(err == BAD_MAP) {
-        fprintf(serverSend, "$map bad\n");
-        fflush(serverSend);
-        printf("%s", get_str(err));
-        return err;
+}
+
+/*
+** Returns 1 if s is a rules hash as the server sends them
+*/
+int is_hash(const char* s)
+{
+    return strlen(s) == HASH_LEN && strspn(s, "0123456789abcdef") == HASH_LEN;
+}
+
+/*
+** Cached rules are stored already parsed: CACHE_MAGIC, then height,
+** width, number of ships and each ship's length as unsigned ints.
+*/
+#define CACHE_MAGIC "NRC1"
+
+/*
+** Where the hash of the rules last downloaded for ruleName is kept. Each
+** named set has its own, the server's default set (NULL) uses "last".
+*/
+void last_path(char* path, const char* cacheDir, const char* ruleName)
+{
+    if (ruleName == NULL) {
+		snprintf(path, PATH_LEN, "%s/last", cacheDir);
+    } else {
+		snprintf(path, PATH_LEN, "%s/last.%s", cacheDir, ruleName);
+    }
+}
+
+/*
+** Loads the rules last downloaded for ruleName into cacheDir into r and
+** copies their hash into hash. Returns OK, or BAD_RULES if there are none
+** usable.
+*/
+ErrCond load_cached_rules(const char* cacheDir, const char* ruleName,
+	char* hash, Rules* r)
+{
+    char path[PATH_LEN];
+    char magic[4];
+    unsigned int header[3];
+    FILE* f;
+    int ok;
+
+    last_path(path, cacheDir, ruleName);
+    if ((f = fopen(path, "r")) == NULL) {
+		return BAD_RULES;
+    }
+    ok = fscanf(f, "%16s", hash) == 1 && is_hash(hash);
+    fclose(f);
+    if (!ok) {
+		return BAD_RULES;
+    }
+
+    snprintf(path, PATH_LEN, "%s/rules.%s", cacheDir, hash);
+    if ((f = fopen(path, "rb")) == NULL) {
+		return BAD_RULES;
+    }
+    ok = fread(magic, 1, 4, f) == 4 && memcmp(magic, CACHE_MAGIC, 4) == 0 &&
+	    fread(header, sizeof(unsigned int), 3, f) == 3 &&
+	    header[0] >= 1 && header[1] >= 1 && header[2] >= 1 &&
+	    header[0] <= SIDE_MAX && header[1] <= SIDE_MAX &&
+	    header[2] <= SHIPS_MAX;
+    if (ok) {
+		r->height = header[0];
+		r->width = header[1];
+		r->nShips = header[2];
+		r->lengths = (unsigned int*)malloc(sizeof(unsigned int) * r->nShips);
+		if (fread(r->lengths, sizeof(unsigned int), r->nShips, f) !=
+			r->nShips) {
+		    free(r->lengths);
+		    ok = 0;
+		}
+    }
+    fclose(f);
+    return ok ? OK : BAD_RULES;
+}
+
+/*
+** Stops trying the rules cached for ruleName, so the server sends its
+** own next time.
+*/
+void forget_cached_rules(const char* cacheDir, const char* ruleName)
+{
+    char path[PATH_LEN];
+
+    last_path(path, cacheDir, ruleName);
+    remove(path);
+}
+
+/*
+** Keeps r in cacheDir under hash, and as the rules to try next time
+** ruleName is asked for. Nothing is kept if it can't all be written.
+*/
+void cache_rules(const char* cacheDir, const char* ruleName,
+	const char* hash, const Rules* r)
+{
+    char path[PATH_LEN], part[PATH_LEN];
+    unsigned int header[3] = {r->height, r->width, r->nShips};
+    FILE* f;
+    int ok;
+
+    snprintf(path, PATH_LEN, "%s/rules.%s", cacheDir, hash);
+    snprintf(part, PATH_LEN, "%s/rules.%s.%d", cacheDir, hash,
+	    (int)getpid());
+    if ((f = fopen(part, "wb")) == NULL) {
+		return;
+    }
+    ok = fwrite(CACHE_MAGIC, 1, 4, f) == 4 &&
+	    fwrite(header, sizeof(unsigned int), 3, f) == 3 &&
+	    fwrite(r->lengths, sizeof(unsigned int), r->nShips, f) == r->nShips;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(part, path) != 0) {
+		remove(part);
+		return;
+    }
+
+    last_path(path, cacheDir, ruleName);
+    if ((f = fopen(path, "w")) != NULL) {
+		fprintf(f, "%s\n", hash);
+		fclose(f);
+    }
+}
+
+/*
+** Lays out the map by the rules parsed with result err, and tells the
+** server whether it fits. hash is what the server called the rules, and
+** they are cached under it as ruleName if there is a cacheDir.
+** Returns error code or OK, in which case b is allocated
+*/
+ErrCond fit_map(Conn* c, ErrCond err, Rules* rules, FILE* map, Board* b,
+        const char* cacheDir, const char* ruleName, const char* hash) {
+    if(err == OK) {
+        if(cacheDir != NULL && is_hash(hash)) {
+            cache_rules(cacheDir, ruleName, hash, rules);
+        }
+        rewind(map);
+        err = alloc_board(b, rules, map);
+        dealloc_rules(rules);
+    }
+    send_message(c, err == OK ? "$map good\n" : "$map bad\n");
+    return err;
+}
+
+/*
+** Answer the opponent's guess at x, y on b, which must be allocated. A
+** guess off the board is ignored, as only a broken peer sends one.
+** Returns GO_LOSS if it sank the last ship, OK otherwise
+*/
+ErrCond answer_request(Conn* c, Board* bb, unsigned int x, unsigned int y,
+        uint64_t traceId) {
+    if(!INRANGE(bb, y, x)) {
+        return OK;
+    }
+    char id = bb->hidden[MAP(bb, y, x)];
+
+    if(id == '.') {
+        send_response(c, "$response miss\n", traceId);
+        return OK;
+    }
+
+    /* Not a duplicate hit */
+    if(bb->guess[MAP(bb, y, x)] != '*') {
+        bb->guess[MAP(bb, y, x)] = '*';
+        bb->ships[id - 'a']->lives--;
+
+        /* ship has been sunk */
+        if(bb->ships[id-'a']->lives == 0) {
+            bb->alive--;
+
+            /* Game over */
+            if(bb->alive == 0) {
+                send_response(c, "$response over\n", traceId);
+                return GO_LOSS;
+            }
+        }
+    }
+    send_response(c, "$response hit\n", traceId);
+    return OK;
+}
+
+/*
+** Ask to carry on a game whose channel closed, on a new channel with the
+** same tag.
+** Returns 0 if it is too early to resume
+*/
+int resume_match(Match* m) {
+    if(m->conn.token[0] == '\0') {
+        return 0;
+    }
+    if(m->rules != NULL) {
+        fclose(m->rules);
+        m->rules = NULL;
+    }
+    fprintf(m->conn.send, "%c%d $resume %s %u\n", PROTO_TAG, m->conn.tag,
+            m->conn.token, m->conn.received);
+    fflush(m->conn.send);
+    m->resuming = 1;
+    return 1;
+}
+
+/*
+** Start a game on the shared connection, with cached rules if there are
+** any. Games are numbered after their tag, idG.0, idG.1 and so on.
+*/
+void start_match(Match* m, int tag, FILE* send, int port, const char* idC,
+        const char* idG, FILE* map, Rules* cached, const char* hash,
+        const char* ruleName) {
+    char line[256];
+
+    memset(m, 0, sizeof(Match));
+    m->conn.send = send;
+    m->conn.port = port;
+    m->conn.tag = tag;
+    snprintf(m->game, sizeof(m->game), "%s.%d", idG, tag);
+
+    if(cached != NULL) {
+        rewind(map);
+        m->result = alloc_board(&m->b, cached, map);
+        m->haveBoard = m->result == OK;
+        snprintf(m->hash, sizeof(m->hash), "%s", hash);
+        snprintf(line, sizeof(line), "$hello %s %s %s %s", idC, m->game,
+                hash, m->haveBoard ? "good" : "bad");
+    } else {
+        snprintf(line, sizeof(line), "$handshake %s %s", idC, m->game);
+    }
+    if(ruleName != NULL) {
+        strcat(line, " ");
+        strcat(line, ruleName);
+    }
+    strcat(line, "\n");
+    send_message(&m->conn, line);
+}
+
+/*
+** Play the message the server sent on m's channel. Guesses are picked
+** by the picker's strategy, as there is nobody to ask.
+*/
+void play_match(Match* m, char* buffer, FILE* map, const char* cacheDir,
+        const char* ruleName, const Picker* picker) {
+    const char* args;
+    unsigned int x, y, seen, i;
+    int hit;
+    uint64_t traceId;
+    Command command;
+
+    /* Rules arrive a line at a time, between other games' messages */
+    if(m->rules != NULL) {
+        if(proto_command(buffer, &args) != CMD_ENDRULES) {
+            fputs(buffer, m->rules);
+            return;
+        }
+        Rules rules;
+        rewind(m->rules);
+        ErrCond err = parse_rules(&rules, m->rules);
+        fclose(m->rules);
+        m->rules = NULL;
+        m->result = fit_map(&m->conn, err, &rules, map, &m->b, cacheDir,
+                ruleName, m->hash);
+        m->haveBoard = m->result == OK;
+        return;
+    }
+
+    /* The server tells us what it got, send the rest */
+    if(m->resuming) {
+        m->resuming = 0;
+        if(sscanf(buffer, "$resume ok %u", &seen) != 1) {
+            m->result = CONN_LOST;	/* seat is gone */
+            return;
+        }
+        for(i = seen; i < m->conn.sent; ++i) {
+            fprintf(m->conn.send, "%c%d %s", PROTO_TAG, m->conn.tag,
+                    m->conn.outbox[i % OUTBOX_SIZE]);
+        }
+        fflush(m->conn.send);
+        return;
+    }
+
+    if(m->conn.token[0] != '\0') {
+        m->conn.received++;
+    }
+    traceId = trace_split(buffer);
+    command = proto_command(buffer, &args);
+    TRACE("receive", traceId, command == CMD_RESPONSE ?
+            FLOW_END : FLOW_STEP);
+
+    if(command == CMD_TOKEN &&
+            proto_word(&args, m->conn.token, TOKEN_LEN + 1)) {
+        m->conn.received = 0;
+        m->conn.sent = 0;
+    } else if(command == CMD_STARTRULES) {
+        m->hash[0] = '\0';
+        proto_word(&args, m->hash, sizeof(m->hash));
+        if(m->haveBoard) {
+            dealloc_board(&m->b);
+            m->haveBoard = 0;
+        }
+        if(m->haveStrategy) {
+            strategy_free(&m->strategy);
+            m->haveStrategy = 0;
+        }
+        m->rules = tmpfile();
+    } else if(command == CMD_YOURMOVE && m->haveBoard) {
+        if(!m->haveStrategy) {
+            start_strategy(&m->strategy, picker->kind, picker, &m->b);
+            m->haveStrategy = 1;
+        }
+        strategy_guess(&m->strategy, &x, &y);
+        send_request(&m->conn, x, y);
+    } else if(command == CMD_RESPONSE && m->haveBoard &&
+            read_past_guess(args, &x, &y, &hit)) {
+        if(!m->haveStrategy) {
+            start_strategy(&m->strategy, picker->kind, picker, &m->b);
+            m->haveStrategy = 1;
+        }
+        strategy_learn(&m->strategy, x, y, hit);
+    } else if(command == CMD_RESPONSE && (strcmp(args, "hit\n") == 0 ||
+            strcmp(args, "miss\n") == 0)) {
+        if(m->haveStrategy) {
+            strategy_result(&m->strategy, args[0] == 'h');
+        }
+        send_message(&m->conn, "$yourmove\n");
+    } else if(command == CMD_RESPONSE && strcmp(args, "over\n") == 0) {
+        m->result = GO_WIN;
+    } else if(command == CMD_BYE) {
+        m->result = GO_DISCONN;
+    } else if(command == CMD_REQUEST && m->haveBoard &&
+            proto_coords(args, &x, &y)) {
+        m->result = answer_request(&m->conn, &m->b, x, y, traceId);
     }
+}
 
-    fclose(readRules);
-    fclose(writeRules);
-    fprintf(serverSend, "$map good\n");
-    fflush(serverSend);
+/*
+** Connect again after losing the server and resume every game still on.
+** Games too early to resume are lost.
+** Returns how many games are still on, 0 if there was no server
+*/
+int resume_matches(Match* matches, int nGames, LineReader* get,
+        FILE** send, int port) {
+    int fd, try, i, playing = 0;
 
+    fclose(*send);
+    *send = NULL;
+    for(try = 0; try < RESUME_TRIES; ++try) {
+        if(try > 0) {
+            sleep(1);
+        }
+        if((fd = open_connection(port)) < 0) {
+            continue;
+        }
+        proto_reader_init(get, fd);
+        *send = fdopen(fd, "w");
+        fprintf(*send, "$multiplex\n");
+        for(i = 0; i < nGames; ++i) {
+            matches[i].conn.send = *send;
+            if(matches[i].result != OK) {
+                continue;
+            }
+            if(resume_match(&matches[i])) {
+                playing++;
+            } else {
+                matches[i].result = CONN_LOST;
+                printf("%s %s", matches[i].game, get_str(CONN_LOST));
+            }
+        }
+        return playing;
+    }
     return 0;
 }
 
+/*
+** Play nGames games at once over one connection, numbered idG.0 on, all
+** with the same map, guessing cells in reading order unless the picker
+** has a strategy. Each game's result is printed as it ends.
+** What the games send is only flushed once every message that has
+** arrived is played, so it goes out in one write. With a batching
+** window of batch microseconds, the client then waits that long for
+** more to arrive before reading, trading latency for fewer packets.
+** Returns CONN_REF if the server can't be reached, OK otherwise
+*/
+int play_games(const char* idC, const char* idG, FILE* map, int port,
+        int nGames, int batch, const char* cacheDir, const char* ruleName,
+        const Picker* picker) {
+    Match* matches = (Match*)malloc(sizeof(Match) * nGames);
+    char buffer[128];
+    char hash[HASH_LEN + 1];
+    Rules cached;
+    int haveCached = 0;
+    int playing = nGames;
+    LineReader get;
+    FILE* send;
+    const char* message;
+    unsigned int tag;
+    int fd, i;
+    Picker sweep = *picker;
+
+    if(sweep.kind < 0) {
+        sweep.kind = strategy_find("sweep");
+    }
+    if (cacheDir != NULL) {
+        mkdir(cacheDir, 0700);
+        haveCached = load_cached_rules(cacheDir, ruleName, hash,
+                &cached) == OK;
+    }
+    if(haveCached) {
+        /* Every game has the same map, so one try tells for them all */
+        Board b;
+        rewind(map);
+        if(alloc_board(&b, &cached, map) == OK) {
+            dealloc_board(&b);
+        } else {
+            dealloc_rules(&cached);
+            forget_cached_rules(cacheDir, ruleName);
+            haveCached = 0;
+        }
+    }
+    if((fd = open_connection(port)) < 0) {
+        printf("%s", get_str(CONN_REF));
+        return CONN_REF;
+    }
+    proto_reader_init(&get, fd);
+    send = fdopen(fd, "w");
+    fprintf(send, "$multiplex\n");
+    for(i = 0; i < nGames; ++i) {
+        start_match(&matches[i], i, send, port, idC, idG, map,
+                haveCached ? &cached : NULL, hash, ruleName);
+    }
+    if(haveCached) {
+        dealloc_rules(&cached);
+    }
+
+    while(playing > 0) {
+        if(!proto_line_ready(&get)) {
+            fflush(send);
+            if(batch > 0) {
+                usleep(batch);
+            }
+        }
+        if(!proto_read_line(&get, buffer, sizeof(buffer))) {
+            playing = resume_matches(matches, nGames, &get, &send, port);
+            continue;
+        }
+        message = buffer;
+        if(!proto_untag(&message, &tag) || tag >= (unsigned int)nGames ||
+                matches[tag].result != OK) {
+            continue;
+        }
+
+        /* An empty frame means the server let go of the seat */
+        Match* m = &matches[tag];
+        if(*message == '\0') {
+            if(!resume_match(m)) {
+                m->result = CONN_LOST;
+            }
+        } else {
+            play_match(m, (char*)message, map, cacheDir, ruleName, &sweep);
+        }
+        if(m->result != OK) {
+            printf("%s %s", m->game, get_str(m->result));
+            playing--;
+        }
+    }
+
+    for(i = 0; i < nGames; ++i) {
+        if(matches[i].result == OK) {
+            printf("%s %s", matches[i].game, get_str(CONN_LOST));
+        }
+        if(matches[i].haveBoard) {
+            dealloc_board(&matches[i].b);
+        }
+        if(matches[i].haveStrategy) {
+            strategy_free(&matches[i].strategy);
+        }
+    }
+    if(send != NULL) {
+        fclose(send);
+    }
+    free(matches);
+    return OK;
+}
+
 int main(int argc, char* argv[])
 {
     /* Parse the command line input */
     char *idC, *idG;    // id strings for client and game
     FILE *map;          // File stream for map file
     int port;           // Port number to connect to
-    int parseReturn = parse_cmd_line(argc, argv, &idC, &idG, &map, &port);
+    int quiet;          // Don't draw the boards
+    char* tracePath;    // Where to write the trace, NULL if not tracing
+    char* cacheDir;     // Where to keep rules, NULL if not keeping them
+    char* ruleName;     // Rules to play by, NULL for the server's default
+    int games;          // Games to play over one connection, 0 for just one
+    int batch;          // Microseconds to gather their messages for
+    Picker picker;      // Picks guesses if nobody is asked for them
+    int parseReturn = parse_cmd_line(argc, argv, &idC, &idG, &map, &port,
+            &quiet, &tracePath, &cacheDir, &ruleName, &games, &batch,
+            &picker);
     if(parseReturn) {
         return parseReturn;
     }
+    if(tracePath != NULL && !trace_open(tracePath, idC)) {
+        printf("%s", get_str(BAD_PARAM));
+        return BAD_PARAM;
+    }
+
+    /* A dropped connection is noticed when reading, not by a signal */
+    signal(SIGPIPE, SIG_IGN);
+
+    if(games > 0) {
+        return play_games(idC, idG, map, port, games, batch, cacheDir,
+                ruleName, &picker);
+    }
 
     /* Connect to server as FILE* */
     int fd;
@@ -449,87 +1331,234 @@ int main(int argc, char* argv[])
     if(serverReturn) {
         return serverReturn;
     }
-    FILE* serverGet = fdopen(fd, "r");
-    FILE* serverSend = fdopen(fd, "w");
-
-    /* Send handshake */
-    fprintf(serverSend, "$handshake %s %s\n", idC, idG);
-    fflush(serverSend);
+    Conn conn;          // Connection to the server
+    proto_reader_init(&conn.get, fd);
+    conn.send = fdopen(fd, "w");
+    conn.port = port;
+    conn.tag = -1;
+    conn.token[0] = '\0';
+    conn.received = 0;
+    conn.sent = 0;
 
     char buffer[80];    // Server output
     Board b;            // The board game
+    View view;          // Draws the board game
+    int haveBoard = 0;  // b and view are allocated
+    char hash[HASH_LEN + 1];    // Names the rules b was laid out by
+
+    /* With the rules from last time the map can be checked before
+     * connecting, and the server only sends rules if its have changed */
+    Rules cached;
+    if (cacheDir != NULL) {
+        mkdir(cacheDir, 0700);
+    }
+    if (cacheDir != NULL &&
+            load_cached_rules(cacheDir, ruleName, hash, &cached) == OK) {
+        ErrCond err = alloc_board(&b, &cached, map);
+        dealloc_rules(&cached);
+        if (err == OK) {
+            alloc_view(&view, &b, quiet);
+            haveBoard = 1;
+        } else {
+            /* Maybe out of date, the server's rules may yet fit */
+            forget_cached_rules(cacheDir, ruleName);
+        }
+    }
+
+    /* Send handshake, naming the rules if not the default */
+    if (haveBoard) {
+        fprintf(conn.send, "$hello %s %s %s good", idC, idG, hash);
+    } else {
+        fprintf(conn.send, "$handshake %s %s", idC, idG);
+    }
+    fprintf(conn.send, "%s%s\n", ruleName ? " " : "", ruleName ? ruleName : "");
+    fflush(conn.send);
+
     unsigned int x, y;  // User guesses
-    while(fgets(buffer, 80, serverGet) != NULL) {
-        if(strcmp(buffer, "$startrules\n") == 0) {
-            int err = check_map(serverGet, serverSend, map, &b);
-            if(err) {
+    int hit;            // Whether a past guess hit
+    uint64_t traceId;   // Move the current message belongs to, 0 if none
+    Command command;    // What the server sent
+    const char* args;   // The rest of it
+    FILE* rules = NULL; // Rules still arriving, NULL if none are
+    Strategy strategy;  // Picks guesses with --strategy
+    int haveStrategy = 0;   // strategy is started
+
+    /* The server, the user and the next try at resuming are all waited
+     * on in one place, so none of them holds up the others: a guess can
+     * be typed (or piped) ahead, and the server is heard from while a
+     * guess is awaited */
+    LineReader in;          // The user's input
+    char guess[SHORT_LEN];  // One line of it
+    int wantGuess = 0;      // It's my turn and no guess is in yet
+    int gobble = 0;         // Skipping the rest of a line that was too long
+    int tries = 0;          // Tries at resuming, while there's no server
+    time_t retryAt = 0;     // When to try next
+    proto_reader_init(&in, STDIN_FILENO);
+
+    while(1) {
+        /* Lost the server, try to resume once a second */
+        if(conn.send == NULL) {
+            if(time(NULL) < retryAt) {
+                wait_for_input(NULL, &in, retryAt);
+                continue;
+            }
+            int resumed = resume_game(&conn);
+            if(resumed == 0 || (resumed < 0 && ++tries == RESUME_TRIES)) {
+                break;
+            }
+            retryAt = time(NULL) + 1;
+            continue;
+        }
+
+        if(!proto_line_ready(&conn.get)) {
+            if(!wantGuess || !proto_line_ready(&in)) {
+                wait_for_input(&conn.get, &in, 0);
+                continue;
+            }
+
+            /* Nothing from the server, so take the guess */
+            if(!proto_read_line(&in, guess, SHORT_LEN)) {
+                send_message(&conn, "$bye\n");
+                printf("\n%s", get_str(OK));
+                return OK;
+            }
+            if(gobble) {
+                gobble = guess[strlen(guess) - 1] != '\n';
+                continue;
+            }
+            if(guess[strlen(guess) - 1] != '\n') {
+                gobble = 1;     /* a long line, or eof before \n */
+                prompt_guess(quiet);
+                continue;
+            }
+            if(!read_guess(&b, guess, &x, &y)) {
+                prompt_guess(quiet);
+                continue;
+            }
+            wantGuess = 0;
+            send_request(&conn, x, y);
+            continue;
+        }
+
+        if(!proto_read_line(&conn.get, buffer, 80)) {
+            if(conn.token[0] == '\0') {
+                break;  /* too early to resume */
+            }
+            fclose(conn.send);
+            conn.send = NULL;
+            tries = 0;
+            retryAt = 0;
+            continue;
+        }
+
+        /* Rules arrive a line at a time, like any other message */
+        if(rules != NULL) {
+            if(proto_command(buffer, &args) != CMD_ENDRULES) {
+                fputs(buffer, rules);
+                continue;
+            }
+            Rules parsed;
+            rewind(rules);
+            ErrCond err = parse_rules(&parsed, rules);
+            fclose(rules);
+            rules = NULL;
+            err = fit_map(&conn, err, &parsed, map, &b, cacheDir, ruleName,
+                    hash);
+            if(err != OK) {
+                printf("%s", get_str(err));
                 return err;
             }
+            alloc_view(&view, &b, quiet);
+            haveBoard = 1;
+            continue;
+        }
+
+        if(conn.token[0] != '\0') {
+            conn.received++;
         }
+        traceId = trace_split(buffer);
+        command = proto_command(buffer, &args);
+        TRACE("receive", traceId, command == CMD_RESPONSE ?
+                FLOW_END : FLOW_STEP);
 
-        /* If it's my turn */
-        else if(strcmp(buffer, "$yourmove\n") == 0) {
-            show_boards(&b);
-            while(!read_guess(&b, &x, &y)) {
-                if(feof(stdin)) {
-                    fprintf(serverSend, "$bye\n");
-                    fflush(serverSend);
-                    printf("\n%s", get_str(OK));
-                    return OK;
+        /* Keep the token in case the connection drops */
+        if(command == CMD_TOKEN &&
+                proto_word(&args, conn.token, TOKEN_LEN + 1)) {
+            conn.received = 0;
+            conn.sent = 0;
+        }
+
+        /* The server's rules aren't the ones we have */
+        else if(command == CMD_STARTRULES) {
+            hash[0] = '\0';
+            proto_word(&args, hash, sizeof(hash));
+            if(haveBoard) {
+                dealloc_view(&view);
+                dealloc_board(&b);
+                haveBoard = 0;
+            }
+            if(haveStrategy) {
+                strategy_free(&strategy);
+                haveStrategy = 0;
+            }
+            rules = tmpfile();
+        }
+
+        /* If it's my turn, the strategy guesses or the guess is
+         * taken once there is one */
+        else if(command == CMD_YOURMOVE) {
+            show_boards(&view, &b);
+            if(picker.kind >= 0) {
+                if(!haveStrategy) {
+                    start_strategy(&strategy, picker.kind, &picker, &b);
+                    haveStrategy = 1;
                 }
+                strategy_guess(&strategy, &x, &y);
+                send_request(&conn, x, y);
+            } else {
+                prompt_guess(quiet);
+                wantGuess = 1;
             }
+        }
 
-            fprintf(serverSend, "$request %u %u\n", x, y);
-            fflush(serverSend);
+        /* One of our moves from before the server restarted */
+        else if(command == CMD_RESPONSE &&
+                read_past_guess(args, &x, &y, &hit)) {
+            if(picker.kind >= 0 && haveBoard) {
+                if(!haveStrategy) {
+                    start_strategy(&strategy, picker.kind, &picker, &b);
+                    haveStrategy = 1;
+                }
+                strategy_learn(&strategy, x, y, hit);
+            }
         }
 
         /* Put these together  because we don't care about visuals */
-        else if(strcmp(buffer, "$response hit\n") == 0 ||
-                strcmp(buffer, "$response miss\n") == 0) {
-            fprintf(serverSend, "$yourmove\n");
-            fflush(serverSend);
+        else if(command == CMD_RESPONSE && (strcmp(args, "hit\n") == 0 ||
+                strcmp(args, "miss\n") == 0)) {
+            if(haveStrategy) {
+                strategy_result(&strategy, args[0] == 'h');
+            }
+            send_message(&conn, "$yourmove\n");
         }
 
         /* I win! */
-        else if(strcmp(buffer, "$response over\n") == 0) {
+        else if(command == CMD_RESPONSE && strcmp(args, "over\n") == 0) {
             printf("\n%s", get_str(GO_WIN));
             return GO_WIN;
         }
 
-        /* Opponent disconnected */
-        else if(strcmp(buffer, "$bye\n") == 0) {
+        /* Opponent disconnected, even while waiting on a guess */
+        else if(command == CMD_BYE) {
             printf("\n%s", get_str(GO_DISCONN));
             return GO_DISCONN;
         }
 
-        else if(sscanf(buffer, "$request %u %u\n", &x, &y) == 2) {
-            Board* bb = &b;
-            char id = bb->hidden[MAP(bb, y, x)];
-            
-            if(id == '.') {
-                fprintf(serverSend, "$response miss\n");
-                fflush(serverSend);
-            } else {
-                /* Not a duplicate hit */
-                if(bb->guess[MAP(bb, y, x)] != '*') {
-                    bb->guess[MAP(bb, y, x)] = '*';
-                    bb->ships[id - 'a']->lives--;
-
-                    /* ship has been sunk */
-                    if(bb->ships[id-'a']->lives == 0) {
-                        bb->alive--;
-
-                        /* Game over */
-                        if(bb->alive == 0) {
-                            fprintf(serverSend, "$response over\n");
-                            fflush(serverSend);
-                            printf("\n%s", get_str(GO_LOSS));
-                            return GO_LOSS;
-                        }
-                    }
-                }
-                fprintf(serverSend, "$response hit\n");
-                fflush(serverSend);
+        else if(command == CMD_REQUEST && haveBoard &&
+                proto_coords(args, &x, &y)) {
+            if(answer_request(&conn, &b, x, y, traceId) == GO_LOSS) {
+                printf("\n%s", get_str(GO_LOSS));
+                return GO_LOSS;
             }
         }
 
@@ -540,4 +1569,3 @@ int main(int argc, char* argv[])
     printf("%s", get_str(CONN_LOST));
     return CONN_LOST;
 }
-
@@ -0,0 +1,571 @@
+/* Networking */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Standard */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "replay.h"
+
+/* Errors */
+#define ERR_NUM_P	1	// Error in number of parameters
+#define ERR_TYPE_P	2	// Error in types of parameters
+#define ERR_FILE	3	// Error opening the replay file
+#define ERR_GAME	4	// No such game or it is corrupt
+#define ERR_NET		5	// Unable to connect to the server
+#define ERR_DIFF	6	// Server didn't relay what was recorded
+
+#define RUN_STACK	(128 * 1024)	// Stack of each game's thread when loading
+
+/*
+ * A game being played back, and how it went. Copies of the same recorded
+ * game share its data but read it through chunks of their own.
+ */
+typedef struct Run {
+	ReplayChunk chunk;
+	int port;
+	double speed;			// Times faster than recorded, 0 for flat out
+	double start;			// When the recording is played back from
+	char game[80];			// Game id given to the server
+	char suffix[16];		// Put after user ids
+	int error;				// ERR_* if the game couldn't be played back
+	int messages;
+	int mismatches;
+	double seconds;			// From the first player joining to the end
+	double* latency;		// Of each message, sent until it came out
+	int latencyCount;
+	int latencySize;
+} Run;
+
+/*
+ * Print an error message then exit the program.
+ */
+void throw_error(int code) {
+	switch(code) {
+		case ERR_NUM_P:
+			fprintf(stderr, "Usage: nreplay replayfile [game [port]]\n"
+					"       nreplay replayfile load port [speed [copies]]\n");
+			break;
+		case ERR_TYPE_P:
+			fprintf(stderr, "Invalid param types or values.\n");
+			break;
+		case ERR_FILE:
+			fprintf(stderr, "Unable to open replay file.\n");
+			break;
+		case ERR_GAME:
+			fprintf(stderr, "No such game in replay file.\n");
+			break;
+		case ERR_NET:
+			fprintf(stderr, "Unable to connect to server.\n");
+			break;
+		case ERR_DIFF:
+			fprintf(stderr, "Server output differs from replay.\n");
+			break;
+	}
+	exit(code);
+}
+
+/*
+ * Print one line per recorded game:
+ * number, game id, both players, number of guesses and the result
+ */
+void list_games(FILE* data, FILE* index) {
+	uint64_t count = replay_count(index);
+	ReplayChunk chunk;
+	ReplayRecord rec;
+
+	for(uint64_t i = 0; i < count; i++) {
+		if(!replay_load(data, index, i, &chunk)) {
+			throw_error(ERR_GAME);
+		}
+		char users[2][80] = {"-", "-"};
+		char result[100] = "unfinished";
+		int moves = 0;
+		while(replay_next(&chunk, &rec)) {
+			if(rec.type == REC_HANDSHAKE) {
+				snprintf(users[rec.player], 80, "%.*s", (int)rec.textLen,
+						rec.text);
+			} else if(rec.type == REC_REQUEST) {
+				moves++;
+			} else if(rec.type == REC_END) {
+				snprintf(result, 100, "%s %s", users[rec.player],
+						rec.value == END_WIN ? "won" : "disconnected");
+			}
+		}
+		fprintf(stdout, "%llu\t%s\t%s\t%s\t%d\t%s\n",
+				(unsigned long long)chunk.serial, chunk.id, users[0], users[1],
+				moves, result);
+		replay_free(&chunk);
+	}
+}
+
+/*
+ * Print the whole of a game, each message prefixed by who sent it
+ */
+void dump_game(ReplayChunk* chunk) {
+	ReplayRecord rec;
+	char line[1024];
+
+	fprintf(stdout, "# game %s rules %016llx\n", chunk->id,
+			(unsigned long long)chunk->rulesHash);
+	while(replay_next(chunk, &rec)) {
+		if(rec.type == REC_HANDSHAKE) {
+			fprintf(stdout, "%d $handshake %.*s %s\n", rec.player,
+					(int)rec.textLen, rec.text, chunk->id);
+		} else if(rec.type == REC_END) {
+			fprintf(stdout, "# player %d %s\n", rec.player,
+					rec.value == END_WIN ? "won" : "disconnected");
+		} else if(replay_format(&rec, line, sizeof(line))) {
+			fprintf(stdout, "%d %s", rec.player, line);
+		}
+	}
+}
+
+double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Open a connection to the server on localhost
+ * Returns -1 if it can't be made
+ */
+int connect_to_server(int port) {
+	int fd;
+	struct sockaddr_in servaddr;    // Address info of server
+
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_port = htons(port);
+	inet_aton("127.0.0.1", &servaddr.sin_addr);
+	if(connect(fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Read server output until a protocol message turns up
+ * Anything not starting with $ is skipped, as are resume tokens
+ * Returns false if the connection is lost
+ */
+bool next_message(FILE* serverGet, char* line, int size) {
+	while(fgets(line, size, serverGet) != NULL) {
+		char* start = line;
+		while(*start == '\0' && start < line + size - 1) {
+			start++;	// Skip stray terminators from the server
+		}
+		if(*start == '$' && strncmp(start, "$token ", 7) != 0) {
+			memmove(line, start, strlen(start) + 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Check the next message from the server is the one expected
+ * Returns true if it is
+ */
+bool expect(FILE* serverGet, int player, const char* expected) {
+	char line[1024];
+	if(!next_message(serverGet, line, sizeof(line))) {
+		fprintf(stdout, "player %d: expected %s", player, expected);
+		fprintf(stdout, "player %d: lost connection\n", player);
+		return false;
+	}
+	if(strcmp(line, expected) != 0) {
+		fprintf(stdout, "player %d: expected %s", player, expected);
+		fprintf(stdout, "player %d: got %s", player, line);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Connect as one player and get through the rules. Saying which rules the
+ * game was played with lets a server holding several sets pick them, and
+ * one that already agrees skips sending them.
+ * Returns false if the rules don't match the recording
+ */
+bool join_game(FILE* serverGet, FILE* serverSend, const char* user,
+		const char* game, ReplayChunk* chunk) {
+	char line[1024];
+	char* rulesText;
+	size_t rulesLen = 0;
+
+	fprintf(serverSend, "$hello %s %s %016llx good\n", user, game,
+			(unsigned long long)chunk->rulesHash);
+	fflush(serverSend);
+
+	if(fgets(line, sizeof(line), serverGet) == NULL) {
+		return false;
+	}
+	if(strncmp(line, "$startrules", 11) != 0) {
+		return true;	// Server has the same rules
+	}
+	rulesText = (char *)malloc(1);
+	while(fgets(line, sizeof(line), serverGet) != NULL) {
+		if(strcmp(line, "$endrules\n") == 0) {
+			break;
+		} else {
+			size_t len = strlen(line);
+			rulesText = (char *)realloc(rulesText, rulesLen + len);
+			memcpy(rulesText + rulesLen, line, len);
+			rulesLen += len;
+		}
+	}
+	uint64_t hash = replay_hash(rulesText, rulesLen);
+	free(rulesText);
+
+	fprintf(serverSend, "$map good\n");
+	fflush(serverSend);
+	return hash == chunk->rulesHash;
+}
+
+/*
+ * Wait until the recording, played back at the run's speed, catches up
+ * with the wait just read. Late runs carry on without waiting.
+ */
+void keep_pace(Run* run, double* due, uint64_t wait) {
+	if(run->speed <= 0) {
+		return;
+	}
+	*due += wait / 1000.0 / run->speed;
+	double left = run->start + *due - now();
+	if(left > 0) {
+		usleep((useconds_t)(left * 1e6));
+	}
+}
+
+/*
+ * Note how long a message took to come out the other side
+ */
+void add_latency(Run* run, double seconds) {
+	if(run->latencyCount == run->latencySize) {
+		run->latencySize = run->latencySize ? run->latencySize * 2 : 64;
+		run->latency = (double *)realloc(run->latency,
+				sizeof(double) * run->latencySize);
+	}
+	run->latency[run->latencyCount++] = seconds;
+}
+
+/*
+ * Replay a game against the server, checking that everything each player
+ * sent reaches the other one. Sets run->error if the game couldn't be
+ * played back at all.
+ * Returns the number of mismatches
+ */
+int play_game(Run* run) {
+	ReplayChunk* chunk = &run->chunk;
+	FILE* serverGet[2] = {NULL, NULL};
+	FILE* serverSend[2] = {NULL, NULL};
+	char users[2][80];
+	int joined = 0;
+	ReplayRecord rec;
+	char line[1024];
+	double due = 0;
+	double start = 0, sent;
+
+	/* Players join in the order they were recorded */
+	while(joined < 2 && replay_next(chunk, &rec)) {
+		if(rec.type == REC_WAIT) {
+			keep_pace(run, &due, rec.wait);
+		}
+		if(rec.type != REC_HANDSHAKE) {
+			continue;
+		}
+		snprintf(users[rec.player], 80, "%.*s%s", (int)rec.textLen, rec.text,
+				run->suffix);
+		int fd = connect_to_server(run->port);
+		if(fd < 0) {
+			run->error = ERR_NET;
+			break;
+		}
+		if(joined == 0) {
+			start = now();
+		}
+		/* Each stream closes its own descriptor, or one closed twice
+		 * could be another game's by then */
+		serverGet[rec.player] = fdopen(fd, "r");
+		serverSend[rec.player] = fdopen(dup(fd), "w");
+		if(serverGet[rec.player] == NULL || serverSend[rec.player] == NULL) {
+			run->error = ERR_NET;
+			break;
+		}
+		if(!join_game(serverGet[rec.player], serverSend[rec.player],
+				users[rec.player], run->game, chunk)) {
+			fprintf(stdout, "player %d: rules differ from recording\n",
+					rec.player);
+			run->mismatches++;
+		}
+		joined++;
+	}
+	if(joined < 2 && run->error == 0) {
+		run->error = ERR_GAME;
+	}
+	bool playing = run->error == 0;
+	if(playing && !expect(serverGet[0], 0, "$yourmove\n")) {
+		run->mismatches++;
+		playing = false;
+	}
+
+	/* Send each message and wait for it to come out the other side */
+	while(playing && replay_next(chunk, &rec)) {
+		if(rec.type == REC_WAIT) {
+			keep_pace(run, &due, rec.wait);
+		}
+		if(!replay_format(&rec, line, sizeof(line))) {
+			continue;
+		}
+		fprintf(serverSend[rec.player], "%s", line);
+		fflush(serverSend[rec.player]);
+		sent = now();
+		run->messages++;
+		if(!expect(serverGet[!rec.player], !rec.player, line)) {
+			run->mismatches++;
+			break;
+		}
+		add_latency(run, now() - sent);
+	}
+	run->seconds = joined > 0 ? now() - start : 0;
+
+	for(int i = 0; i < 2; i++) {
+		if(serverGet[i] != NULL) {
+			fclose(serverGet[i]);
+		}
+		if(serverSend[i] != NULL) {
+			fclose(serverSend[i]);
+		}
+	}
+	return run->mismatches;
+}
+
+void* run_thread(void* arg) {
+	play_game((Run *)arg);
+	return NULL;
+}
+
+int compare_doubles(const void* a, const void* b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Returns the p quantile of sorted, in microseconds
+ */
+double percentile(const double* sorted, int count, double p) {
+	if(count == 0) {
+		return 0;
+	}
+	return sorted[(int)(p * (count - 1))] * 1e6;
+}
+
+/*
+ * Play every recorded game back at once, copies times over, each game at
+ * the pace it was recorded times speed, or flat out if speed is 0. Game
+ * and user ids get the copy number added so no two runs meet.
+ * Prints one line of JSON, as make bench does:
+ *     {"bench": "replay_load", "games": 200, "connections": 400, ...
+ *      "msgs_per_sec": 51234.5, "p50_us": 41.2, "p99_us": 180.3, ...}
+ * Returns the number of games that didn't play back as recorded
+ */
+int load_games(FILE* data, FILE* index, int port, double speed,
+		int copies) {
+	uint64_t count = replay_count(index);
+	int runCount = (int)count * copies;
+	Run* runs = (Run *)calloc(runCount, sizeof(Run));
+	pthread_t* threads = (pthread_t *)malloc(sizeof(pthread_t) * runCount);
+	bool* started = (bool *)calloc(runCount, sizeof(bool));
+	ReplayChunk* chunks = (ReplayChunk *)malloc(sizeof(ReplayChunk) * count);
+	pthread_attr_t attr;
+	struct rlimit files;
+
+	/* Two connections a game */
+	if(getrlimit(RLIMIT_NOFILE, &files) == 0) {
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+
+	for(uint64_t i = 0; i < count; i++) {
+		if(!replay_load(data, index, i, &chunks[i])) {
+			throw_error(ERR_GAME);
+		}
+	}
+	for(int i = 0; i < runCount; i++) {
+		Run* run = &runs[i];
+		ReplayChunk* chunk = &chunks[i % count];
+		int copy = i / count;
+		run->chunk = *chunk;
+		run->port = port;
+		run->speed = speed;
+		snprintf(run->game, sizeof(run->game), "%.50s.%llu.%d", chunk->id,
+				(unsigned long long)chunk->serial, copy);
+		snprintf(run->suffix, sizeof(run->suffix), ".%d", copy);
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, RUN_STACK);
+	double start = now();
+	for(int i = 0; i < runCount; i++) {
+		runs[i].start = start;
+		started[i] = pthread_create(&threads[i], &attr, run_thread,
+				&runs[i]) == 0;
+	}
+	for(int i = 0; i < runCount; i++) {
+		if(started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+	double seconds = now() - start;
+	pthread_attr_destroy(&attr);
+
+	/* Put every game's latencies together */
+	long long messages = 0;
+	int latencyCount = 0, failed = 0, mismatched = 0;
+	for(int i = 0; i < runCount; i++) {
+		messages += runs[i].messages;
+		latencyCount += runs[i].latencyCount;
+		if(!started[i] || runs[i].error != 0) {
+			failed++;
+		} else if(runs[i].mismatches > 0) {
+			mismatched++;
+		}
+	}
+	double* latency = (double *)malloc(sizeof(double) * (latencyCount + 1));
+	latencyCount = 0;
+	for(int i = 0; i < runCount; i++) {
+		memcpy(latency + latencyCount, runs[i].latency,
+				sizeof(double) * runs[i].latencyCount);
+		latencyCount += runs[i].latencyCount;
+		free(runs[i].latency);
+	}
+	qsort(latency, latencyCount, sizeof(double), compare_doubles);
+
+	fprintf(stdout, "{\"bench\": \"replay_load\", \"games\": %d, "
+			"\"connections\": %d, \"speed\": %g, \"failed\": %d, "
+			"\"mismatched\": %d, \"messages\": %lld, \"seconds\": %.4f, "
+			"\"msgs_per_sec\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+			"\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}\n",
+			runCount, 2 * runCount, speed, failed, mismatched, messages,
+			seconds, seconds > 0 ? messages / seconds : 0,
+			percentile(latency, latencyCount, 0.5),
+			percentile(latency, latencyCount, 0.9),
+			percentile(latency, latencyCount, 0.99),
+			percentile(latency, latencyCount, 0.999),
+			percentile(latency, latencyCount, 1));
+	fflush(stdout);
+
+	free(latency);
+	for(uint64_t i = 0; i < count; i++) {
+		replay_free(&chunks[i]);
+	}
+	free(chunks);
+	free(started);
+	free(threads);
+	free(runs);
+	return failed + mismatched;
+}
+
+/*
+ * Read a port, which must be a number from 0 to 65535
+ */
+int read_port(const char* arg) {
+	int port;
+	if(sscanf(arg, "%d", &port) != 1 || port < 0 || port > 65535) {
+		throw_error(ERR_TYPE_P);
+	}
+	return port;
+}
+
+int main(int argc, char* argv[]) {
+	if(argc < 2 || argc > 6 ||
+			(argc > 4 && strcmp(argv[2], "load") != 0)) {
+		throw_error(ERR_NUM_P);
+	}
+
+	/* Open the replay and its index */
+	FILE* data = fopen(argv[1], "rb");
+	char* indexPath = (char *)malloc(strlen(argv[1]) +
+			strlen(REPLAY_INDEX_EXT) + 1);
+	sprintf(indexPath, "%s%s", argv[1], REPLAY_INDEX_EXT);
+	FILE* index = fopen(indexPath, "rb");
+	free(indexPath);
+	if(data == NULL || index == NULL) {
+		throw_error(ERR_FILE);
+	}
+
+	if(argc == 2) {
+		list_games(data, index);
+		return 0;
+	}
+
+	/* Every game at once, at the recorded pace or faster */
+	if(strcmp(argv[2], "load") == 0) {
+		double speed = 1;
+		int copies = 1;
+		if(argc < 4) {
+			throw_error(ERR_NUM_P);
+		}
+		int port = read_port(argv[3]);
+		if(argc > 4 && strcmp(argv[4], "max") == 0) {
+			speed = 0;
+		} else if(argc > 4 && (sscanf(argv[4], "%lf", &speed) != 1 ||
+				speed <= 0)) {
+			throw_error(ERR_TYPE_P);
+		}
+		if(argc > 5 && (sscanf(argv[5], "%d", &copies) != 1 ||
+				copies < 1)) {
+			throw_error(ERR_TYPE_P);
+		}
+		if(load_games(data, index, port, speed, copies) != 0) {
+			throw_error(ERR_DIFF);
+		}
+		return 0;
+	}
+
+	unsigned long long serial;
+	Run run;
+	memset(&run, 0, sizeof(run));
+	if(sscanf(argv[2], "%llu", &serial) != 1) {
+		throw_error(ERR_TYPE_P);
+	}
+	if(!replay_load(data, index, serial, &run.chunk)) {
+		throw_error(ERR_GAME);
+	}
+
+	if(argc == 3) {
+		dump_game(&run.chunk);
+		return 0;
+	}
+
+	/* One game as fast as it will go */
+	run.port = read_port(argv[3]);
+	snprintf(run.game, sizeof(run.game), "%s", run.chunk.id);
+	play_game(&run);
+	if(run.error != 0) {
+		throw_error(run.error);
+	}
+	fprintf(stdout, "game %llu: %d messages in %.3f s, %d mismatches\n",
+			serial, run.messages, run.seconds, run.mismatches);
+	if(run.mismatches != 0) {
+		throw_error(ERR_DIFF);
+	}
+	replay_free(&run.chunk);
+	free(run.latency);
+	return 0;
+}
@@ -10,13 +10,40 @@
 #include <stdlib.h>	
 #include <ctype.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 /* Other */
 #include <pthread.h>	// For using threads
+#include <poll.h>		// For the supervisor's connections
+#include <sys/wait.h>	// For noticing workers die
+#include <sys/resource.h>	// For closing every fd before an upgrade
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <sys/prctl.h>	// So workers go with the supervisor
+#endif
+#include <sched.h>		// For sched_yield
 #include <signal.h>		// For handling signals
 
+#include "replay.h"		// For recording games
+#include "ring.h"		// Queues of messages waiting to be sent
+#include "conn.h"		// Reading and writing sockets
+#include "trace.h"		// Following moves through the server
+#include "protocol.h"	// Naming and parsing messages
+#include "ladder.h"		// Ranking users by rating
+#include "shared.h"		// State shared by preforked workers
+#include "limit.h"		// Connections allowed from each address
+#include "store.h"		// Users not kept in memory
+#include "table.h"		// Finding and counting games
+#include "intern.h"		// Ids as numbers
+
 
 /* Errors */
 #define ERR_NUM_P	1	// Error in number of parameters
@@ -34,6 +61,24 @@
 #define LOG_WIN			6	// Game over -- win
 #define LOG_DISCON		7	// Client disconnects before game over
 #define LOG_BAD_MAP		8	// Client disconnects due to bad map
+#define LOG_RESUME		9	// Client comes back after dropping out
+#define LOG_NO_RULES	10	// Client asks for rules the server hasn't got
+#define LOG_RULES_CON	11	// Connection attempt to a game with other rules
+#define LOG_WORKER		12	// A preforked worker died and was replaced
+#define LOG_LIMITED		13	// An address starts having connections refused
+#define LOG_IDLE		14	// A game expires waiting for players
+#define LOG_DRAIN		15	// Server stops taking games and drains
+#define LOG_UPGRADE		16	// Server hands over to a new server
+#define LOG_NO_UPGRADE	17	// A new server couldn't be started
+
+/* Other Constants */
+#define TOKEN_LEN		16	// Hex digits in a resume token
+#define HIGH_WATER		8	// Unsent messages before a player is dropped
+#define TOP_MAX			100	// Most users a $top query lists
+#define PENDING_MAX		64	// Connections the supervisor reads at once
+#define MUX_CHANNELS	256	// Games one connection may carry at once
+#define RECORD_MAX		65536	// Longest message between servers handing over
+#define RULES_MAX		256		// Most rule sets, so a game's fits in a byte
 
 /* Structures */
 
@@ -42,189 +87,617 @@
  * All users are linked as a unidirectional list
  */
 typedef struct User {	// A linked list of users
-	char* id;	    // Name of the user
+	char* id;	    // Name of the user, interned
+    unsigned int handle;    // What id is interned as
 	int disconns;	// Number of disconnects for this user
 	int won;		// Number of games won for this user
 	int lost;		// Number of games lost for this user
+    LadderNode rank;    // Rating and place on the ladder
+    SharedUser* slot;   // Stats every worker sees, NULL if not preforked
+    int refs;           // Threads and games holding the user
+    time_t lastSeen;    // When the last of them let go
 	struct User* next;
 } User;
 
 /*
- * A game type contains information about a currently running game
- * A game can have maximum 2 users playing at once.
+ * A rules file, read once at startup and shared read only by every
+ * game played with it
+ */
+typedef struct RuleSet {
+    char* name;         // File name less any .rules, chosen at handshake
+    char* text;         // Sent to clients as it is
+    size_t len;
+    uint64_t hash;      // Identifies the rules to clients and in replays
+    int number;         // Where it is in ruleSets
+} RuleSet;
+
+/*
+ * A request one player made of the other that has been answered
  */
-typedef struct Game {
-	char* id;		// The name of this game
-	User* users[2];	// References players of this game (at most two)
-	int fd[2];		// The socket each user is associated with
+typedef struct Move {
+    int player;         // Who asked
+    unsigned int x, y;  // Where
+    bool hit;           // What the answer was
+} Move;
 
-    /* To know when game is full */
-    pthread_cond_t startCond;   // To know whether to start
-    pthread_mutex_t startMutex;
-    bool start;
-} Game;
+/*
+ * What a game keeps once it has moves, outboxes or a replay. The rest of
+ * a game, and all of one waiting for players, is in gameTable by entry,
+ * and the server refers to a game by its entry.
+ */
+typedef struct Play {
+    pthread_cond_t cond;    // Wakes its players' threads once it has started
+    SharedGame* slot;   // Where other processes see it, NULL if not preforked
+    ReplayGame* replay; // Moves so far, NULL if not recording
+
+    /* So the game can carry on after a server restart */
+    Move* moves;        // Answered requests, oldest first
+    int nMoves;
+    int movesSize;
+    bool pending;       // The last move hasn't been answered yet
+    int resume;         // Who makes the next request if play is interrupted
+
+    /* So a player who drops out can come back */
+    Ring* outbox[2];    // Messages for each player, sent by their own thread,
+                        // NULL until the game starts
+    unsigned int received[2];   // Messages received from each player
+    bool resumed[2];    // Player is back and needs to catch up
+    unsigned int seen[2];   // How many messages they had when they came back
+
+    /* So the I/O thread can relay it with no thread waiting on it */
+    Conn* seats[2];     // Each player's connection, NULL unless relayed
+    User* users[2];     // Who each seat is played for while relayed
+} Play;
+
+/*
+ * Copies of a user's and a game's stats, taken for a stats dump
+ */
+typedef struct UserStats {
+    const char* id;     // Users aren't freed while a dump is reading them
+    int won, lost, disconns, rating;
+} UserStats;
+
+typedef struct GameStats {
+    char id[80];
+    const char* players[2]; // Ids, NULL for an empty seat
+    const char* rules;
+    int moves;
+} GameStats;
 
 /* Global variables */
 int maxGames = 0;   // Max number of games
 
-FILE* rules;    // The rules file
-pthread_mutex_t rulesMutex; // Synchronize access to the rules file
+RuleSet** ruleSets = NULL;  // Every set of rules offered, by name
+int nRuleSets = 0;
+RuleSet* defaultRules = NULL;   // For clients that don't choose
+
+ReplayLog* replayLog = NULL;    // Where finished games are recorded
 
 User* userListHead = NULL;	// This will point to the first user
+User** userIndex[INTERN_CHUNKS];    // Users by the handle of their id, in
+                                    // chunks that never move
 pthread_mutex_t userListMutex;	// Lock mutex when adding or updating users
+Ladder ladder;  // Users by rating, also guarded by userListMutex
+unsigned int statsSeq = 0;  // Odd while user stats are being changed
+char* statsPath = NULL;     // Where SIGHUP dumps stats, NULL for stdout
+
+Shared* shared = NULL;  // Shared by every process, NULL unless preforked
+int workerNum = -1;     // Which worker this process is, -1 if not one
+
+bool limiting = false;  // Connections per address are limited
+bool relayed = false;   // The I/O thread relays games in play
 
-Game** gameArray = NULL;    // Array of current games
-pthread_mutex_t gameListMutex;	// Lock mutex when adding or updating games
+GameTable gameTable;    // Current games, each locked by its shard
+pthread_mutex_t gameListMutex;	// Lock mutex when adding or removing games
 
 FILE* logFile = NULL;   // The log file
 pthread_mutex_t logMutex;   // Lock the log file before writing to it
 
+char* snapshotPath = NULL;  // Where state is saved, NULL if not saving
+int snapshotInterval = 10;  // Seconds between snapshots
+int graceSeconds = 30;      // How long a dropped player's seat is held
+FILE* journal = NULL;       // Changes since the last snapshot
+unsigned long journalNum = 0;   // Which journal file is current
+pthread_mutex_t journalMutex;   // Lock the journal before writing to it
+pthread_rwlock_t snapshotLock;  // Write locked while state is copied
+
+int idleSeconds = 0;        // How long a game may wait to start, 0 for ever
+UserStore* userStore = NULL;    // Where cold users go, NULL to keep them
+int coldSeconds = 600;      // How long a user is kept after they leave
+size_t gameBytes = 0;       // Held by games' records and their moves
+size_t userBytes = 0;       // Held by users
+unsigned int statsReaders = 0;  // Dumps walking the user list
+int batchMicros = 0;        // How long a multiplexed connection gathers
+                            // frames before sending, 0 to send at once
+
+char** serverArgv = NULL;   // As started, to start an upgrade the same way
+int listenFd = -1;          // The listening socket
+bool draining = false;      // No new games, going once the last one ends
+int drainSeconds = 60;      // Longest a drain waits for games to end
+int handoverFd = -1;        // To the server this one hands over to, or took
+                            // over from, -1 if there is none
+bool handingOver = false;   // Handed over, only finishing games here
+pthread_mutex_t handoverMutex;  // Messages to the other server go out whole
+pthread_mutex_t saveMutex;  // One snapshot saved at a time
+
 /* Helper functions for Stuctures */
 
+/*
+ * Take a user's stats from their shared slot, which every worker updates
+ * Called with userListMutex held
+ */
+void pull_stats(User* user) {
+    SharedUser* slot = user->slot;
+    int rating = __atomic_load_n(&slot->rating, __ATOMIC_RELAXED);
+
+    user->won = __atomic_load_n(&slot->won, __ATOMIC_RELAXED);
+    user->lost = __atomic_load_n(&slot->lost, __ATOMIC_RELAXED);
+    user->disconns = __atomic_load_n(&slot->disconns, __ATOMIC_RELAXED);
+    if(rating != user->rank.rating) {
+        ladder_set_rating(&ladder, &user->rank, rating);
+    }
+}
+
+/*
+ * Returns the user whose id is interned as handle, NULL if none is in
+ * memory. Chunks never move, so anyone holding the user may look without
+ * the lock.
+ */
+User* user_of(unsigned int handle) {
+    User** chunk = __atomic_load_n(&userIndex[handle / INTERN_CHUNK],
+            __ATOMIC_ACQUIRE);
+    if(chunk == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(&chunk[handle % INTERN_CHUNK], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Index user by handle, or take handle out of the index if user is NULL
+ * Called with userListMutex held, the handle's chunk already made
+ */
+void set_user(unsigned int handle, User* user) {
+    __atomic_store_n(&userIndex[handle / INTERN_CHUNK][handle % INTERN_CHUNK],
+            user, __ATOMIC_RELEASE);
+}
+
 /* 
  * Push a new user onto the list
+ * Called with userListMutex held
  */
-void push_user(User** userHeadRef, char* id) {
+User* push_user(User** userHeadRef, char* id) {
 	User* newUser = (User*)malloc(sizeof(User));
 
-    newUser->id = (char *)malloc(sizeof(char) * (strlen(id) + 1));
-	strcpy(newUser->id, id);
+    newUser->handle = intern(id);
+    newUser->id = (char *)intern_name(newUser->handle);
 	newUser->disconns = 0;
 	newUser->won = 0;
 	newUser->lost = 0;
 	newUser->next = *userHeadRef;
+    newUser->slot = shared ? shared_user(shared, id, ELO_START, workerNum) :
+            NULL;
+    newUser->refs = 0;
+    newUser->lastSeen = time(NULL);
+    __atomic_add_fetch(&userBytes, sizeof(User), __ATOMIC_RELAXED);
+
+    User*** chunk = &userIndex[newUser->handle / INTERN_CHUNK];
+    if(*chunk == NULL) {
+        __atomic_store_n(chunk, (User **)calloc(INTERN_CHUNK,
+                sizeof(User *)), __ATOMIC_RELEASE);
+        __atomic_add_fetch(&userBytes, sizeof(User *) * INTERN_CHUNK,
+                __ATOMIC_RELAXED);
+    }
+    set_user(newUser->handle, newUser);
 
-	pthread_mutex_lock(&userListMutex);
-	*userHeadRef = newUser;
-	pthread_mutex_unlock(&userListMutex);
+    ladder_insert(&ladder, &newUser->rank, newUser->id, ELO_START);
+    if(newUser->slot != NULL) {
+        pull_stats(newUser);    // They may have played in other workers
+    }
+    /* Stats dumps walk the list without the lock */
+	__atomic_store_n(userHeadRef, newUser, __ATOMIC_RELEASE);
+    return newUser;
+}
+
+/* 
+ * Returns a pointer to the found user, NULL if can't be found 
+ * Called with userListMutex held, so no user can let go of id
+ */
+User* find_user(char* id) {
+    unsigned int handle = intern_find(id);
+    if(handle == INTERN_NONE) {
+        return NULL;
+    }
+    return user_of(handle);
 }
 
 /*
- * Print stats of all users in the list
+ * Free a user already taken off the list and out of the index
  */
-void print_user_stats(User* userListHead) {
-	User* current = userListHead;
+void free_user(User* user) {
+    __atomic_add_fetch(&userBytes, -sizeof(User), __ATOMIC_RELAXED);
+    intern_release(user->handle);
+    free(user);
+}
 
-	while(current) {
-		fprintf(stdout, "%s\t", current->id);
-		fprintf(stdout, "%d\t", current->won);
-		fprintf(stdout, "%d\t", current->lost);
-		fprintf(stdout, "%d\n", current->disconns);
-        fflush(stdout);
-		current = current->next;
-	}
+/*
+ * Let go of a user held by get_user or a game. A user with no one
+ * holding them may be spilled once they are cold.
+ */
+void put_user(User* user) {
+    if(user == NULL) {
+        return;
+    }
+    __atomic_store_n(&user->lastSeen, time(NULL), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&user->refs, -1, __ATOMIC_RELEASE);
 }
 
-/* 
- * Returns a pointer to the found user, NULL if can't be found 
+/*
+ * Returns the name of the game at entry game
  */
-User* find_user(User* userListHead, char* id) {
-	User* current = userListHead;
-	while(current) {
-		if(strcmp(current->id, id) == 0) {
-			return current;
-		}
-		current = current->next;
-	}
-	return NULL;
+const char* game_name(int game) {
+    return intern_name(gameTable.ids[game]);
+}
+
+/*
+ * Returns the user in a seat of game, NULL if it is empty
+ */
+User* seated(int game, int player) {
+    unsigned int handle = gameTable.players[game][player];
+    return handle == INTERN_NONE ? NULL : user_of(handle);
+}
+
+/*
+ * Returns the rules game is played by
+ */
+RuleSet* game_rules(int game) {
+    return ruleSets[gameTable.rules[game]];
+}
+
+/*
+ * Returns the record of game, NULL if it hasn't needed one yet
+ */
+Play* play_of(int game) {
+    return (Play *)gameTable.games[game];
+}
+
+/*
+ * Returns the record of game, making it if it has none yet
+ * Called with gameListMutex or the game's lock held
+ */
+Play* need_play(int game) {
+    Play* play = play_of(game);
+    if(play == NULL) {
+        play = (Play *)calloc(1, sizeof(Play));
+        pthread_cond_init(&play->cond, NULL);
+        gameTable.games[game] = play;
+        __atomic_add_fetch(&gameBytes, sizeof(Play), __ATOMIC_RELAXED);
+    }
+    return play;
+}
+
+void lock_game(int game) {
+    pthread_mutex_lock(table_lock(&gameTable, game));
+}
+
+void unlock_game(int game) {
+    pthread_mutex_unlock(table_lock(&gameTable, game));
+}
+
+/*
+ * Returns what the threads playing game wait on with its lock held: its
+ * shard's until it starts, then its own
+ */
+pthread_cond_t* game_cond(int game) {
+    if(gameTable.flags[game] & TABLE_STARTED) {
+        return &play_of(game)->cond;
+    }
+    return table_cond(&gameTable, game);
+}
+
+/*
+ * Put user in a seat of game, which holds them while they are in it
+ */
+void seat_user(int game, int player, User* user) {
+    User* old = seated(game, player);
+    if(old == user) {
+        return;
+    }
+    if(user != NULL) {
+        __atomic_add_fetch(&user->refs, 1, __ATOMIC_RELAXED);
+    }
+    put_user(old);
+    gameTable.players[game][player] = user ? user->handle : INTERN_NONE;
 }
 
 /*
  * Returns true if all game slots are taken, false otherwise 
  */
-bool at_max_games(Game* gameArray[], int maxGames) {
-    for(int i = 0; i < maxGames; i++) {
-        if(gameArray[i] == NULL) {
-            return false;
+bool at_max_games(GameTable* table) {
+    return table->count == table->max;
+}
+
+/*
+ * Push a new game into the table, which mustn't be full. Only a game
+ * being recorded needs a record from the start.
+ * Called with gameListMutex held
+ * Returns the game's entry
+ */
+int push_game(GameTable* table, char* id, RuleSet* rules) {
+    int game = table_add(table, intern(id), time(NULL), rules->number);
+
+    if(replayLog != NULL) {
+        need_play(game)->replay = replay_start(id, rules->hash);
+    }
+    return game;
+}
+
+/*
+ * Give both players somewhere to queue messages as the game starts. Most
+ * of a game is its outboxes, and a game waiting for players has none.
+ * Called with the game's lock held
+ */
+void open_outboxes(int game) {
+    Play* play = need_play(game);
+
+    for(int i = 0; i < 2; i++) {
+        if(play->outbox[i] == NULL) {
+            play->outbox[i] = (Ring *)malloc(sizeof(Ring));
+            ring_init(play->outbox[i]);
+            __atomic_add_fetch(&gameBytes, sizeof(Ring), __ATOMIC_RELAXED);
         }
     }
-    return true;
 }
 
 /*
- * Push a new game onto the array
+ * Remove game from the table
+ * Called with gameListMutex held
  */
-Game* push_game(Game** gameArray, char* id) {
-	Game* newGame = (Game *)malloc(sizeof(Game));
+void remove_game(GameTable* table, int game) {
+    Play* play = play_of(game);
 
-    newGame->id = (char *)malloc(sizeof(char) * (strlen(id) + 1));
-	strcpy(newGame->id, id);
-	(newGame->users)[0] = NULL;
-	(newGame->users)[1] = NULL;
-	(newGame->fd)[0] = -1;
-	(newGame->fd)[1] = -1;
-    pthread_cond_init(&newGame->startCond, NULL);
-    pthread_mutex_init(&newGame->startMutex, NULL);
-    newGame->start = false;
+    for(int i = 0; i < 2; i++) {
+        seat_user(game, i, NULL);
+    }
+    if(play != NULL) {
+        if(play->slot != NULL) {
+            shared_game_release(shared, play->slot);
+        }
+        if(play->replay != NULL) {
+            replay_drop(play->replay);  // It never finished
+        }
+        for(int i = 0; i < 2; i++) {
+            if(play->outbox[i] != NULL) {
+                __atomic_add_fetch(&gameBytes, -sizeof(Ring),
+                        __ATOMIC_RELAXED);
+                free(play->outbox[i]);
+            }
+        }
+        __atomic_add_fetch(&gameBytes, -(sizeof(Play) +
+                sizeof(Move) * play->movesSize), __ATOMIC_RELAXED);
+        pthread_cond_destroy(&play->cond);
+        free(play->moves);
+        free(play);
+    }
+    intern_release(table->ids[game]);
+    table_remove(table, game);
+}
 
-	pthread_mutex_lock(&gameListMutex);
-	for(int i = 0; i < maxGames; i++) {
-		if(gameArray[i] == NULL) {
-			gameArray[i] = newGame;
-			gameArray[i+1] = NULL;
-			break;
-		}
-	}
-	pthread_mutex_unlock(&gameListMutex);
-    return newGame;
+/*
+ * Returns the game called id, -1 if there isn't one
+ * Called with gameListMutex held, so no game can let go of id
+ */
+int find_game(GameTable* table, char *id) {
+    unsigned int handle = intern_find(id);
+    if(handle == INTERN_NONE) {
+        return -1;
+    }
+    int game = table_find(table, handle);
+    if(game < 0 || (table->flags[game] & TABLE_ENDED)) {
+        return -1;  // Ending, if not yet marked so
+    }
+    return game;
 }
 
 /*
- * Remove game from the array
+ * Move a game on to phase, so scans of the table see it without looking
+ * at the game. Games never go back a phase.
  */
-void remove_game(Game* gameArray[], Game* game) {
-    int i = 0;
+void set_phase(int game, uint8_t phase) {
+    pthread_mutex_lock(&gameListMutex);
+    if(gameTable.phases[game] < phase) {
+        gameTable.phases[game] = phase;
+    }
+    pthread_mutex_unlock(&gameListMutex);
+}
 
-    /* Find and remove game */
-    for(i = 0; i < maxGames; i++) {
-        if(gameArray[i] == game) {
-            free(game);
+/*
+ * Track a message a player sent so play can resume from the last
+ * complete exchange if the server restarts
+ * Called with the game's lock held
+ */
+void record_move(int game, int player, const char* message) {
+    Play* play = need_play(game);
+    unsigned int x, y;
+    const char* args;
+
+    switch(proto_command(message, &args)) {
+        case CMD_REQUEST:
+            if(!proto_coords(args, &x, &y)) {
+                break;
+            }
+            if(play->nMoves == play->movesSize) {
+                int grown = play->movesSize ? play->movesSize * 2 : 16;
+                __atomic_add_fetch(&gameBytes, sizeof(Move) *
+                        (grown - play->movesSize), __ATOMIC_RELAXED);
+                play->movesSize = grown;
+                play->moves = (Move *)realloc(play->moves,
+                        sizeof(Move) * play->movesSize);
+            }
+            play->moves[play->nMoves].player = player;
+            play->moves[play->nMoves].x = x;
+            play->moves[play->nMoves].y = y;
+            play->moves[play->nMoves].hit = false;
+            play->nMoves++;
+            if(play->slot != NULL) {
+                __atomic_store_n(&play->slot->moves, play->nMoves,
+                        __ATOMIC_RELAXED);
+            }
+            play->pending = true;
+            play->resume = player;  // Ask again if unanswered
+            break;
+        case CMD_RESPONSE:
+            if(play->pending) {
+                play->moves[play->nMoves - 1].hit =
+                        strcmp(args, "miss\n") != 0;
+            }
+            play->pending = false;
+            play->resume = player;  // Whoever answered asks next
+            break;
+        case CMD_YOURMOVE:
+            play->resume = !player;
+            break;
+        default:
             break;
-        }
     }
+}
 
-    /* Shift down other games */
-    for(int j = i; j < maxGames; j++) {
-        gameArray[j] = gameArray[j + 1];
+/*
+ * Returns the slot user held in a game restored from a snapshot,
+ * -1 if they have no slot waiting for them
+ */
+int restored_slot(int game, User* user) {
+    for(int i = 0; i < 2; i++) {
+        if(gameTable.players[game][i] == user->handle &&
+                gameTable.conns[game][i] == -1) {
+            return i;
+        }
     }
+    return -1;
 }
 
-void print_game_stats(Game* gameArray[]) {
-    Game* current;
-	fprintf(stdout, "\nGame Stats:\n");
-    fflush(stdout);
-    for(int i = 0; gameArray[i] != NULL; i++) {
-        current = gameArray[i];
-		fprintf(stdout, "%s\t", current->id);
-		fprintf(stdout, "%p\t", (void *)current->users[0]);
-		fprintf(stdout, "%p\t", (void *)current->users[1]);
-		fprintf(stdout, "%d\t", current->fd[0]);
-		fprintf(stdout, "%d\n", current->fd[1]);
-        fflush(stdout);
+/* 
+ * Returns true if game is full (has 2 users)
+ */
+bool is_full_game(int game) {
+    return gameTable.players[game][0] != INTERN_NONE &&
+            gameTable.players[game][1] != INTERN_NONE;
+}
+
+/* Rules Functions */
+
+/*
+ * Returns the rules called name, NULL if there are none
+ */
+RuleSet* find_rules(const char* name) {
+    for(int i = 0; i < nRuleSets; i++) {
+        if(strcmp(ruleSets[i]->name, name) == 0) {
+            return ruleSets[i];
+        }
     }
+    return NULL;
 }
 
 /*
- * Returns a pointer to the game if found, NULL otherwise
+ * Returns the rules with the given hash, NULL if there are none
  */
-Game* find_game(Game* gameArray[], char *id) {
-    for(int i = 0; gameArray[i] != NULL; i++) {
-        if(strcmp(gameArray[i]->id, id) == 0) {
-            return gameArray[i];
+RuleSet* find_rules_by_hash(uint64_t hash) {
+    for(int i = 0; i < nRuleSets; i++) {
+        if(ruleSets[i]->hash == hash) {
+            return ruleSets[i];
         }
     }
     return NULL;
 }
 
-/* 
- * Returns true if game is full (has 2 users)
- * Assume game indicated by id exists 
+/*
+ * Read the rules file at path and offer it, named after the file
+ * Returns false if it can't be read, its name can't be sent or is taken,
+ * or there are RULES_MAX rule sets already
+ */
+bool load_rules(const char* path) {
+    const char* base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    char name[80];
+    size_t nameLen = strlen(base);
+    if(nameLen > 6 && strcmp(base + nameLen - 6, ".rules") == 0) {
+        nameLen -= 6;
+    }
+    if(nameLen == 0 || nameLen > 79 || strcspn(base, " \t\n") < nameLen) {
+        return false;
+    }
+    memcpy(name, base, nameLen);
+    name[nameLen] = '\0';
+
+    FILE* file;
+    if(nRuleSets == RULES_MAX || find_rules(name) != NULL ||
+            (file = fopen(path, "r")) == NULL) {
+        return false;
+    }
+    RuleSet* set = (RuleSet *)malloc(sizeof(RuleSet));
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    set->text = (char *)malloc(size + 1);
+    set->len = fread(set->text, 1, size, file);
+    fclose(file);
+    set->name = (char *)malloc(nameLen + 1);
+    strcpy(set->name, name);
+    set->hash = replay_hash(set->text, set->len);
+    set->number = nRuleSets;
+
+    ruleSets = (RuleSet **)realloc(ruleSets,
+            sizeof(RuleSet *) * (nRuleSets + 1));
+    ruleSets[nRuleSets++] = set;
+    return true;
+}
+
+int compare_rules(const void* a, const void* b) {
+    return strcmp((*(RuleSet **)a)->name, (*(RuleSet **)b)->name);
+}
+
+/*
+ * Offer the rules in path, a rules file or a directory of them. With a
+ * directory the default is "standard" if there is one, otherwise the
+ * first by name.
+ * Returns false if no rules could be read
  */
-bool is_full_game(Game* gameArray[], char *id) {
-    Game* theGame = find_game(gameArray, id);
-    if(theGame->users[0] == NULL || theGame->users[1] == NULL) {
+bool load_all_rules(const char* path) {
+    struct stat info;
+    if(stat(path, &info) != 0) {
+        return false;
+    }
+    if(!S_ISDIR(info.st_mode)) {
+        if(!load_rules(path)) {
+            return false;
+        }
+        defaultRules = ruleSets[0];
+        return true;
+    }
+
+    DIR* dir = opendir(path);
+    struct dirent* entry;
+    char filePath[1024];
+    if(dir == NULL) {
         return false;
     }
+    while((entry = readdir(dir)) != NULL) {
+        snprintf(filePath, sizeof(filePath), "%s/%s", path, entry->d_name);
+        if(entry->d_name[0] != '.' && stat(filePath, &info) == 0 &&
+                S_ISREG(info.st_mode)) {
+            load_rules(filePath);
+        }
+    }
+    closedir(dir);
+    if(nRuleSets == 0) {
+        return false;
+    }
+    qsort(ruleSets, nRuleSets, sizeof(RuleSet *), compare_rules);
+    for(int i = 0; i < nRuleSets; i++) {
+        ruleSets[i]->number = i;
+    }
+    defaultRules = find_rules("standard");
+    if(defaultRules == NULL) {
+        defaultRules = ruleSets[0];
+    }
     return true;
 }
 
@@ -236,7 +709,13 @@ bool is_full_game(Game* gameArray[], char *id) {
 void throw_error(int code) {
 	switch(code) {
 		case ERR_NUM_P:
-			fprintf(stderr, "Usage: nserver logfile max_games rules port\n");
+			fprintf(stderr, "Usage: nserver [-r replayfile] "
+                    "[-s snapshotfile [-S seconds]] [-g seconds] [-u] "
+                    "[-t tracefile] [-d statsfile[.json]] [-p workers] "
+                    "[-l rate[,burst]] [-e seconds] "
+                    "[-U storefile[,seconds]] [-w microseconds] "
+                    "[-D seconds] "
+                    "logfile max_games rules|rulesdir port\n");
 			break;
 		case ERR_TYPE_P:
 			fprintf(stderr, "Invalid param types or values.\n");
@@ -259,7 +738,8 @@ void throw_error(int code) {
  * Initialize logFile with code 0.
  * Further calls can have logFile NULL to use the same
  */
-void log_message(int code, FILE* logFile, char* id, char* game, int port) {
+void log_message(int code, FILE* logFile, const char* id,
+        const char* game, int port) {
 	static FILE* log;
 	if(logFile != NULL) {
 		log = logFile;
@@ -293,6 +773,34 @@ void log_message(int code, FILE* logFile, char* id, char* game, int port) {
 		case LOG_BAD_MAP:
 			sprintf(message, "%s disconnected due to bad map.\n", id);
 			break;
+		case LOG_RESUME:
+			sprintf(message, "%s resumed game %s.\n", id, game);
+			break;
+		case LOG_NO_RULES:
+			sprintf(message, "Rejected %s due to unknown rules.\n", id);
+			break;
+		case LOG_RULES_CON:
+			sprintf(message, "Rejected %s from game %s with other rules.\n",
+                    id, game);
+			break;
+		case LOG_WORKER:
+			sprintf(message, "Worker %d died and was restarted.\n", port);
+			break;
+		case LOG_LIMITED:
+			sprintf(message, "Refusing connections from %s.\n", id);
+			break;
+		case LOG_IDLE:
+			sprintf(message, "Game %s expired.\n", game);
+			break;
+		case LOG_DRAIN:
+			sprintf(message, "Server draining.\n");
+			break;
+		case LOG_UPGRADE:
+			sprintf(message, "Server handed over to process %d.\n", port);
+			break;
+		case LOG_NO_UPGRADE:
+			sprintf(message, "Server couldn't be upgraded.\n");
+			break;
 	}
 
 	if(log != NULL) {
@@ -303,315 +811,2471 @@ void log_message(int code, FILE* logFile, char* id, char* game, int port) {
 	}
 }
 
-/* 
- * Open a socket for the server to listen on 
+/*
+ * Append printf style output to a growing buffer
  */
-int open_listen(int port)
-{
-    int fd;	// The connection point for the server
-    struct sockaddr_in serverAddr;	// The address of the server
-    int optVal = 1;	// Allow immidiate reuse of address	
+void buffer_printf(char** buffer, size_t* len, size_t* size,
+        const char* format, ...) {
+    va_list args;
+    int n;
 
-    /* Create a socket - Internet - TCP */
-    fd = socket(AF_INET, SOCK_STREAM, 0);
-    if(fd < 0) {
-		throw_error(ERR_NET);
+    while(1) {
+        va_start(args, format);
+        n = vsnprintf(*buffer + *len, *size - *len, format, args);
+        va_end(args);
+        if(n >= 0 && *len + n < *size) {
+            *len += n;
+            return;
+        }
+        *size *= 2;
+        *buffer = (char *)realloc(*buffer, *size);
     }
+}
 
-    /* Set option on socket to immediately reuse address - otherwise
-    ** we can get an address in use error until timeout (after exit) 
-    */
-    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int)) < 0) {
-		throw_error(ERR_NET);
-    }
+/* Stats */
 
-    /* Create address structure for the adddress we're listening on */
-    serverAddr.sin_family = AF_INET;	// Internet address family 
-    serverAddr.sin_port = htons(port);	// Port number 
-	serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);	// Any IP address
+/*
+ * Changes to user stats go between these, with userListMutex held, so a
+ * stats dump can copy them without taking the lock. A change is at most a
+ * few stores, so a dump that overlaps one just tries again.
+ */
+void stats_begin(void) {
+    __atomic_store_n(&statsSeq, statsSeq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-    /* Bind the socket to this address - note the cast of address types */
-    if(bind(fd, (struct sockaddr*)&serverAddr, 
-                sizeof(struct sockaddr_in)) < 0){
-		throw_error(ERR_PORT);
-    }
+void stats_end(void) {
+    __atomic_store_n(&statsSeq, statsSeq + 1, __ATOMIC_RELEASE);
+}
 
-    /* Start listening for incoming connections. Second argument is
-    ** the maximum number of unaccepted connection requests that will be
-    ** queued by the OS. Agave value SOMAXCONN is 128.
-    */
-    if(listen(fd, SOMAXCONN) < 0) {
-		throw_error(ERR_NET);
-    }
+#define STAT(field)     __atomic_load_n(&(field), __ATOMIC_RELAXED)
 
-    return fd;
+/*
+ * Copy every user's stats as they were at one moment, without holding up
+ * players. Users are only ever added at the head of the list, and one
+ * taken out still leads on to the rest, so the list can be walked while
+ * it changes.
+ * Returns the number of users, copied into a new array at *stats
+ */
+int copy_user_stats(UserStats** stats) {
+    int n, size = 64;
+    unsigned int seq;
+
+    *stats = (UserStats *)malloc(sizeof(UserStats) * size);
+    do {
+        while((seq = __atomic_load_n(&statsSeq, __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+        }
+        n = 0;
+        for(User* user = __atomic_load_n(&userListHead, __ATOMIC_ACQUIRE);
+                user; user = user->next) {
+            if(n == size) {
+                size *= 2;
+                *stats = (UserStats *)realloc(*stats,
+                        sizeof(UserStats) * size);
+            }
+            (*stats)[n].id = user->id;
+            (*stats)[n].won = STAT(user->won);
+            (*stats)[n].lost = STAT(user->lost);
+            (*stats)[n].disconns = STAT(user->disconns);
+            (*stats)[n].rating = STAT(user->rank.rating);
+            n++;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while(__atomic_load_n(&statsSeq, __ATOMIC_RELAXED) != seq);
+    return n;
 }
 
-/* 
- * Parse client handshake 
+/*
+ * Copy the games every worker is running, as a supervisor has none of its
+ * own. Slots are read while their workers change them, so a game may be
+ * a move behind.
  */
-bool parse_handshake(int fd, char** user, char** game) {
-    ssize_t numBytesRead;
-    char buffer[1024];
-    while((numBytesRead = read(fd, buffer, 1024)) > 0) {
-        if(sscanf(buffer, "$handshake %s %s", *user, *game) == 2) {
-            return true; // Got it
+int copy_shared_games(GameStats* stats) {
+    int n = 0;
+
+    for(int i = 0; i < shared->maxGames; i++) {
+        SharedGame* slot = &shared->games[i];
+        if(!__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE)) {
+            continue;
         }
-        continue; // Try again
+        GameStats* copy = &stats[n++];
+        snprintf(copy->id, sizeof(copy->id), "%s", slot->id);
+        for(int j = 0; j < 2; j++) {
+            copy->players[j] = slot->players[j][0] ? slot->players[j] : NULL;
+        }
+        copy->rules = slot->rules;
+        copy->moves = STAT(slot->moves);
     }
-    return false; // Something's wrong
+    return n;
 }
 
 /*
- * Sends rules to client, parses response.
- * Returns 1 if OK
- * Returns 2 if Bad Map
- * Returns 0 if Connection Error
+ * Copy every running game. Games are freed when they end, so this holds
+ * the game list, but only for as long as the copy takes.
+ * Returns the number of games, copied into a new array at *stats
  */
-int parse_map(int fd, FILE* rules) {
-    FILE* clientSend = fdopen(fd, "w");
-    FILE* clientGet = fdopen(fd, "r");
-
-    /* Tell client to get ready for rules */
-    fprintf(clientSend, "$startrules\n");
-    fflush(clientSend);
+int copy_game_stats(GameStats** stats) {
+    int n = 0;
 
-    /* Send the rules */
-    char rule[80];
-    pthread_mutex_lock(&rulesMutex);
-    while(fgets(rule, 80, rules) != NULL) {
-        fprintf(clientSend, rule);
-        fflush(clientSend);
+    *stats = (GameStats *)malloc(sizeof(GameStats) * (maxGames + 1));
+    if(shared != NULL && workerNum < 0) {
+        return copy_shared_games(*stats);
     }
-    fseek(rules, 0, SEEK_SET);
-    pthread_mutex_unlock(&rulesMutex);
-
-    /* Tell client rules complete */
-    fprintf(clientSend, "$endrules\n");
-    fflush(clientSend);
-
-    char mapStatus[80];
-    while(fgets(mapStatus, 80, clientGet) != NULL) {
-        if(strcmp(mapStatus, "$map good\n") == 0) {
-            return 1; // Good map
-        } else if(strcmp(mapStatus, "$map bad\n") == 0) {
-            return 2; // Bad map
+    pthread_mutex_lock(&gameListMutex);
+    for(unsigned int i = 0; i < gameTable.high; i++) {
+        if(gameTable.phases[i] >= TABLE_OVER) {
+            continue;
         }
-        continue; // Try again
+        Play* play = (Play *)STAT(gameTable.games[i]);
+        GameStats* copy = &(*stats)[n++];
+        snprintf(copy->id, sizeof(copy->id), "%s", game_name(i));
+        for(int j = 0; j < 2; j++) {
+            User* user = seated(i, j);
+            copy->players[j] = user ? user->id : NULL;
+        }
+        copy->rules = game_rules(i)->name;
+        copy->moves = play ? STAT(play->nMoves) : 0;
     }
-    return 0; // Something's wrong
+    pthread_mutex_unlock(&gameListMutex);
+    return n;
 }
 
 /*
- * Called when a user disconnects 
+ * Append s as a JSON string, or null
  */
-void handle_disconnect(int fd, User* user, Game* game, bool first ) {
-    /* Close the appropriate socket */
-    close(fd);
-    
-    /* Increase disconnects for appropriate user */
-    if(user != NULL) {
-        pthread_mutex_lock(&userListMutex);
-        user->disconns++;
-        pthread_mutex_unlock(&userListMutex);
+void buffer_json(char** buffer, size_t* len, size_t* size, const char* s) {
+    if(s == NULL) {
+        buffer_printf(buffer, len, size, "null");
+        return;
     }
+    buffer_printf(buffer, len, size, "\"");
+    for(; *s != '\0'; s++) {
+        if(*s == '"' || *s == '\\') {
+            buffer_printf(buffer, len, size, "\\%c", *s);
+        } else if((unsigned char)*s < ' ') {
+            buffer_printf(buffer, len, size, "\\u%04x", *s);
+        } else {
+            buffer_printf(buffer, len, size, "%c", *s);
+        }
+    }
+    buffer_printf(buffer, len, size, "\"");
+}
 
-    if(game != NULL) {
+/*
+ * Write out user, game and memory stats, as JSON if statsPath ends in
+ * .json and as tab separated text otherwise. Stats are copied first and formatted
+ * from the copy, and a dump file is replaced in one step.
+ */
+void dump_stats(void) {
+    UserStats* users;
+    GameStats* games;
+
+    /* Holds off freeing users, whose ids the copy points to */
+    __atomic_add_fetch(&statsReaders, 1, __ATOMIC_SEQ_CST);
+    int nUsers = copy_user_stats(&users);
+    int nGames = copy_game_stats(&games);
+    LimitStats conns;
+    size_t len = 0, size = 4096;
+    char* buffer = (char *)malloc(size);
+    size_t pathLen = statsPath ? strlen(statsPath) : 0;
+    bool json = pathLen >= 5 && strcmp(statsPath + pathLen - 5, ".json") == 0;
+
+    if(limiting) {
+        limit_stats(&conns);
+    }
+
+    if(json) {
+        buffer_printf(&buffer, &len, &size, "{\"users\": [");
+        for(int i = 0; i < nUsers; i++) {
+            buffer_printf(&buffer, &len, &size, "%s\n{\"id\": ",
+                    i ? "," : "");
+            buffer_json(&buffer, &len, &size, users[i].id);
+            buffer_printf(&buffer, &len, &size, ", \"won\": %d, "
+                    "\"lost\": %d, \"disconns\": %d, \"rating\": %d}",
+                    users[i].won, users[i].lost, users[i].disconns,
+                    users[i].rating);
+        }
+        buffer_printf(&buffer, &len, &size, "],\n\"games\": [");
+        for(int i = 0; i < nGames; i++) {
+            buffer_printf(&buffer, &len, &size, "%s\n{\"id\": ",
+                    i ? "," : "");
+            buffer_json(&buffer, &len, &size, games[i].id);
+            buffer_printf(&buffer, &len, &size, ", \"players\": [");
+            buffer_json(&buffer, &len, &size, games[i].players[0]);
+            buffer_printf(&buffer, &len, &size, ", ");
+            buffer_json(&buffer, &len, &size, games[i].players[1]);
+            buffer_printf(&buffer, &len, &size, "], \"rules\": ");
+            buffer_json(&buffer, &len, &size, games[i].rules);
+            buffer_printf(&buffer, &len, &size, ", \"moves\": %d}",
+                    games[i].moves);
+        }
+        buffer_printf(&buffer, &len, &size, "]");
+        if(limiting) {
+            buffer_printf(&buffer, &len, &size, ",\n\"connections\": "
+                    "{\"admitted\": %lu, \"refused\": %lu, "
+                    "\"untracked\": %lu, \"limited\": %u}",
+                    conns.admitted, conns.refused, conns.untracked,
+                    conns.limited);
+        }
+        buffer_printf(&buffer, &len, &size, ",\n\"memory\": {\"games\": %zu, "
+                "\"users\": %zu, \"ids\": %zu, \"conns\": %zu, "
+                "\"replays\": %zu, \"stored\": %u}", STAT(gameBytes),
+                STAT(userBytes), intern_memory(), conn_memory(),
+                replay_memory(),
+                userStore ? STAT(userStore->count) : 0);
+        buffer_printf(&buffer, &len, &size, "}\n");
+    } else {
+        for(int i = 0; i < nUsers; i++) {
+            buffer_printf(&buffer, &len, &size, "%s\t%d\t%d\t%d\t%d\n",
+                    users[i].id, users[i].won, users[i].lost,
+                    users[i].disconns, users[i].rating);
+        }
+        buffer_printf(&buffer, &len, &size, "\nGame Stats:\n");
+        for(int i = 0; i < nGames; i++) {
+            buffer_printf(&buffer, &len, &size, "%s\t%s\t%s\t%s\t%d\n",
+                    games[i].id,
+                    games[i].players[0] ? games[i].players[0] : "-",
+                    games[i].players[1] ? games[i].players[1] : "-",
+                    games[i].rules, games[i].moves);
+        }
+        if(limiting) {
+            buffer_printf(&buffer, &len, &size, "\nConnection Stats:\n"
+                    "admitted\t%lu\nrefused\t%lu\nuntracked\t%lu\n"
+                    "limited\t%u\n", conns.admitted, conns.refused,
+                    conns.untracked, conns.limited);
+        }
+        buffer_printf(&buffer, &len, &size, "\nMemory Stats:\ngames\t%zu\n"
+                "users\t%zu\nids\t%zu\nconns\t%zu\nreplays\t%zu\n"
+                "stored\t%u\n", STAT(gameBytes), STAT(userBytes),
+                intern_memory(), conn_memory(),
+                replay_memory(), userStore ? STAT(userStore->count) : 0);
+    }
+    free(users);
+    free(games);
+    __atomic_add_fetch(&statsReaders, -1, __ATOMIC_SEQ_CST);
+
+    if(statsPath == NULL) {
+        fflush(stdout);
+        if(write(STDOUT_FILENO, buffer, len) != (ssize_t)len) {
+            /* Nowhere to report it */
+        }
+    } else {
+        char tmpPath[1024];
+        snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", statsPath);
+        int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd >= 0 && write(fd, buffer, len) == (ssize_t)len &&
+                close(fd) == 0) {
+            rename(tmpPath, statsPath);
+        } else {
+            if(fd >= 0) {
+                close(fd);
+            }
+            unlink(tmpPath);
+        }
+    }
+    free(buffer);
+}
+
+/* Snapshots */
+
+/*
+ * Journal n lives next to the snapshot
+ */
+void journal_path(char* path, unsigned long n) {
+    sprintf(path, "%s.journal.%lu", snapshotPath, n);
+}
+
+/*
+ * Anything that changes users or games and is journalled must happen
+ * between these, so a snapshot never sees half of a change.
+ */
+void begin_change(void) {
+    if(snapshotPath != NULL) {
+        pthread_rwlock_rdlock(&snapshotLock);
+    }
+}
+
+void end_change(void) {
+    if(snapshotPath != NULL) {
+        pthread_rwlock_unlock(&snapshotLock);
+    }
+}
+
+/*
+ * Send a message to the other server, with fd if it isn't -1
+ * Returns false if there is no other server to send it to
+ */
+bool hand_over(const char* record, size_t len, int fd) {
+    pthread_mutex_lock(&handoverMutex);
+    bool sent = handoverFd >= 0 && conn_send_msg(handoverFd, record, len, fd);
+    pthread_mutex_unlock(&handoverMutex);
+    return sent;
+}
+
+/*
+ * Append a line to the journal
+ */
+void journal_event(const char* format, ...) {
+    va_list args;
+
+    /* Once handed over, the new server keeps users' stats */
+    if(__atomic_load_n(&handingOver, __ATOMIC_SEQ_CST)) {
+        if(format[0] == 'S') {
+            char line[256];
+            va_start(args, format);
+            vsnprintf(line, sizeof(line), format, args);
+            va_end(args);
+            hand_over(line, strlen(line), -1);
+        }
+        return;
+    }
+    if(journal == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&journalMutex);
+    va_start(args, format);
+    vfprintf(journal, format, args);
+    va_end(args);
+    fflush(journal);
+    pthread_mutex_unlock(&journalMutex);
+}
+
+/*
+ * Write out a game as the lines that would make it again
+ * Called with the game's lock held
+ */
+void buffer_game(char** buffer, size_t* len, size_t* size, int game) {
+    const char* id = game_name(game);
+    Play* play = play_of(game);
+
+    buffer_printf(buffer, len, size, "G %s %s\n", id, game_rules(game)->name);
+    for(int j = 0; j < 2; j++) {
+        User* user = seated(game, j);
+        if(user != NULL) {
+            buffer_printf(buffer, len, size, "J %s %d %s\n", id, j, user->id);
+        }
+    }
+    if(play == NULL) {
+        return;
+    }
+    for(int j = 0; j < play->nMoves; j++) {
+        buffer_printf(buffer, len, size, "M %s %d $request %u %u\n",
+                id, play->moves[j].player, play->moves[j].x,
+                play->moves[j].y);
+        if(j < play->nMoves - 1 || !play->pending) {
+            buffer_printf(buffer, len, size, "M %s %d $response %s\n",
+                    id, !play->moves[j].player,
+                    play->moves[j].hit ? "hit" : "miss");
+        }
+    }
+    buffer_printf(buffer, len, size, "P %s %d\n", id, play->resume);
+}
+
+/*
+ * Copy all users and games while nothing can change, then write the copy
+ * out and start a fresh journal. Only the copy happens under the lock.
+ * Returns true if the snapshot made it to disk
+ */
+bool save_snapshot(void) {
+    size_t len = 0, size = 4096;
+    char* buffer;
+    char path[1024], tmpPath[1024];
+    unsigned long oldJournal;
+
+    /* A server that has handed over has no say in the snapshot */
+    pthread_mutex_lock(&saveMutex);
+    if(handingOver) {
+        pthread_mutex_unlock(&saveMutex);
+        return false;
+    }
+    buffer = (char *)malloc(size);
+
+    pthread_rwlock_wrlock(&snapshotLock);
+    pthread_mutex_lock(&userListMutex);
+    pthread_mutex_lock(&gameListMutex);
+
+    /* Later changes go to a new journal */
+    pthread_mutex_lock(&journalMutex);
+    oldJournal = journalNum++;
+    journal_path(path, journalNum);
+    if(journal != NULL) {
+        fclose(journal);
+    }
+    journal = fopen(path, "w");
+    pthread_mutex_unlock(&journalMutex);
+
+    buffer_printf(&buffer, &len, &size, "snapshot %lu\n", journalNum);
+    for(User* user = userListHead; user; user = user->next) {
+        buffer_printf(&buffer, &len, &size, "U %s\nS %s %d %d %d %d\n",
+                user->id, user->id, user->won, user->lost, user->disconns,
+                user->rank.rating);
+    }
+    for(unsigned int i = 0; i < gameTable.high; i++) {
+        if(gameTable.phases[i] >= TABLE_OVER) {
+            continue;
+        }
+        lock_game(i);
+        if(!(gameTable.flags[i] & TABLE_ENDED)) {
+            buffer_game(&buffer, &len, &size, i);
+        }
+        unlock_game(i);
+    }
+
+    pthread_mutex_unlock(&gameListMutex);
+    pthread_mutex_unlock(&userListMutex);
+    pthread_rwlock_unlock(&snapshotLock);
+
+    /* Replace the old snapshot in one step */
+    sprintf(tmpPath, "%s.tmp", snapshotPath);
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool saved = fd >= 0 && write(fd, buffer, len) == (ssize_t)len &&
+            fsync(fd) == 0 && close(fd) == 0 &&
+            rename(tmpPath, snapshotPath) == 0;
+    if(saved) {
+        journal_path(path, oldJournal);
+        unlink(path);
+    }
+    free(buffer);
+    pthread_mutex_unlock(&saveMutex);
+    return saved;
+}
+
+/*
+ * Save a snapshot every snapshotInterval seconds
+ */
+void* snapshot_thread(void* arg) {
+    while(1) {
+        sleep(snapshotInterval);
+        save_snapshot();
+    }
+    return NULL;
+}
+
+/*
+ * Apply one line of a snapshot or journal. Nothing else is running yet.
+ */
+void apply_event(char* line) {
+    char id[80], other[80], message[80];
+    int player, won, lost, disconns, rating;
+    User* user;
+    int game;
+    int n;
+
+    if(sscanf(line, "U %79s", id) == 1) {
+        pthread_mutex_lock(&userListMutex);
+        if(find_user(id) == NULL) {
+            push_user(&userListHead, id);
+        }
+        pthread_mutex_unlock(&userListMutex);
+    } else if((n = sscanf(line, "S %79s %d %d %d %d", id, &won, &lost,
+                &disconns, &rating)) >= 4) {
+        if((user = find_user(id)) != NULL) {
+            stats_begin();
+            user->won = won;
+            user->lost = lost;
+            user->disconns = disconns;
+            if(n == 5) {
+                ladder_set_rating(&ladder, &user->rank, rating);
+            }
+            stats_end();
+        }
+    } else if(sscanf(line, "G %79s %79s", id, other) == 2) {
+        RuleSet* rules = find_rules(other);
+        if(find_game(&gameTable, id) == -1 && !at_max_games(&gameTable)) {
+            push_game(&gameTable, id, rules ? rules : defaultRules);
+        }
+    } else if(sscanf(line, "J %79s %d %79s", id, &player, other) == 3) {
+        if((game = find_game(&gameTable, id)) == -1) {
+            if(at_max_games(&gameTable)) {
+                return;
+            }
+            game = push_game(&gameTable, id, defaultRules);
+        }
+        seat_user(game, player & 1, find_user(other));
+    } else if(sscanf(line, "M %79s %d %79[^\n]", id, &player, message) == 3) {
+        if((game = find_game(&gameTable, id)) != -1) {
+            strcat(message, "\n");
+            record_move(game, player & 1, message);
+        }
+    } else if(sscanf(line, "P %79s %d", id, &player) == 2) {
+        if((game = find_game(&gameTable, id)) != -1) {
+            need_play(game)->resume = player & 1;
+        }
+    } else if(sscanf(line, "R %79s", id) == 1) {
+        if((game = find_game(&gameTable, id)) != -1) {
+            remove_game(&gameTable, game);
+        }
+    }
+}
+
+/*
+ * Ready a game rebuilt from journal lines to carry on, asking again a
+ * request that wasn't answered
+ */
+void settle_game(int game) {
+    Play* play = play_of(game);
+    if(play == NULL) {
+        return;
+    }
+    if(play->pending) {
+        play->nMoves--;
+        play->pending = false;
+    }
+    gameTable.turns[game] = play->resume;
+}
+
+/*
+ * Rebuild users and games from the last snapshot and the journals
+ * written since. Restored games wait for both players to reconnect.
+ */
+void restore_state(void) {
+    char line[256];
+    char path[1024];
+    FILE* file;
+    unsigned long firstJournal;
+
+    if((file = fopen(snapshotPath, "r")) != NULL) {
+        if(fgets(line, sizeof(line), file) != NULL) {
+            sscanf(line, "snapshot %lu", &journalNum);
+        }
+        while(fgets(line, sizeof(line), file) != NULL) {
+            apply_event(line);
+        }
+        fclose(file);
+    }
+
+    /* A crash mid snapshot can leave more than one journal */
+    firstJournal = journalNum;
+    while(1) {
+        journal_path(path, journalNum);
+        if((file = fopen(path, "r")) == NULL) {
+            break;
+        }
+        while(fgets(line, sizeof(line), file) != NULL) {
+            apply_event(line);
+        }
+        fclose(file);
+        journalNum++;
+    }
+
+    /* Unanswered requests get asked again */
+    for(unsigned int i = 0; i < gameTable.high; i++) {
+        if(gameTable.phases[i] != TABLE_FREE) {
+            settle_game(i);
+        }
+    }
+
+    /* Start a new journal with a snapshot of what was recovered */
+    if(save_snapshot()) {
+        for(unsigned long i = firstJournal; i < journalNum - 1; i++) {
+            journal_path(path, i);
+            unlink(path);
+        }
+    }
+}
+
+/*
+ * Find a user and hold them in memory until put_user, bringing them back
+ * from the store if they were spilled there. Unless create is set, a user
+ * who has never played isn't made up. Called between begin_change and
+ * end_change.
+ * Returns NULL if there is no such user
+ */
+User* get_user(char* id, bool create) {
+    StoredUser stored;
+
+	pthread_mutex_lock(&userListMutex);
+    User* user = find_user(id);
+    if(user == NULL) {
+        bool found = userStore != NULL && store_get(userStore, id, &stored);
+        if(!found && !create) {
+	        pthread_mutex_unlock(&userListMutex);
+            return NULL;
+        }
+        user = push_user(&userListHead, id);
+        journal_event("U %s\n", id);
+        if(found) {
+            stats_begin();
+            user->won = stored.won;
+            user->lost = stored.lost;
+            user->disconns = stored.disconns;
+            ladder_set_rating(&ladder, &user->rank, stored.rating);
+            stats_end();
+            journal_event("S %s %d %d %d %d\n", id, user->won, user->lost,
+                    user->disconns, user->rank.rating);
+        }
+    }
+    __atomic_add_fetch(&user->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&userListMutex);
+    return user;
+}
+
+/*
+ * Bring a reconnected player up to date on every move so far, in order.
+ * What their opponent asked is asked again, and the answers are read and
+ * thrown away. What they asked comes back as "$response hit x y" or
+ * "$response miss x y", which needs no answer.
+ * Returns false if the connection is lost
+ */
+bool resend_moves(int game, int player, Conn* conn) {
+    Play* play = play_of(game);
+    char message[80];
+    int len;
+
+    for(int i = 0; play != NULL && i < play->nMoves; i++) {
+        Move* move = &play->moves[i];
+        if(move->player == player) {
+            len = sprintf(message, "$response %s %u %u\n",
+                    move->hit ? "hit" : "miss", move->x, move->y);
+            if(!conn_write(conn, message, len)) {
+                return false;
+            }
+            continue;
+        }
+        len = sprintf(message, "$request %u %u\n", move->x, move->y);
+        if(!conn_write(conn, message, len) ||
+                !conn_read_line(conn, message, 80)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* 
+ * Open a socket for the server to listen on 
+ */
+int open_listen(int port)
+{
+    int fd;	// The connection point for the server
+    struct sockaddr_in serverAddr;	// The address of the server
+    int optVal = 1;	// Allow immidiate reuse of address	
+
+    /* Create a socket - Internet - TCP */
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+		throw_error(ERR_NET);
+    }
+
+    /* Set option on socket to immediately reuse address - otherwise
+    ** we can get an address in use error until timeout (after exit) 
+    */
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int)) < 0) {
+		throw_error(ERR_NET);
+    }
+
+    /* Create address structure for the adddress we're listening on */
+    serverAddr.sin_family = AF_INET;	// Internet address family 
+    serverAddr.sin_port = htons(port);	// Port number 
+	serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);	// Any IP address
+
+    /* Bind the socket to this address - note the cast of address types */
+    if(bind(fd, (struct sockaddr*)&serverAddr, 
+                sizeof(struct sockaddr_in)) < 0){
+		throw_error(ERR_PORT);
+    }
+
+    /* Start listening for incoming connections. Second argument is
+    ** the maximum number of unaccepted connection requests that will be
+    ** queued by the OS. Agave value SOMAXCONN is 128.
+    */
+    if(listen(fd, SOMAXCONN) < 0) {
+		throw_error(ERR_NET);
+    }
+
+    return fd;
+}
+
+/*
+ * Append a user's line of the ladder
+ */
+void buffer_rank(char** buffer, size_t* len, size_t* size, User* user) {
+    buffer_printf(buffer, len, size, "$rank %u %s %d %d %d\n",
+            ladder_rank(&ladder, &user->rank), user->id, user->rank.rating,
+            user->won, user->lost);
+}
+
+/*
+ * Write the answer to $top k into buffer: "$top n" and then the best n
+ * users, n being at most k and TOP_MAX, as $rank lines
+ */
+void buffer_top(char** buffer, size_t* len, size_t* size, const char* args) {
+    LadderNode* top[TOP_MAX];
+    unsigned int k;
+
+    if(!proto_uint(&args, &k) || k > TOP_MAX) {
+        k = TOP_MAX;
+    }
+    pthread_mutex_lock(&userListMutex);
+    unsigned int n = ladder_top(&ladder, top, k);
+    buffer_printf(buffer, len, size, "$top %u\n", n);
+    for(unsigned int i = 0; i < n; i++) {
+        /* Nodes live inside users */
+        buffer_rank(buffer, len, size, (User *)((char *)top[i] -
+                offsetof(User, rank)));
+    }
+    pthread_mutex_unlock(&userListMutex);
+}
+
+/*
+ * Write the answer to $rank id into buffer: "$rank place id rating won
+ * lost", place being 0 for a user we don't know. A spilled user is
+ * brought back to be ranked. The user is found by its interned handle
+ * and placed on the ladder, so the answer takes O(log n) however many
+ * users there are.
+ */
+void buffer_user_rank(char** buffer, size_t* len, size_t* size,
+        const char* args) {
+    char id[80];
+    User* user;
+
+    if(!proto_word(&args, id, sizeof(id))) {
+        id[0] = '\0';
+    }
+    begin_change();
+    user = get_user(id, false);
+    end_change();
+    pthread_mutex_lock(&userListMutex);
+    if(user != NULL) {
+        buffer_rank(buffer, len, size, user);
+    } else {
+        buffer_printf(buffer, len, size, "$rank 0 %s\n", id);
+    }
+    pthread_mutex_unlock(&userListMutex);
+    put_user(user);
+}
+
+/*
+ * Returns the answer to a $top or $rank query in a new buffer, with its
+ * length at *len
+ */
+char* answer_ladder(Command command, const char* args, size_t* len) {
+    size_t size = 1024;
+    char* buffer = (char *)malloc(size);
+
+    *len = 0;
+    if(command == CMD_TOP) {
+        buffer_top(&buffer, len, &size, args);
+    } else {
+        buffer_user_rank(&buffer, len, &size, args);
+    }
+    return buffer;
+}
+
+/*
+ * Answer a $top or $rank query on conn
+ */
+void send_ladder(Conn* conn, Command command, const char* args) {
+    size_t len;
+    char* buffer = answer_ladder(command, args, &len);
+
+    conn_write(conn, buffer, len);
+    free(buffer);
+}
+
+/* 
+ * Parse client handshake 
+ * Returns 1 for a new player, with their user and game ids
+ * Returns 2 for a player resuming, with their token and messages seen
+ * Returns 3 for a client playing many games over this connection
+ * Returns 0 if Connection Error
+ *
+ * A new player may name the rules they want after their ids, and gets
+ * the default rules if they don't. ruleSet is NULL if they named rules
+ * we haven't got.
+ *
+ * A new player who already has the rules says so with $hello, along with
+ * their hash and whether their map fits them. Without a name the hash
+ * picks the rules. mapStatus is then what parse_map would have returned,
+ * and is 0 if the rules still have to be sent.
+ *
+ * Ladder queries ($top, $rank) are answered while waiting.
+ */
+int parse_handshake(Conn* conn, char** user, char** game, char* token,
+        unsigned int* seen, RuleSet** ruleSet, int* mapStatus) {
+    char buffer[1024];
+    char hash[17];
+    char status[8];
+    char name[80];
+    const char* args;
+
+    *ruleSet = defaultRules;
+    *mapStatus = 0;
+    while(conn_read_line(conn, buffer, 1024)) {
+        switch(proto_command(buffer, &args)) {
+            case CMD_HANDSHAKE:
+                if(proto_word(&args, *user, 80) &&
+                        proto_word(&args, *game, 80)) {
+                    if(proto_word(&args, name, sizeof(name))) {
+                        *ruleSet = find_rules(name);
+                    }
+                    return 1; // Got it
+                }
+                break;
+            case CMD_HELLO:
+                if(proto_word(&args, *user, 80) &&
+                        proto_word(&args, *game, 80) &&
+                        proto_word(&args, hash, sizeof(hash)) &&
+                        proto_word(&args, status, sizeof(status))) {
+                    uint64_t theirs = strtoull(hash, NULL, 16);
+                    if(proto_word(&args, name, sizeof(name))) {
+                        *ruleSet = find_rules(name);
+                    } else if(find_rules_by_hash(theirs) != NULL) {
+                        *ruleSet = find_rules_by_hash(theirs);
+                    }
+                    if(*ruleSet != NULL && (*ruleSet)->hash == theirs) {
+                        if(strcmp(status, "good") == 0) {
+                            *mapStatus = 1;
+                        } else if(strcmp(status, "bad") == 0) {
+                            *mapStatus = 2;
+                        }
+                    }
+                    return 1; // Got it, maybe without the map
+                }
+                break;
+            case CMD_RESUME:
+                if(proto_word(&args, token, TOKEN_LEN + 1) &&
+                        proto_uint(&args, seen)) {
+                    return 2; // Coming back
+                }
+                break;
+            case CMD_MULTIPLEX:
+                return 3; // Frames from here on
+            case CMD_TOP:
+                send_ladder(conn, CMD_TOP, args);
+                break;
+            case CMD_RANK:
+                send_ladder(conn, CMD_RANK, args);
+                break;
+            default:
+                break;
+        }
+        continue; // Try again
+    }
+    return 0; // Something's wrong
+}
+
+/*
+ * Sends rules to client, parses response.
+ * Returns 1 if OK
+ * Returns 2 if Bad Map
+ * Returns 0 if Connection Error
+ */
+int parse_map(Conn* conn, RuleSet* rules) {
+    /* Tell client to get ready for rules, and what to keep them as */
+    char start[40];
+    sprintf(start, "$startrules %016llx\n", (unsigned long long)rules->hash);
+    conn_write_more(conn, start, strlen(start));
+
+    /* Send the rules, which never change so need no lock */
+    conn_write_more(conn, rules->text, rules->len);
+
+    /* Tell client rules complete */
+    conn_write(conn, "$endrules\n", 10);
+
+    char mapStatus[80];
+    const char* args;
+    while(conn_read_line(conn, mapStatus, 80)) {
+        if(proto_command(mapStatus, &args) == CMD_MAP) {
+            if(strcmp(args, "good\n") == 0) {
+                return 1; // Good map
+            } else if(strcmp(args, "bad\n") == 0) {
+                return 2; // Bad map
+            }
+        }
+        continue; // Try again
+    }
+    return 0; // Something's wrong
+}
+
+/*
+ * Append a finished game to the replay file if it is being recorded.
+ * Once handed over, the new server has the file and writes it there.
+ */
+void end_replay(int game, int outcome, int player) {
+    Play* play = play_of(game);
+    ReplayGame* replay = play ? play->replay : NULL;
+
+    if(replay == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&handoverMutex);
+    if(handingOver) {
+        replay_finish(replay, outcome, player);
+        char* record = (char *)malloc(replay->len + 128);
+        int len = sprintf(record, "Y %016llx %s\n",
+                (unsigned long long)replay->rulesHash, replay->id);
+        memcpy(record + len, replay->data, replay->len);
+        if(handoverFd >= 0) {
+            conn_send_msg(handoverFd, record, len + replay->len, -1);
+        }
+        free(record);
+        replay_drop(replay);
+    } else {
+        replay_end(replayLog, replay, outcome, player);
+    }
+    pthread_mutex_unlock(&handoverMutex);
+    play->replay = NULL;
+}
+
+/*
+ * Bump a user's disconnect count
+ */
+void count_disconnect(User* user) {
+    pthread_mutex_lock(&userListMutex);
+    stats_begin();
+    if(user->slot != NULL) {
+        shared_count_disconnect(shared, user->slot);
+        pull_stats(user);
+    } else {
+        user->disconns++;
+    }
+    stats_end();
+    journal_event("S %s %d %d %d %d\n", user->id, user->won, user->lost,
+            user->disconns, user->rank.rating);
+    pthread_mutex_unlock(&userListMutex);
+}
+
+/*
+ * Called when a user disconnects 
+ */
+void handle_disconnect(Conn* conn, User* user, int game, bool first ) {
+    /* Close the appropriate socket */
+    conn_close(conn);
+    
+    begin_change();
+
+    /* Increase disconnects for appropriate user */
+    if(user != NULL) {
+        count_disconnect(user);
+    }
+
+    if(game != -1) {
         /* Remove the game */
-        remove_game(gameArray, game);
+        pthread_mutex_lock(&gameListMutex);
+        journal_event("R %s\n", game_name(game));
+        remove_game(&gameTable, game);
+        pthread_mutex_unlock(&gameListMutex);
+    }
+
+    end_change();
+}
+
+/*
+ * Mark the game finished and wake the other player so they leave too
+ */
+void end_game(int game) {
+    lock_game(game);
+    gameTable.flags[game] |= TABLE_ENDED;
+    pthread_cond_broadcast(game_cond(game));
+    unlock_game(game);
+    set_phase(game, TABLE_OVER);
+}
+
+/*
+ * Queue a message for a player. Their own thread sends it, so a player
+ * who isn't reading never holds up the one sending to them. A player
+ * too far behind is cut off and has to resume.
+ */
+void send_to_player(int game, int player, const char* message) {
+    lock_game(game);
+    Ring* outbox = play_of(game)->outbox[player];
+    if(!ring_push(outbox, message) || ring_pending(outbox) > HIGH_WATER) {
+        if(gameTable.conns[game][player] != -1) {
+            shutdown(gameTable.conns[game][player], SHUT_RDWR);
+        }
+    }
+    unlock_game(game);
+}
+
+/*
+ * Send a player everything queued for them, letting each message share
+ * a packet with the next. Only the player's own thread may call this.
+ * Returns false if the connection failed or the player stopped reading
+ * for CONN_TIMEOUT, in which case it has been shut down
+ */
+bool flush_outbox(int game, int player, Conn* conn) {
+    Ring* outbox = play_of(game)->outbox[player];
+    const char* message;
+
+    while((message = ring_peek(outbox)) != NULL) {
+        if(traceOn) {
+            TRACE("send", trace_peek(message), FLOW_STEP);
+        }
+        bool ok = ring_pending(outbox) > 1 ?
+                conn_write_more(conn, message, strlen(message)) :
+                conn_write(conn, message, strlen(message));
+        if(!ok) {
+            return false;
+        }
+        ring_pop(outbox);
+    }
+    return true;
+}
+
+/*
+ * After a player resumes on a new connection, tell them how much of
+ * theirs arrived and go back to sending from what they last saw
+ */
+void catch_up(int game, int player, Conn* conn) {
+    Play* play = play_of(game);
+    char reply[80];
+
+    lock_game(game);
+    if(play->resumed[player]) {
+        sprintf(reply, "$resume ok %u\n", play->received[player]);
+        conn_write(conn, reply, strlen(reply));
+        ring_rewind(play->outbox[player], play->seen[player]);
+        play->resumed[player] = false;
+    }
+    unlock_game(game);
+}
+
+/*
+ * Called by the user who lost the game
+ */
+void handle_loss(int game, bool first) {
+    int playerNum = first ? 0 : 1;
+    int opponentNum = first ? 1 : 0;
+
+    begin_change();
+
+    /* Increase win/loss and rerate the players */
+    pthread_mutex_lock(&userListMutex);
+    stats_begin();
+    User* winner = seated(game, opponentNum);
+    User* loser = seated(game, playerNum);
+    if(winner->slot != NULL && loser->slot != NULL) {
+        /* Other workers may have rated them since, so rate them there */
+        shared_result(shared, winner->slot, loser->slot);
+        pull_stats(winner);
+        pull_stats(loser);
+    } else {
+        loser->lost++;
+        winner->won++;
+        ladder_result(&ladder, &winner->rank, &loser->rank);
+    }
+    stats_end();
+    for(int i = 0; i < 2; i++) {
+        User* user = seated(game, i);
+        journal_event("S %s %d %d %d %d\n", user->id, user->won,
+                user->lost, user->disconns, user->rank.rating);
+    }
+    pthread_mutex_unlock(&userListMutex);
+
+    pthread_mutex_lock(&gameListMutex);
+
+    /* Log win */
+    log_message(LOG_WIN, NULL, winner->id, game_name(game), 0);
+    end_replay(game, END_WIN, opponentNum);
+    journal_event("R %s\n", game_name(game));
+
+    pthread_mutex_unlock(&gameListMutex);
+    end_change();
+    end_game(game);
+}
+
+/*
+ * Called when a player drops out and doesn't come back in time
+ */
+void handle_quit(int game, bool first) {
+    int playerNum = first ? 0 : 1;
+    int opponentNum = first ? 1 : 0;
+    User* me = seated(game, playerNum);
+
+    begin_change();
+    count_disconnect(me);
+    log_message(LOG_DISCON, NULL, me->id, game_name(game), 0);
+    end_replay(game, END_DISCON, playerNum);
+    journal_event("R %s\n", game_name(game));
+    end_change();
+
+    /* Let the opponent know nobody is coming back */
+    send_to_player(game, opponentNum, "$bye\n");
+    end_game(game);
+}
+
+/*
+ * Give up a seat, the last player out removes the game
+ */
+void leave_game(int game) {
+    lock_game(game);
+    bool last = --gameTable.active[game] == 0;
+    unlock_game(game);
+
+    if(last) {
+        pthread_mutex_lock(&gameListMutex);
+        remove_game(&gameTable, game);
+        pthread_mutex_unlock(&gameListMutex);
+    }
+}
+
+/*
+ * Hold a player's seat after their connection fails, until they resume
+ * or graceSeconds pass. Closes conn.
+ * Returns their new socket, -1 if they didn't come back
+ */
+int wait_for_resume(int game, int player, Conn* conn) {
+    int fd = conn->fd;
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += graceSeconds;
+
+    /* Nothing else is sent to the old socket once it's out of the game */
+    lock_game(game);
+    if(gameTable.conns[game][player] == fd) {
+        gameTable.conns[game][player] = -1;
+    }
+    unlock_game(game);
+    conn_close(conn);
+
+    lock_game(game);
+    while(gameTable.conns[game][player] == -1 &&
+            !(gameTable.flags[game] & TABLE_ENDED)) {
+        if(pthread_cond_timedwait(game_cond(game),
+                    table_lock(&gameTable, game), &until) == ETIMEDOUT) {
+            break;
+        }
+    }
+    fd = gameTable.conns[game][player];
+    if(fd == -1) {
+        gameTable.flags[game] |= TABLE_ENDED;  // Too late to resume now
+    }
+    unlock_game(game);
+    return fd;
+}
+
+/*
+ * Record a message a player sent on their turn and pass it on to the
+ * other player. Its trace id is split off message.
+ */
+void pass_message(int game, int player, char* message) {
+    Play* play = play_of(game);
+    char relay[80];
+
+    uint64_t traceId = trace_split(message);
+    TRACE("receive", traceId, FLOW_STEP);
+    if(play->replay != NULL) {
+        replay_message(play->replay, player, message);
+    }
+    begin_change();
+    lock_game(game);
+    play->received[player]++;
+    record_move(game, player, message);
+    unlock_game(game);
+    journal_event("M %s %d %s", game_name(game), player, message);
+    end_change();
+
+    TRACE("relay", traceId, FLOW_STEP);
+    send_to_player(game, !player, trace_join(message, relay, 80, traceId));
+}
+
+/*
+ * Allows communication between clients.
+ * Returns 1 if player lost
+ * Returns 0 if player disconnected
+ * Returns -1 if the game was ended by the opponent
+ */
+int parse_communication(int myGame, bool first, Conn* conn) {
+    int playerNum = first ? 0 : 1;
+    int opponentNum = first ? 1 : 0;
+    int fdPlayer = conn->fd;
+    Play* play = play_of(myGame);   // It has started, so it has one
+
+    bool turn = gameTable.turns[myGame] == playerNum;
+    char message[80];
+    Command command;
+    const char* args;
+
+    /* Keep reading more input until otherwise */
+    while(1) {
+        if(turn) {
+            if(flush_outbox(myGame, playerNum, conn) &&
+                    conn_read_line(conn, message, 80)) {
+                pass_message(myGame, playerNum, message);
+                command = proto_command(message, &args);
+                if(command == CMD_RESPONSE && strcmp(args, "over\n") == 0) {
+                    conn_close(conn);
+                    return 1;
+                }
+                if(command == CMD_BYE) {
+                    conn_close(conn);
+                    return 0;   // Leaving on purpose, no need to wait
+                }
+            } else {
+                fdPlayer = wait_for_resume(myGame, playerNum, conn);
+                if(fdPlayer == -1) {
+                    return 0;
+                }
+                conn = conn_open(fdPlayer);
+                catch_up(myGame, playerNum, conn);
+                continue;
+            }
+
+            /* Signal next player to go */
+            lock_game(myGame);
+            turn = !turn;
+            gameTable.turns[myGame] = opponentNum;
+            pthread_cond_broadcast(&play->cond);
+            unlock_game(myGame);
+        } else {
+            /* Player waits for signal that it's his turn */
+            lock_game(myGame);
+            while(gameTable.turns[myGame] != playerNum &&
+                    !(gameTable.flags[myGame] & TABLE_ENDED) &&
+                    gameTable.conns[myGame][playerNum] == fdPlayer) {
+                pthread_cond_wait(&play->cond, table_lock(&gameTable, myGame));
+            }
+            bool over = gameTable.flags[myGame] & TABLE_ENDED;
+            int fd = gameTable.conns[myGame][playerNum];
+            turn = gameTable.turns[myGame] == playerNum;
+            unlock_game(myGame);
+
+            /* They may have resumed on a new connection while waiting */
+            if(fd != fdPlayer) {
+                conn_close(conn);
+                fdPlayer = fd;
+                conn = conn_open(fdPlayer);
+                catch_up(myGame, playerNum, conn);
+                flush_outbox(myGame, playerNum, conn);
+            }
+            if(over) {
+                flush_outbox(myGame, playerNum, conn);
+                conn_close(conn);
+                return -1;
+            }
+        }
+    }
+}
+
+/*
+ * Make a token a player can quote to resume after dropping out
+ * Returns the token, which is never 0
+ */
+uint64_t make_token(void) {
+    uint64_t token = 0;
+    FILE* urandom = fopen("/dev/urandom", "r");
+    if(urandom == NULL || fread(&token, sizeof(token), 1, urandom) != 1) {
+        token = (uint64_t)random() << 42 ^ (uint64_t)random() << 21 ^
+                random();
+    }
+    if(urandom != NULL) {
+        fclose(urandom);
+    }
+
+    /* So the supervisor knows where to send a resume, by its first digit */
+    if(workerNum >= 0) {
+        token = (token & ~(0xfULL << 60)) | (uint64_t)workerNum << 60;
+    }
+    return token != 0 ? token : 1;
+}
+
+/*
+ * Returns the token written out in s, 0 if s isn't one
+ */
+uint64_t parse_token(const char* s) {
+    if(strlen(s) != TOKEN_LEN || strspn(s, "0123456789abcdef") != TOKEN_LEN) {
+        return 0;
+    }
+    return strtoull(s, NULL, 16);
+}
+
+/*
+ * Put a returning player back in their seat on a new connection. The
+ * thread already playing their seat carries on with the new connection
+ * and sends them whatever they missed.
+ * Returns true if they could resume
+ */
+bool resume_player(int fd, char* quoted, unsigned int seen) {
+    uint64_t token = parse_token(quoted);
+    int game = -1;
+    int player = 0;
+
+    if(token == 0) {
+        return false;
+    }
+    pthread_mutex_lock(&gameListMutex);
+    for(unsigned int i = 0; i < gameTable.high && game == -1; i++) {
+        if(gameTable.phases[i] >= TABLE_OVER) {
+            continue;
+        }
+        for(int j = 0; j < 2; j++) {
+            if(gameTable.tokens[i][j] == token) {
+                game = i;
+                player = j;
+                break;
+            }
+        }
+    }
+    if(game == -1) {
+        pthread_mutex_unlock(&gameListMutex);
+        return false;
+    }
+    lock_game(game);
+    pthread_mutex_unlock(&gameListMutex);
+
+    /* Can only fill in what is still in the outbox */
+    Play* play = need_play(game);
+    unsigned int sent = play->outbox[player] ?
+            ring_pushed(play->outbox[player]) : 0;
+    if((gameTable.flags[game] & TABLE_ENDED) || seen > sent ||
+            sent - seen >= RING_SIZE) {
+        unlock_game(game);
+        return false;
+    }
+
+    /* Knock the old connection loose if it hasn't noticed yet */
+    if(gameTable.conns[game][player] != -1) {
+        shutdown(gameTable.conns[game][player], SHUT_RDWR);
+    }
+    gameTable.conns[game][player] = fd;
+    play->resumed[player] = true;
+    play->seen[player] = seen;
+    if(play->seats[player] != NULL) {
+        conn_poke(play->seats[player]);     // So the relay lets go
+    }
+
+    log_message(LOG_RESUME, NULL, seated(game, player)->id, game_name(game),
+            0);
+
+    pthread_cond_broadcast(game_cond(game));
+    unlock_game(game);
+    return true;
+}
+
+/*
+ * Take up a seat in the game and wait until both players are there
+ *
+ * Whoever arrives second tells the player to move first, as the other
+ * thread may not wake until play has moved on. It wakes the first on the
+ * shard's condition variable, which from then on the game has its own of.
+ * Returns false if the game expired first
+ */
+bool wait_for_opponent(int game, int playerNum, int fd) {
+    bool starting = false;
+
+    lock_game(game);
+    gameTable.conns[game][playerNum] = fd;
+    if(gameTable.conns[game][!playerNum] != -1 &&
+            !(gameTable.flags[game] & TABLE_ENDED)) {
+        open_outboxes(game);
+        ring_push(play_of(game)->outbox[gameTable.turns[game]],
+                "$yourmove\n");
+        gameTable.flags[game] |= TABLE_STARTED;
+        starting = true;
+        pthread_cond_broadcast(table_cond(&gameTable, game));
+    }
+    while(!(gameTable.flags[game] & (TABLE_STARTED | TABLE_ENDED))) {
+        pthread_cond_wait(table_cond(&gameTable, game),
+                table_lock(&gameTable, game));
+    }
+    bool started = gameTable.flags[game] & TABLE_STARTED;
+    unlock_game(game);
+
+    if(starting) {
+        set_phase(game, TABLE_PLAYING);
+    }
+    return started;
+}
+
+/* Multiplexing */
+
+/*
+ * Multiplexing saves the client sockets, not the server anything. Each
+ * game on a connection still costs a socket pair and a client thread of
+ * its own, the connection costs a pipe and a pump thread on top, and
+ * every relayed line takes an extra trip through the socket pair and
+ * the pump's poll. A connection carries at most MUX_CHANNELS games, and
+ * a preforked server turns $multiplex away, as its games may belong to
+ * different workers.
+ */
+
+/*
+ * A game played over a multiplexed connection. Its seat is played by an
+ * ordinary client thread on one end of a socket pair, so it can drop out
+ * and resume like any other. The connection's threads hold the other end.
+ */
+typedef struct Channel {
+    unsigned int tag;   // What the client calls it
+    int fd;             // Our end of the socket pair
+    char* out;          // Output from the seat, not yet a whole line
+    size_t outLen;
+    size_t outSize;
+} Channel;
+
+/*
+ * A connection carrying many games. The thread that read $multiplex
+ * reads frames and passes them to their channels; a pump thread sends
+ * whatever the channels write back, tagged.
+ */
+typedef struct Mux {
+    Conn* conn;
+    pthread_mutex_t lock;           // Guards the channels
+    pthread_mutex_t writeLock;      // Frames go out whole
+    Channel* channels[MUX_CHANNELS];
+    int nChannels;
+    int wake[2];                    // Tells the pump the channels changed
+    bool done;                      // The client has gone
+} Mux;
+
+void* client_thread(void* arg);
+
+/*
+ * Returns the channel tagged tag, NULL if there is none. Hold mux->lock.
+ */
+Channel* find_channel(Mux* mux, unsigned int tag) {
+    for(int i = 0; i < mux->nChannels; i++) {
+        if(mux->channels[i]->tag == tag) {
+            return mux->channels[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start a seat for a new tag. Hold mux->lock.
+ * Returns NULL if the connection already has all the channels it may
+ */
+Channel* open_channel(Mux* mux, unsigned int tag) {
+    int fds[2];
+    pthread_t thread_id;
+
+    if(mux->nChannels == MUX_CHANNELS ||
+            socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        return NULL;
+    }
+    /* A seat that stops reading is cut off, not waited for */
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    Channel* channel = (Channel *)malloc(sizeof(Channel));
+    channel->tag = tag;
+    channel->fd = fds[0];
+    channel->outLen = 0;
+    channel->outSize = 256;
+    channel->out = (char *)malloc(channel->outSize);
+    mux->channels[mux->nChannels++] = channel;
+    if(write(mux->wake[1], "", 1) < 0) {
+        /* The pump is awake already */
+    }
+
+    pthread_create(&thread_id, NULL, client_thread, (void*)(long)fds[1]);
+    pthread_detach(thread_id);
+    return channel;
+}
+
+/*
+ * Send a frame to the client
+ */
+void send_frame(Mux* mux, const char* data, size_t len) {
+    pthread_mutex_lock(&mux->writeLock);
+    conn_write(mux->conn, data, len);
+    pthread_mutex_unlock(&mux->writeLock);
+}
+
+/*
+ * Pass on what a seat wrote as one frame per line
+ * Returns false once the seat has closed its end
+ */
+bool forward_channel(Mux* mux, Channel* channel) {
+    size_t sent = 0;
+
+    if(channel->outSize - channel->outLen < 128) {
+        channel->outSize *= 2;
+        channel->out = (char *)realloc(channel->out, channel->outSize);
+    }
+    ssize_t n = read(channel->fd, channel->out + channel->outLen,
+            channel->outSize - channel->outLen);
+    if(n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return true;
+    }
+    if(n <= 0) {
+        return false;
+    }
+    channel->outLen += n;
+
+    /* Every whole line goes out, in one write */
+    size_t len = 0, size = channel->outLen + 64;
+    char* buffer = (char *)malloc(size);
+    const char* newline;
+    while((newline = proto_find_newline(channel->out + sent,
+                    channel->outLen - sent)) != NULL) {
+        size_t lineLen = newline - (channel->out + sent) + 1;
+        buffer_printf(&buffer, &len, &size, "%c%u %.*s", PROTO_TAG,
+                channel->tag, (int)lineLen, channel->out + sent);
+        sent += lineLen;
+    }
+    if(len > 0) {
+        send_frame(mux, buffer, len);
+    }
+    free(buffer);
+    memmove(channel->out, channel->out + sent, channel->outLen - sent);
+    channel->outLen -= sent;
+    return true;
+}
+
+/*
+ * Take a channel whose seat has gone off the connection, and tell the
+ * client. Its tag is free again first, for the seat to resume on.
+ */
+void close_channel(Mux* mux, Channel* channel) {
+    char frame[40];
+
+    pthread_mutex_lock(&mux->lock);
+    for(int i = 0; i < mux->nChannels; i++) {
+        if(mux->channels[i] == channel) {
+            mux->channels[i] = mux->channels[--mux->nChannels];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mux->lock);
+    int len = sprintf(frame, "%c%u\n", PROTO_TAG, channel->tag);
+    send_frame(mux, frame, len);
+    close(channel->fd);
+    free(channel->out);
+    free(channel);
+}
+
+/*
+ * Send the client what its seats write until the client has gone and
+ * every seat has let go. Frames from seats that are ready together are
+ * corked into as few packets as they fill. With a batching window the
+ * pump also waits that long for more before letting them go, which
+ * costs each message up to the window but saves packets and wakeups
+ * when a connection carries many busy games.
+ */
+void* mux_pump(void* arg) {
+    Mux* mux = (Mux *)arg;
+    struct pollfd fds[MUX_CHANNELS + 1];
+    Channel* polled[MUX_CHANNELS + 1];
+    char drain[64];
+
+    fds[0].fd = mux->wake[0];
+    fds[0].events = POLLIN;
+    while(1) {
+        int nFds = 1;
+        pthread_mutex_lock(&mux->lock);
+        if(mux->done && mux->nChannels == 0) {
+            pthread_mutex_unlock(&mux->lock);
+            break;
+        }
+        for(int i = 0; i < mux->nChannels; i++) {
+            polled[nFds] = mux->channels[i];
+            fds[nFds].fd = mux->channels[i]->fd;
+            fds[nFds].events = POLLIN;
+            nFds++;
+        }
+        pthread_mutex_unlock(&mux->lock);
+
+        int ready = poll(fds, nFds, -1);
+        if(ready < 0) {
+            continue;
+        }
+        bool corked = batchMicros > 0 || ready > 1;
+        if(corked) {
+            conn_cork(mux->conn, true);
+        }
+        for(int round = 0; round < 2 && ready > 0; round++) {
+            if(fds[0].revents & POLLIN) {
+                if(read(mux->wake[0], drain, sizeof(drain)) < 0) {
+                    /* Woken anyway */
+                }
+            }
+            for(int i = 1; i < nFds; i++) {
+                if(fds[i].revents != 0 && !forward_channel(mux, polled[i])) {
+                    close_channel(mux, polled[i]);
+                    fds[i].fd = -1; // Gone, skip it next round
+                }
+            }
+
+            /* Gather whatever else comes in the window */
+            if(batchMicros == 0) {
+                break;
+            }
+            usleep(batchMicros);
+            ready = poll(fds, nFds, 0);
+        }
+        if(corked) {
+            conn_cork(mux->conn, false);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Play every game the client sends frames for over conn, then close it.
+ * A game whose first frame arrives gets a seat, and a seat whose client
+ * closes its channel or goes altogether has dropped out, and may resume
+ * on another channel or connection.
+ */
+void serve_multiplexed(Conn* conn) {
+    Mux mux;
+    pthread_t pump;
+    char line[1024];
+    char frame[40];
+
+    mux.conn = conn;
+    mux.nChannels = 0;
+    mux.done = false;
+    pthread_mutex_init(&mux.lock, NULL);
+    pthread_mutex_init(&mux.writeLock, NULL);
+    if(pipe(mux.wake) < 0) {
+        conn_close(conn);
+        return;
+    }
+    pthread_create(&pump, NULL, mux_pump, &mux);
+
+    while(conn_read_line(conn, line, sizeof(line))) {
+        const char* message = line;
+        unsigned int tag;
+        if(!proto_untag(&message, &tag)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&mux.lock);
+        Channel* channel = find_channel(&mux, tag);
+        if(channel == NULL && *message != '\0' &&
+                (channel = open_channel(&mux, tag)) == NULL) {
+            pthread_mutex_unlock(&mux.lock);
+            int len = sprintf(frame, "%c%u\n", PROTO_TAG, tag);
+            send_frame(&mux, frame, len);   // No room for it
+            continue;
+        }
+        if(channel != NULL && *message == '\0') {
+            shutdown(channel->fd, SHUT_WR);
+        } else if(channel != NULL && write(channel->fd, message,
+                    strlen(message)) != (ssize_t)strlen(message)) {
+            shutdown(channel->fd, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&mux.lock);
+    }
+
+    /* The client has gone, and every seat with it */
+    pthread_mutex_lock(&mux.lock);
+    mux.done = true;
+    for(int i = 0; i < mux.nChannels; i++) {
+        shutdown(mux.channels[i]->fd, SHUT_RDWR);
+    }
+    if(write(mux.wake[1], "", 1) < 0) {
+        /* The pump is awake already */
+    }
+    pthread_mutex_unlock(&mux.lock);
+
+    pthread_join(pump, NULL);
+    close(mux.wake[0]);
+    close(mux.wake[1]);
+    pthread_mutex_destroy(&mux.lock);
+    pthread_mutex_destroy(&mux.writeLock);
+    conn_close(conn);
+}
+
+/*
+ * Returns true if fd is one end of a multiplexed connection's socket
+ * pair rather than a client's own socket
+ */
+bool is_channel(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t addrLen = sizeof(addr);
+
+    return getsockname(fd, (struct sockaddr *)&addr, &addrLen) == 0 &&
+            addr.ss_family == AF_UNIX;
+}
+
+/*
+ * Play a seat in a game that has started until it is over for them.
+ * Closes conn and lets go of me.
+ */
+void finish_seat(int myGame, int playerNum, User* me, Conn* conn) {
+    bool first = playerNum == 0;
+
+    /* Parse further input */
+    int communicationStatus = parse_communication(myGame, first, conn);
+    if(communicationStatus == 1) {
+        /* I lost */
+        handle_loss(myGame, first);
+    } else if(communicationStatus == 0) {
+        /* I disconnected and didn't come back */
+        handle_quit(myGame, first);
+    }
+
+    /* Socket was closed when the game was done with it */
+    leave_game(myGame);
+    put_user(me);
+}
+
+/* Relaying */
+
+/*
+ * A seat handed back from the I/O thread to a thread of its own
+ */
+typedef struct Seat {
+    int game;
+    int player;
+    User* me;
+    Conn* conn;
+} Seat;
+
+void* seat_thread(void* arg) {
+    Seat* seat = (Seat *)arg;
+
+    finish_seat(seat->game, seat->player, seat->me, seat->conn);
+    free(seat);
+    fflush(stdout);
+    pthread_exit(NULL);
+    return NULL;
+}
+
+/*
+ * Relay as many turns of a game as have arrived, on the I/O thread. Only
+ * the middle of a game is relayed here: its end, a player dropping out
+ * or coming back, and anything else that has to wait, are left to the
+ * seats' own threads.
+ * Returns true if the seats need their threads back
+ */
+bool relay_turns(int game) {
+    Play* play = play_of(game);
+    char message[80];
+    char peek[80];
+    const char* args;
+
+    while(1) {
+        lock_game(game);
+        int player = gameTable.turns[game];
+        bool changed = (gameTable.flags[game] & TABLE_ENDED) ||
+                gameTable.conns[game][0] != play->seats[0]->fd ||
+                gameTable.conns[game][1] != play->seats[1]->fd;
+        unlock_game(game);
+
+        Conn* conn = play->seats[player];
+        if(changed || !flush_outbox(game, player, conn)) {
+            return true;
+        }
+        int got = conn_next_line(conn, message, 80, false);
+        if(got <= 0) {
+            return got < 0;     // Wait for more unless it has gone
+        }
+
+        /* The last move and leaving are left in place for the thread */
+        strcpy(peek, message);
+        trace_split(peek);
+        Command command = proto_command(peek, &args);
+        if(command == CMD_BYE ||
+                (command == CMD_RESPONSE && strcmp(args, "over\n") == 0)) {
+            return true;
+        }
+        conn_next_line(conn, message, 80, true);
+        pass_message(game, player, message);
+
+        lock_game(game);
+        gameTable.turns[game] = !player;
+        unlock_game(game);
+    }
+}
+
+/*
+ * Called by the I/O thread when either player's input arrives
+ */
+void relay_input(Conn* conn, void* arg) {
+    int game = (int)(long)arg;
+    Play* play = play_of(game);
+    Seat* seats[2];
+    pthread_t threadID;
+
+    if(!relay_turns(game)) {
+        return;
+    }
+    lock_game(game);
+    for(int i = 0; i < 2; i++) {
+        seats[i] = (Seat *)malloc(sizeof(Seat));
+        seats[i]->game = game;
+        seats[i]->player = i;
+        seats[i]->me = play->users[i];
+        seats[i]->conn = play->seats[i];
+        conn_set_handler(play->seats[i], NULL, NULL);
+        play->seats[i] = NULL;
+    }
+    unlock_game(game);
+    for(int i = 0; i < 2; i++) {
+        pthread_create(&threadID, NULL, seat_thread, seats[i]);
+        pthread_detach(threadID);
+    }
+}
+
+/*
+ * Leave a seat in a game that has started to the I/O thread, which
+ * relays it once both players are there. The thread that played it up
+ * to now is free to go.
+ */
+void relay_seat(int game, int player, User* me, Conn* conn) {
+    Play* play = play_of(game);
+
+    /* Held until both have handlers, so the relay can't start early */
+    lock_game(game);
+    play->seats[player] = conn;
+    play->users[player] = me;
+    if(play->seats[!player] != NULL) {
+        for(int i = 0; i < 2; i++) {
+            conn_set_handler(play->seats[i], relay_input,
+                    (void *)(long)game);
+        }
+        conn_poke(conn);    // For whatever arrived before
+    }
+    unlock_game(game);
+}
+
+/*
+ * Play a seat from when the player has their token until the game is
+ * over for them. Closes conn and lets go of me.
+ */
+void play_seat(int myGame, int playerNum, User* me, Conn* conn) {
+    if(!wait_for_opponent(myGame, playerNum, conn->fd)) {
+        /* Nobody came */
+        conn_close(conn);
+        leave_game(myGame);
+        put_user(me);
+        return;
+    }
+
+    if(relayed) {
+        relay_seat(myGame, playerNum, me, conn);
+    } else {
+        finish_seat(myGame, playerNum, me, conn);
+    }
+}
+
+/*
+ * Put a player whose handshake and map have been read in the game they
+ * asked for, then play their seat. Closes conn and lets go of me.
+ */
+void join_and_play(Conn* conn, User* me, char* id, char* game,
+        RuleSet* ruleSet) {
+    int myGame;
+    int playerNum;
+    uint64_t token;
+
+    /* Add user to game */
+    begin_change();
+    pthread_mutex_lock(&gameListMutex);
+    if(handingOver && !is_channel(conn->fd)) {
+        /* The new server has the game, or will start it */
+        pthread_mutex_unlock(&gameListMutex);
+        end_change();
+        char line[256];
+        int fd = conn->fd;
+        snprintf(line, sizeof(line), "A %s %s %s\n", id, game,
+                ruleSet->name);
+        conn_release(conn);
+        hand_over(line, strlen(line), fd);
+        close(fd);
+        put_user(me);
+        return;
+    }
+    if((myGame = find_game(&gameTable, game)) == -1) {
+        /* Create new game if not at max games or draining */
+        SharedGame* slot = NULL;
+        if(!draining && !at_max_games(&gameTable) && (shared == NULL ||
+                (slot = shared_game_claim(shared, game,
+                    workerNum)) != NULL)) {
+            myGame = push_game(&gameTable, game, ruleSet);
+            if(slot != NULL) {
+                snprintf(slot->rules, SHARED_ID_LEN, "%s",
+                        ruleSet->name);
+                need_play(myGame)->slot = slot;
+            }
+            journal_event("G %s %s\n", game, ruleSet->name);
+            playerNum = 0;
+        } else {
+            pthread_mutex_unlock(&gameListMutex);
+            end_change();
+            log_message(LOG_MAX_CON, NULL, id, NULL, 0);
+            put_user(me);
+            handle_disconnect(conn, NULL, -1, -1);
+            return;
+        }
+    } else if(game_rules(myGame) != ruleSet) {
+        /* Only players with the same rules can play each other */
         pthread_mutex_unlock(&gameListMutex);
+        end_change();
+        log_message(LOG_RULES_CON, NULL, id, game, 0);
+        put_user(me);
+        handle_disconnect(conn, NULL, -1, -1);
+        return;
+    } else if((playerNum = restored_slot(myGame, me)) != -1) {
+        /* Back in the seat held since the server restarted */
+    } else {
+        /* Add to current game if game not full */
+        if(!is_full_game(myGame)) {
+            /* Set second player */
+            playerNum = 1;
+        } else {
+            pthread_mutex_unlock(&gameListMutex);
+            end_change();
+            log_message(LOG_FULL_CON, NULL, id, game, 0);
+            put_user(me);
+            handle_disconnect(conn, NULL, -1, -1);
+            return;
+        }
+    }
+    seat_user(myGame, playerNum, me);
+    Play* play = play_of(myGame);
+    if(play != NULL && play->slot != NULL) {
+        snprintf(play->slot->players[playerNum], SHARED_ID_LEN, "%s", id);
+    }
+    journal_event("J %s %d %s\n", game, playerNum, id);
+
+    /* Counted in while the list is held, so it can't expire under us */
+    lock_game(myGame);
+    gameTable.active[myGame]++;
+    unlock_game(myGame);
+    pthread_mutex_unlock(&gameListMutex);
+    end_change();
+
+    log_message(LOG_GOOD_CON, NULL, id, game, 0);
+    if(play != NULL && play->replay != NULL) {
+        replay_handshake(play->replay, playerNum, id);
+    }
+
+    /* Catch up on a restored game, then wait for the other player */
+    if(resend_moves(myGame, playerNum, conn)) {
+        /* Messages are counted from the token on */
+        lock_game(myGame);
+        token = make_token();
+        gameTable.tokens[myGame][playerNum] = token;
+        play = play_of(myGame);
+        if(play != NULL) {
+            if(play->outbox[playerNum] != NULL) {
+                ring_init(play->outbox[playerNum]);
+            }
+            play->received[playerNum] = 0;
+        }
+        unlock_game(myGame);
+        char line[80];
+        sprintf(line, "$token %016llx\n", (unsigned long long)token);
+        conn_write(conn, line, strlen(line));
+
+        play_seat(myGame, playerNum, me, conn);
+    } else {
+        /* The seat is held for them as if they had dropped out */
+        lock_game(myGame);
+        gameTable.active[myGame]--;
+        unlock_game(myGame);
+        put_user(me);
+        handle_disconnect(conn, NULL, -1, -1);
     }
 }
 
 /*
- * Called by the user who lost the game
+ * The thread for interacting with clients
  */
-void handle_loss(Game* game, bool first) {
-    int playerNum = first ? 0 : 1;
-    int opponentNum = first ? 1 : 0;
+void* client_thread(void* arg) {
+    int fd;
+    User* me = NULL;
+
+    fd  = (int)arg;
+    Conn* conn = conn_open(fd);
+	char* id  = (char *)malloc(sizeof(char) * 80);
+	char* game = (char *)malloc(sizeof(char) * 80);
+    char token[TOKEN_LEN + 1];
+    unsigned int seen;
+
+    /* Get info about new player */
+    RuleSet* ruleSet;
+    int mapStatus;
+    int hello = parse_handshake(conn, &id, &game, token, &seen, &ruleSet,
+            &mapStatus);
+    if(hello == 3) {
+        serve_multiplexed(conn);
+        free(id);
+        free(game);
+        pthread_exit(NULL);
+        return NULL;
+    } else if(hello == 2) {
+        /* Returning player, their old thread takes it from here */
+        conn_release(conn);
+        if(resume_player(fd, token, seen)) {
+            pthread_exit(NULL);
+            return NULL;
+        }
+
+        /* Or the server this one took over from, if it has their game */
+        char line[80];
+        sprintf(line, "R %s %u\n", token, seen);
+        if(!handingOver && hand_over(line, strlen(line), fd)) {
+            close(fd);
+            pthread_exit(NULL);
+            return NULL;
+        }
+        conn = conn_open(fd);
+        conn_write(conn, "$resume bad\n", 12);
+    } else if(hello == 1 && ruleSet == NULL) {
+        log_message(LOG_NO_RULES, NULL, id, NULL, 0);
+    } else if(hello == 1) {
+	    /* Push user if isn't already in the list */
+        begin_change();
+        me = get_user(id, true);
+        end_change();
+
+        /* Check for good/bad map, unless the client already did */
+        if(mapStatus == 0) {
+            mapStatus = parse_map(conn, ruleSet);
+        }
+		if(mapStatus == 1) {
+            join_and_play(conn, me, id, game, ruleSet);
+            free(id);
+            free(game);
+            fflush(stdout);
+            pthread_exit(NULL);
+            return NULL;
+        } else if(mapStatus == 2) {
+            log_message(LOG_BAD_MAP, NULL, id, NULL, 0);
+        }
+    }
+
+    /* Disconnection catch-all */
+    put_user(me);
+    handle_disconnect(conn, NULL, -1, -1);
+    fflush(stdout);
+    pthread_exit(NULL);
+    return NULL;
+}
+
+/* 
+ * Handle various signals 
+ */
+void handle_sigs(int sigNum) {
+	switch(sigNum) {
+		case SIGINT:
+            if(workerNum < 0) {
+                log_message(LOG_STOP, NULL, NULL, NULL, 0);
+            }
+			exit(0);
+        case SIGTERM:
+            exit(0);    // A worker whose supervisor has gone
+	}
+}
 
+/* Eviction */
+
+/*
+ * End games that have waited seconds for players without starting.
+ * Anyone waiting in one leaves it, and the last out removes it. A game
+ * restored from a snapshot may have no one in it, so goes straight away.
+ * Only the table is read to find them.
+ */
+void evict_games(time_t now, int seconds) {
+    begin_change();
     pthread_mutex_lock(&gameListMutex);
-    /* Disconnect both players */
-    close(game->fd[playerNum]);
-    close(game->fd[opponentNum]);
+    for(unsigned int i = 0; i < gameTable.high; i++) {
+        if(gameTable.phases[i] != TABLE_WAITING ||
+                now - gameTable.since[i] < seconds) {
+            continue;
+        }
+        lock_game(i);
+        bool idle = !(gameTable.flags[i] & (TABLE_STARTED | TABLE_ENDED));
+        if(idle) {
+            gameTable.flags[i] |= TABLE_ENDED;
+            pthread_cond_broadcast(table_cond(&gameTable, i));
+        }
+        bool empty = gameTable.active[i] == 0;
+        unlock_game(i);
+        if(!idle) {
+            continue;
+        }
+        gameTable.phases[i] = TABLE_OVER;
 
-    /* Increase win/loss for appropriate player */
-    game->users[playerNum]->lost++;
-    game->users[opponentNum]->won++;
+        log_message(LOG_IDLE, NULL, NULL, game_name(i), 0);
+        journal_event("R %s\n", game_name(i));
+        if(empty) {
+            remove_game(&gameTable, i);
+        }
+    }
+    pthread_mutex_unlock(&gameListMutex);
+    end_change();
+}
 
-    /* Log win */
-    log_message(LOG_WIN, NULL, game->users[opponentNum]->id, game->id, 0);
+/*
+ * Write users no one has held for coldSeconds to the store and free
+ * them. Stats dumps read the list without the lock, so a user is only
+ * freed once no dump can still be looking at them. The top of the ladder
+ * is always kept, so $top doesn't need the store.
+ */
+void spill_users(time_t now) {
+    User* spilled[256];
+    int n = 0;
+    StoredUser stored;
+
+    pthread_mutex_lock(&userListMutex);
+    for(User** link = &userListHead; *link != NULL && n < 256; ) {
+        User* user = *link;
+        if(__atomic_load_n(&user->refs, __ATOMIC_ACQUIRE) != 0 ||
+                now - __atomic_load_n(&user->lastSeen, __ATOMIC_RELAXED) <
+                    coldSeconds ||
+                ladder_rank(&ladder, &user->rank) <= TOP_MAX) {
+            link = &user->next;
+            continue;
+        }
+        snprintf(stored.id, sizeof(stored.id), "%s", user->id);
+        stored.won = user->won;
+        stored.lost = user->lost;
+        stored.disconns = user->disconns;
+        stored.rating = user->rank.rating;
+        if(!store_put(userStore, &stored)) {
+            link = &user->next;     // No room, so keep them
+            continue;
+        }
+
+        /* A dump part way along still finds its way on from them */
+        stats_begin();
+        __atomic_store_n(link, user->next, __ATOMIC_RELEASE);
+        ladder_remove(&ladder, &user->rank);
+        set_user(user->handle, NULL);
+        stats_end();
+        spilled[n++] = user;
+    }
+    pthread_mutex_unlock(&userListMutex);
+
+    if(n == 0) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&statsReaders, __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+    for(int i = 0; i < n; i++) {
+        free_user(spilled[i]);
+    }
+}
+
+/*
+ * Look for idle games and cold users once a second
+ */
+void* evict_thread(void* arg) {
+    while(1) {
+        sleep(1);
+        time_t now = time(NULL);
+        if(idleSeconds > 0) {
+            evict_games(now, idleSeconds);
+        }
+        if(userStore != NULL && !handingOver) {
+            spill_users(now);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start evicting if either kind of eviction is on
+ */
+void start_eviction(void) {
+    pthread_t threadID;
+
+    if(idleSeconds > 0 || userStore != NULL) {
+        pthread_create(&threadID, NULL, evict_thread, NULL);
+        pthread_detach(threadID);
+    }
+}
+
+/* Admission */
+
+/*
+ * Take a token for the address fd is connected from. Nothing has been
+ * spent on the connection yet, and nothing will be if it is refused.
+ * Returns false, having closed fd, if the address is over its limit
+ */
+bool admit(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t addrLen = sizeof(addr);
+    const void* key;
+    size_t keyLen;
+    bool first;
+
+    if(!limiting || getpeername(fd, (struct sockaddr *)&addr, &addrLen) < 0) {
+        return true;
+    }
+    if(addr.ss_family == AF_INET) {
+        key = &((struct sockaddr_in *)&addr)->sin_addr;
+        keyLen = sizeof(struct in_addr);
+    } else if(addr.ss_family == AF_INET6) {
+        key = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+        keyLen = sizeof(struct in6_addr);
+    } else {
+        return true;
+    }
+    if(limit_admit(key, keyLen, &first)) {
+        return true;
+    }
+
+    /* Once per run of refusals, so a flood doesn't flood the log too */
+    if(first) {
+        char who[INET6_ADDRSTRLEN];
+        if(inet_ntop(addr.ss_family, key, who, sizeof(who)) != NULL) {
+            log_message(LOG_LIMITED, NULL, who, NULL, 0);
+        }
+    }
+    close(fd);
+    return false;
+}
+
+/* Prefork */
+
+/*
+ * Open what each serving process writes to for itself. A worker's files
+ * are named after it, so no two processes write to the same one.
+ */
+void start_outputs(char* tracePath, char* replayPath, bool useUring) {
+    char path[1024];
+    char name[40];
+
+    if(useUring && !(relayed = conn_use_uring())) {
+        fprintf(stderr, "io_uring unavailable, using threads.\n");
+    }
+    if(tracePath != NULL) {
+        snprintf(path, sizeof(path), workerNum < 0 ? "%s" : "%s.%d",
+                tracePath, workerNum);
+        snprintf(name, sizeof(name), workerNum < 0 ? "nserver" :
+                "nserver %d", workerNum);
+        if(handoverFd >= 0) {
+            /* Not over the trace of the server it took over from */
+            snprintf(path, sizeof(path), "%s.%d", tracePath, (int)getpid());
+        }
+        if(!trace_open(path, name)) {
+            throw_error(ERR_TYPE_P);
+        }
+    }
+    if(replayPath != NULL) {
+        snprintf(path, sizeof(path), workerNum < 0 ? "%s" : "%s.%d",
+                replayPath, workerNum);
+        if((replayLog = replay_open(path)) == NULL) {
+            throw_error(ERR_TYPE_P);
+        }
+    }
+}
+
+/*
+ * Bring the supervisor's users up to date with what the workers have
+ * done, so it can answer ladder queries and dump stats. Only users who
+ * changed since last time are looked at again.
+ */
+void sync_users(void) {
+    static unsigned int lastGen = 0;
+    static User** users = NULL;     // The user in each shared slot
+    static unsigned int* gens;      // The slot's gen when last looked at
+    unsigned int gen = __atomic_load_n(&shared->userGen, __ATOMIC_ACQUIRE);
+
+    if(gen == lastGen) {
+        return;
+    }
+    lastGen = gen;
+    if(users == NULL) {
+        users = (User **)calloc(SHARED_USERS, sizeof(User *));
+        gens = (unsigned int *)calloc(SHARED_USERS, sizeof(unsigned int));
+    }
+    for(int i = 0; i < SHARED_USERS; i++) {
+        SharedUser* slot = &shared->users[i];
+        unsigned int slotGen = __atomic_load_n(&slot->gen, __ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SLOT_USED ||
+                slotGen == gens[i]) {
+            continue;
+        }
+        gens[i] = slotGen;
+        pthread_mutex_lock(&userListMutex);
+        if(users[i] == NULL) {
+            users[i] = push_user(&userListHead, slot->id);
+        } else {
+            stats_begin();
+            pull_stats(users[i]);
+            stats_end();
+        }
+        pthread_mutex_unlock(&userListMutex);
+    }
+}
+
+/*
+ * Returns the worker a handshake sends its connection to: the one running
+ * the game it names or, for a resume, the one its token names. -1 if the
+ * line is to be ignored, as a worker would, and -2 if it can go nowhere.
+ */
+int pick_worker(Command command, const char* args, int nWorkers) {
+    char word[80];
+    int worker;
+
+    switch(command) {
+        case CMD_HANDSHAKE:
+        case CMD_HELLO:
+            if(proto_word(&args, word, sizeof(word)) &&
+                    proto_word(&args, word, sizeof(word))) {
+                return replay_hash(word, strlen(word)) % nWorkers;
+            }
+            return -1;
+        case CMD_RESUME:
+            if(isdigit((unsigned char)args[0])) {
+                worker = args[0] - '0';
+            } else if(args[0] >= 'a' && args[0] <= 'f') {
+                worker = args[0] - 'a' + 10;
+            } else {
+                return -1;
+            }
+            return worker < nWorkers ? worker : -2;
+        case CMD_MULTIPLEX:
+            return -2;  // Its games may belong to different workers
+        default:
+            return -1;
+    }
+}
+
+/*
+ * Fork worker n, which plays the games it is handed over channel
+ * Returns its pid
+ */
+pid_t start_worker(int n, int fdServer, int* channel, char* tracePath,
+        char* replayPath, bool useUring) {
+    int fds[2];
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        throw_error(ERR_NET);
+    }
+    pid_t pid = fork();
+    if(pid != 0) {
+        close(fds[1]);
+        *channel = fds[0];
+        return pid;
+    }
 
-    /* Remove the game */
-    remove_game(gameArray, game);
+    /* Worker: go when the supervisor does, quietly */
+    close(fds[0]);
+    close(fdServer);
+#ifdef __linux__
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    signal(SIGTERM, handle_sigs);
+    sigset_t term;
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    pthread_sigmask(SIG_UNBLOCK, &term, NULL);  // Only the supervisor drains
+    workerNum = n;
+    start_outputs(tracePath, replayPath, useUring);
+    start_eviction();
 
-    pthread_mutex_unlock(&gameListMutex);
+    pthread_t thread_id;
+    int fd;
+    while((fd = conn_recv_fd(fds[1])) >= 0) {
+		pthread_create(&thread_id, NULL, client_thread, (void*)(long)fd);
+		pthread_detach(thread_id);
+    }
+    exit(0);
 }
 
 /*
- * Allows communication between clients.
- * Returns 1 if player lost
- * Returns 0 if player disconnected
- * Returns -1 if opponent disconnected
+ * Own the listening socket and hand each connection to the worker for
+ * its game, replacing workers that die. A connection is only looked at
+ * until its first line has arrived, and ladder queries are answered here
+ * without ever waiting on the client.
  */
-int parse_communication(Game* myGame, bool first) {
-    int playerNum = first ? 0 : 1;
-    int opponentNum = first ? 1 : 0;
-    int fdPlayer = myGame->fd[playerNum];
-    int fdOpponent = myGame->fd[opponentNum];
-
-    FILE* playerGet = fdopen(fdPlayer, "r");
-    FILE* opponentSend = fdopen(fdOpponent, "w");
-
-    bool turn = first;
-    char message[80];
+void supervise(int fdServer, int nWorkers, char* tracePath,
+        char* replayPath, bool useUring) {
+    pid_t pids[SHARED_WORKERS];
+    int channels[SHARED_WORKERS];
+    struct pollfd fds[PENDING_MAX + 1];
+    time_t since[PENDING_MAX + 1];      // When each connection arrived
+    size_t avail[PENDING_MAX + 1];      // Bytes it had last time
+    bool stalled[PENDING_MAX + 1];      // No more since, don't poll it
+    int nFds = 1;
+    char line[1024];
+
+    for(int i = 0; i < nWorkers; i++) {
+        pids[i] = start_worker(i, fdServer, &channels[i], tracePath,
+                replayPath, useUring);
+    }
+    fds[0].fd = fdServer;
 
-    /* Keep reading more input until otherwise */
     while(1) {
-        if(turn) {
-            if(fgets(message, 80, playerGet) != NULL) {
-                if(strcmp(message, "$response over\n") == 0) {
-                    fprintf(opponentSend, message);
-                    if(fflush(opponentSend) == EOF) {
-                        return -1;
-                    }
-                    return 1;
-                }
-
-                fprintf(opponentSend, "awef\n");    //Don't know why this
-                fflush(opponentSend);               //is necessary...
-
-                fprintf(opponentSend, message);
-                if(fflush(opponentSend) == EOF) {
-                    return -1;
+        /* Replace workers that have died, their games went with them */
+        pid_t pid;
+        while((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            for(int i = 0; i < nWorkers; i++) {
+                if(pids[i] == pid) {
+                    close(channels[i]);
+                    shared_release_worker(shared, i);
+                    log_message(LOG_WORKER, NULL, NULL, NULL, i);
+                    pids[i] = start_worker(i, fdServer, &channels[i],
+                            tracePath, replayPath, useUring);
                 }
-            } else {
-                return 0;
             }
-
-            /* Signal next player to go */
-            pthread_mutex_lock(&myGame->startMutex);
-            turn = !turn;
-            pthread_cond_signal(&myGame->startCond);
-            pthread_mutex_unlock(&myGame->startMutex);
-        } else {
-            /* Player waits for signal that it's his turn */
-            pthread_mutex_lock(&myGame->startMutex);
-            pthread_cond_wait(&myGame->startCond, &myGame->startMutex);
-            turn = !turn;
-            pthread_mutex_unlock(&myGame->startMutex);
         }
-    }
-}
+        sync_users();
+
+        /* Stalled connections are looked at again every tick */
+        bool anyStalled = false;
+        fds[0].fd = draining ? -1 : fdServer;
+        fds[0].events = nFds <= PENDING_MAX ? POLLIN : 0;
+        for(int i = 1; i < nFds; i++) {
+            fds[i].events = stalled[i] ? 0 : POLLIN;
+            anyStalled = anyStalled || stalled[i];
+        }
+        if(poll(fds, nFds, anyStalled ? 10 : 1000) < 0 && errno != EINTR) {
+            throw_error(ERR_NET);
+        }
 
-/*
- * The thread for interacting with clients
- */
-void* client_thread(void* arg) {
-    int fd;
-    bool first;   // 0 or 1 depending on whether first or second player
-    User* me = NULL;
-    Game* myGame = NULL;
+        if(fds[0].revents & POLLIN) {
+            int fd = accept(fdServer, NULL, NULL);
+            if(fd >= 0 && admit(fd)) {
+                fds[nFds].fd = fd;
+                fds[nFds].revents = 0;
+                since[nFds] = time(NULL);
+                avail[nFds] = 0;
+                stalled[nFds] = false;
+                nFds++;
+            }
+        }
 
-    fd  = (int)arg;
-	char* id  = (char *)malloc(sizeof(char) * 80);
-	char* game = (char *)malloc(sizeof(char) * 80);
+        for(int i = nFds - 1; i >= 1; i--) {
+            int fd = fds[i].fd;
+            int worker = -2;
+            size_t now;
+            int len = 0;
 
-    /* Get info about new player */
-	if(parse_handshake(fd, &id, &game)) {
-	    /* Push user if isn't already in the list */
-        me = find_user(userListHead, id);
-    	if(me == NULL) {
-	    	push_user(&userListHead, id);
-            me = userListHead;
-	    }
-
-        /* Check for good/bad map */
-        int mapStatus = parse_map(fd, rules);
-		if(mapStatus == 1) {
+            if(fds[i].revents == 0 && !stalled[i] &&
+                    time(NULL) - since[i] <= CONN_TIMEOUT) {
+                continue;
+            }
+            while((len = conn_peek_line(fd, line, sizeof(line), &now)) > 0) {
+                const char* args = "";
+                Command command = proto_command(line, &args);
+                if((worker = pick_worker(command, args, nWorkers)) != -1) {
+                    break;  // Leave the handshake for the worker
+                }
 
-            /* Add user to game */
-            if((myGame = find_game(gameArray, game)) == NULL) {
-                /* Create new game if not at max games */
-                if(!at_max_games(gameArray, maxGames)) {
-                    myGame = push_game(gameArray, game);
-                    myGame->users[0] = me;
-                    myGame->fd[0] = fd;
-                    first = true;
-                    log_message(LOG_GOOD_CON, NULL, id, game, 0);
-
-                    /* Wait for second player */
-                    pthread_mutex_lock(&myGame->startMutex);
-                    while(myGame->start == false) {
-                        fflush(stdout);
-                        pthread_cond_wait(&myGame->startCond, 
-                                &myGame->startMutex);
-                        fflush(stdout);
+                /* Answer ladder queries, anything else is ignored. One
+                 * that doesn't go out at once drops the client, who
+                 * isn't reading, rather than hold up everyone else. */
+                conn_skip(fd, len);
+                if(command == CMD_TOP || command == CMD_RANK) {
+                    size_t answerLen;
+                    char* answer = answer_ladder(command, args, &answerLen);
+                    bool sent = conn_write_now(fd, answer, answerLen);
+                    free(answer);
+                    if(!sent) {
+                        break;
                     }
-                    pthread_mutex_unlock(&myGame->startMutex);
-
-                    /* Send $yourmove to first player */
-                    write(fd, "$yourmove\n", 11);
-                } else {
-                    log_message(LOG_MAX_CON, NULL, id, NULL, 0);
-                    handle_disconnect(fd, NULL, NULL, -1);
-                    fflush(stdout);
-                    pthread_exit(NULL);
-                    return NULL;
-
-                }
-            } else {
-                /* Add to current game if game not full */
-                if(!is_full_game(gameArray, game)) {
-                    /* Set second player */
-                    myGame->users[1] = me;
-                    myGame->fd[1] = fd;
-                    first = false ;
-                    log_message(LOG_GOOD_CON, NULL, id, game, 0);
-
-                    /* Signal first player */
-                    pthread_mutex_lock(&myGame->startMutex);
-                    pthread_cond_signal(&myGame->startCond);
-                    myGame->start = true;
-                    pthread_mutex_unlock(&myGame->startMutex);
-                } else {
-                    log_message(LOG_FULL_CON, NULL, id, game, 0);
-                    handle_disconnect(fd, NULL, NULL, -1);
-                    fflush(stdout);
-                    pthread_exit(NULL);
-                    return NULL;
                 }
             }
-
-            /* Parse further input */
-            int communicationStatus = parse_communication(myGame, first);
-            if(communicationStatus == 1) {
-                /* I lost */
-                handle_loss(myGame, first);
-                fflush(stdout);
-                pthread_exit(NULL);
-                return NULL;
-            } else if(communicationStatus == 0) {
-                /* I disconnected */
-                User* opponent = myGame->users[first ? 1 : 0];
-                handle_disconnect(fd, opponent, myGame, first);
-                log_message(LOG_DISCON, NULL, opponent->id, id, 0); 
-            } else if(communicationStatus == -1) {
-                /* Opponent disconnected on my turn */
-                handle_disconnect(fd, me, myGame, first);
-                log_message(LOG_DISCON, NULL, me->id, id, 0); 
+            if(len == 0 && time(NULL) - since[i] <= CONN_TIMEOUT) {
+                stalled[i] = now == avail[i];
+                avail[i] = now;
+                continue;   // Rest of the line still to come
             }
 
-        } else if(mapStatus == 2) {
-            log_message(LOG_BAD_MAP, NULL, id, NULL, 0);
+            /* Gone, too slow or nowhere to go if not handed over */
+            if(worker >= 0) {
+                conn_send_fd(channels[worker], fd);
+            }
+            close(fd);
+            nFds--;
+            fds[i] = fds[nFds];
+            since[i] = since[nFds];
+            avail[i] = avail[nFds];
+            stalled[i] = stalled[nFds];
         }
     }
-
-    /* Disconnection catch-all */
-    handle_disconnect(fd, NULL, NULL, -1);
-    fflush(stdout);
-    pthread_exit(NULL);
-    return NULL;
 }
 
 /* 
@@ -619,50 +3283,562 @@ void* client_thread(void* arg) {
  */
 void process_connections(int fdServer) {
     int fd;	// Newly accepted connection end-point
-    struct sockaddr_in fromAddr;	// Address of newly acccepted connection
-    unsigned int fromAddrSize; 
-    struct hostent *hp; 
     pthread_t thread_id;
 
     /* Accept new client connections until server is terminted */
     while(1) {
-		fromAddrSize = sizeof(struct sockaddr_in);
-		
 		/* Accept a connection - wait if none are pending */
 		/* Note that fd is a new one */
-		fd = accept(fdServer, (struct sockaddr*)&fromAddr,  &fromAddrSize);
-		if(fd < 0) {
+		fd = conn_accept(fdServer);
+		if(fd < 0 && draining) {
+			pthread_exit(NULL);	// Stopped listening, games carry on
+		} else if(fd < 0) {
 			throw_error(ERR_NET);
 		}
-		 
-		/* Determine where the connection request came from and print it out */
-		hp = gethostbyaddr((char *)&fromAddr.sin_addr.s_addr,
-				    sizeof(fromAddr.sin_addr.s_addr), AF_INET);
+		if(handingOver) {
+			/* Connections are the new server's now */
+			hand_over("C\n", 2, fd);
+			close(fd);
+			continue;
+		}
+		if(!admit(fd)) {
+			continue;	// Nothing spent on it but the accept
+		}
 		
 		pthread_create(&thread_id, NULL, client_thread, (void*)fd);
 		pthread_detach(thread_id);
     }
 }
 
-/* 
- * Handle various signals 
+/* Draining and upgrading */
+
+/*
+ * Returns how many games are still in play, across every worker if
+ * preforked. A worker's game is only in play once both players are in it.
  */
-void handle_sigs(int sigNum) {
-	switch(sigNum) {
-		case SIGINT:
-			log_message(LOG_STOP, NULL, NULL, NULL, 0);
-			exit(0);
-	}
+int live_games(void) {
+    int n = 0;
+
+    if(shared != NULL) {
+        for(int i = 0; i < shared->maxGames; i++) {
+            SharedGame* slot = &shared->games[i];
+            if(__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE) &&
+                    slot->players[0][0] && slot->players[1][0]) {
+                n++;
+            }
+        }
+        return n;
+    }
+    pthread_mutex_lock(&gameListMutex);
+    n = gameTable.count;
+    pthread_mutex_unlock(&gameListMutex);
+    return n;
 }
 
-/* 
- * Handle SIGHUP 
+/*
+ * Stop taking games, let those in play finish for up to drainSeconds,
+ * then go. Games waiting for players are ended straight away. A server
+ * that has handed over leaves the rest to the new one, otherwise the
+ * last snapshot and stats are written on the way out.
+ */
+void* drain_thread(void* arg) {
+    draining = true;
+    if(!handingOver) {
+        log_message(LOG_DRAIN, NULL, NULL, NULL, 0);
+        shutdown(listenFd, SHUT_RD);    // Wakes accept, connections stay
+    }
+    evict_games(time(NULL), 0);
+
+    time_t deadline = time(NULL) + drainSeconds;
+    while(live_games() > 0 && time(NULL) < deadline) {
+        usleep(100000);
+    }
+
+    if(!handingOver) {
+        if(snapshotPath != NULL) {
+            save_snapshot();
+        }
+        dump_stats();
+        log_message(LOG_STOP, NULL, NULL, NULL, 0);
+    }
+    exit(0);
+    return NULL;
+}
+
+/*
+ * A player handed over by the server this one took over from, either
+ * seated in a game that was waiting or still to join one
+ */
+typedef struct Arrival {
+    int fd;
+    int seat;           // Game they are seated in, -1 if joining
+    int player;
+    char id[80];        // Who is joining which game
+    char game[80];
+    RuleSet* rules;
+} Arrival;
+
+void* arrival_thread(void* arg) {
+    Arrival* arrival = (Arrival *)arg;
+    Conn* conn = conn_open(arrival->fd);
+
+    if(arrival->seat != -1) {
+        play_seat(arrival->seat, arrival->player,
+                seated(arrival->seat, arrival->player), conn);
+    } else {
+        begin_change();
+        User* me = get_user(arrival->id, true);
+        end_change();
+        join_and_play(conn, me, arrival->id, arrival->game, arrival->rules);
+    }
+    free(arrival);
+    return NULL;
+}
+
+/*
+ * Take a user's stats from the server that handed over, which may still
+ * be finishing games they played
+ */
+void adopt_stats(char* line) {
+    char id[80];
+    int won, lost, disconns, rating;
+
+    if(sscanf(line, "S %79s %d %d %d %d", id, &won, &lost, &disconns,
+                &rating) != 5) {
+        return;
+    }
+    begin_change();
+    User* user = get_user(id, true);
+    pthread_mutex_lock(&userListMutex);
+    stats_begin();
+    user->won = won;
+    user->lost = lost;
+    user->disconns = disconns;
+    ladder_set_rating(&ladder, &user->rank, rating);
+    stats_end();
+    journal_event("S %s %d %d %d %d\n", id, won, lost, disconns, rating);
+    pthread_mutex_unlock(&userListMutex);
+    end_change();
+    put_user(user);
+}
+
+/*
+ * Take a waiting game from the server that handed over, as the lines
+ * that make it, along with the players already waiting in it
+ */
+void adopt_game(char* lines) {
+    char id[80];
+    int game;
+
+    pthread_mutex_lock(&gameListMutex);
+    for(char* line = lines; *line != '\0'; ) {
+        char* end = strchr(line, '\n');
+        if(end != NULL) {
+            *end = '\0';
+        }
+        apply_event(line);
+        line = end ? end + 1 : line + strlen(line);
+    }
+    if(sscanf(lines, "G %79s", id) == 1 &&
+            (game = find_game(&gameTable, id)) != -1) {
+        settle_game(game);
+    }
+    pthread_mutex_unlock(&gameListMutex);
+}
+
+/*
+ * Seat a player handed over with the game they were waiting in
+ * Returns false if their game couldn't be taken over
+ */
+bool adopt_seat(char* record, int fd) {
+    char id[80], token[80];
+    int player;
+    int game;
+    User* user;
+
+    if(sscanf(record, "T %79s %d %16s", id, &player, token) != 3) {
+        return false;
+    }
+    player &= 1;
+    pthread_mutex_lock(&gameListMutex);
+    if((game = find_game(&gameTable, id)) == -1 ||
+            (user = seated(game, player)) == NULL) {
+        pthread_mutex_unlock(&gameListMutex);
+        return false;
+    }
+    lock_game(game);
+    gameTable.tokens[game][player] = parse_token(token);
+    gameTable.active[game]++;
+    unlock_game(game);
+    __atomic_add_fetch(&user->refs, 1, __ATOMIC_RELAXED);
+    Play* play = play_of(game);
+    if(play != NULL && play->replay != NULL) {
+        replay_handshake(play->replay, player, user->id);
+    }
+    pthread_mutex_unlock(&gameListMutex);
+
+    Arrival* arrival = (Arrival *)calloc(1, sizeof(Arrival));
+    pthread_t threadID;
+    arrival->fd = fd;
+    arrival->seat = game;
+    arrival->player = player;
+    pthread_create(&threadID, NULL, arrival_thread, arrival);
+    pthread_detach(threadID);
+    return true;
+}
+
+/*
+ * Act on a message from the other server, which is a line saying what
+ * it is and any fd that came with it:
+ *     B                        handing over starts
+ *     S id won lost disconns rating   (one or more lines)
+ *     G id rules ...           a waiting game, as snapshot lines
+ *     T game player token      a player waiting in it, with their socket
+ *     L                        the listening socket, handing over is done
+ *     C                        a connection the old server accepted
+ *     A id game rules          a player whose handshake it read
+ *     Y rulesHash id           a finished game's replay records follow
+ *     R token seen             a player resuming a game it is finishing
+ * Returns the listening socket if that is what came, else -1
+ */
+int take_record(char* record, size_t len, int fd) {
+    char id[80], game[80], name[80];
+    unsigned long long hash;
+    unsigned int seen;
+    pthread_t threadID;
+
+    switch(record[0]) {
+        case 'S':
+            for(char* line = record; line != NULL && *line != '\0'; ) {
+                char* end = strchr(line, '\n');
+                adopt_stats(line);
+                line = end ? end + 1 : NULL;
+            }
+            break;
+        case 'G':
+            adopt_game(record);
+            break;
+        case 'T':
+            if(fd >= 0 && adopt_seat(record, fd)) {
+                return -1;
+            }
+            break;
+        case 'L':
+            return fd;
+        case 'C':
+            if(fd >= 0 && admit(fd)) {
+                pthread_create(&threadID, NULL, client_thread,
+                        (void*)(long)fd);
+                pthread_detach(threadID);
+            }
+            return -1;
+        case 'A': {
+            RuleSet* rules;
+            if(fd < 0 || sscanf(record, "A %79s %79s %79s", id, game,
+                        name) != 3 || (rules = find_rules(name)) == NULL) {
+                break;
+            }
+            Arrival* arrival = (Arrival *)calloc(1, sizeof(Arrival));
+            arrival->fd = fd;
+            arrival->seat = -1;
+            sprintf(arrival->id, "%s", id);
+            sprintf(arrival->game, "%s", game);
+            arrival->rules = rules;
+            pthread_create(&threadID, NULL, arrival_thread, arrival);
+            pthread_detach(threadID);
+            return -1;
+        }
+        case 'Y': {
+            char* data = memchr(record, '\n', len);
+            if(replayLog != NULL && data != NULL &&
+                    sscanf(record, "Y %llx %79s", &hash, id) == 2) {
+                data++;
+                replay_write(replayLog, id, hash, (unsigned char *)data,
+                        len - (data - record));
+            }
+            break;
+        }
+        case 'R':
+            if(fd >= 0 && sscanf(record, "R %79s %u", name, &seen) == 2 &&
+                    strlen(name) == TOKEN_LEN &&
+                    resume_player(fd, name, seen)) {
+                return -1;
+            }
+            if(fd >= 0) {
+                Conn* conn = conn_open(fd);
+                conn_write(conn, "$resume bad\n", 12);
+                conn_close(conn);
+                return -1;
+            }
+            break;
+    }
+    if(fd >= 0) {
+        close(fd);
+    }
+    return -1;
+}
+
+/*
+ * Take messages from the other server until it goes
+ */
+void* handover_thread(void* arg) {
+    char* record = (char *)malloc(RECORD_MAX + 1);
+    ssize_t n;
+    int fd;
+
+    while((n = conn_recv_msg(handoverFd, record, RECORD_MAX, &fd)) > 0) {
+        record[n] = '\0';
+        take_record(record, n, fd);
+    }
+    pthread_mutex_lock(&handoverMutex);
+    close(handoverFd);
+    handoverFd = -1;
+    pthread_mutex_unlock(&handoverMutex);
+    free(record);
+    return NULL;
+}
+
+/*
+ * Send the new server what it needs to take over: every user's stats,
+ * the games waiting for players along with the players waiting in them,
+ * then the listening socket. Games in play stay to finish here; their
+ * players' stats and replays follow them over as they end. Nothing can
+ * join or change a game while this runs.
+ */
+void start_handover(void) {
+    size_t len = 0, size = 4096;
+    char* buffer = (char *)malloc(size);
+    UserStats* users;
+
+    pthread_mutex_lock(&saveMutex);
+    begin_change();
+    pthread_mutex_lock(&gameListMutex);
+    pthread_mutex_lock(&handoverMutex);
+    __atomic_store_n(&handingOver, true, __ATOMIC_SEQ_CST);
+    if(snapshotPath != NULL && journal != NULL) {
+        pthread_mutex_lock(&journalMutex);
+        fclose(journal);
+        journal = NULL;
+        pthread_mutex_unlock(&journalMutex);
+    }
+    conn_send_msg(handoverFd, "B\n", 2, -1);
+
+    __atomic_add_fetch(&statsReaders, 1, __ATOMIC_SEQ_CST);
+    int nUsers = copy_user_stats(&users);
+    for(int i = 0; i < nUsers; i++) {
+        buffer_printf(&buffer, &len, &size, "S %s %d %d %d %d\n",
+                users[i].id, users[i].won, users[i].lost,
+                users[i].disconns, users[i].rating);
+        if(len > 4000) {
+            conn_send_msg(handoverFd, buffer, len, -1);
+            len = 0;
+        }
+    }
+    if(len > 0) {
+        conn_send_msg(handoverFd, buffer, len, -1);
+    }
+    free(users);
+    __atomic_add_fetch(&statsReaders, -1, __ATOMIC_SEQ_CST);
+
+    /* Seats on a multiplexed connection can't leave it, so theirs expire */
+    for(unsigned int i = 0; i < gameTable.high; i++) {
+        if(gameTable.phases[i] != TABLE_WAITING) {
+            continue;
+        }
+        int32_t* fds = gameTable.conns[i];
+        lock_game(i);
+        if(gameTable.flags[i] != 0 || (fds[0] != -1 && is_channel(fds[0])) ||
+                (fds[1] != -1 && is_channel(fds[1]))) {
+            unlock_game(i);
+            continue;
+        }
+        len = 0;
+        buffer_game(&buffer, &len, &size, i);
+        conn_send_msg(handoverFd, buffer, len, -1);
+        for(int j = 0; j < 2; j++) {
+            if(fds[j] != -1) {
+                char line[160];
+                sprintf(line, "T %s %d %016llx\n", game_name(i), j,
+                        (unsigned long long)gameTable.tokens[i][j]);
+                conn_send_msg(handoverFd, line, strlen(line), fds[j]);
+            }
+        }
+
+        /* Whoever was waiting in it here just leaves */
+        gameTable.flags[i] |= TABLE_ENDED;
+        pthread_cond_broadcast(table_cond(&gameTable, i));
+        bool empty = gameTable.active[i] == 0;
+        unlock_game(i);
+        gameTable.phases[i] = TABLE_OVER;
+        if(empty) {
+            remove_game(&gameTable, i);
+        }
+    }
+    conn_send_msg(handoverFd, "L\n", 2, listenFd);
+
+    pthread_mutex_unlock(&handoverMutex);
+    pthread_mutex_unlock(&gameListMutex);
+    end_change();
+    pthread_mutex_unlock(&saveMutex);
+    free(buffer);
+}
+
+/*
+ * Start a new server from the binary this one was started from, with the
+ * same arguments, and hand over to it. This one then drains. Nothing is
+ * handed over unless the new server starts and says it is ready.
+ * Returns false if it didn't start
+ */
+bool upgrade(void) {
+    extern char** environ;
+    int fds[2];
+    struct rlimit files;
+    char ready[16];
+    int fd;
+
+    if(shared != NULL || socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) {
+        return false;   // Preforked servers can only drain
+    }
+
+    /* All made before forking, the child may only make system calls */
+    int nEnv = 0;
+    while(environ[nEnv] != NULL) {
+        nEnv++;
+    }
+    char** env = (char **)malloc(sizeof(char *) * (nEnv + 2));
+    int n = 0;
+    for(int i = 0; i < nEnv; i++) {
+        if(strncmp(environ[i], "NSERVER_UPGRADE=", 16) != 0) {
+            env[n++] = environ[i];
+        }
+    }
+    env[n++] = "NSERVER_UPGRADE=3";
+    env[n] = NULL;
+    getrlimit(RLIMIT_NOFILE, &files);
+    int maxFd = files.rlim_cur < 65536 ? (int)files.rlim_cur : 65536;
+
+    /* Both write the log as it is, a line at a time */
+    fcntl(fileno(logFile), F_SETFL, O_APPEND);
+
+    pid_t pid = fork();
+    if(pid == 0) {
+        /* Only the channel goes with it, as fd 3 */
+        dup2(fds[1], 3);
+#ifdef SYS_close_range
+        if(syscall(SYS_close_range, 4, ~0U, 0) != 0)
+#endif
+        for(fd = 4; fd < maxFd; fd++) {
+            close(fd);
+        }
+        execve(serverArgv[0], serverArgv, env);
+        _exit(127);
+    }
+    free(env);
+    close(fds[1]);
+
+    /* It says so once it has read its rules */
+    struct pollfd channel = {fds[0], POLLIN, 0};
+    if(pid < 0 || poll(&channel, 1, 10000) != 1 ||
+            conn_recv_msg(fds[0], ready, sizeof(ready), &fd) != 2 ||
+            ready[0] != 'H') {
+        if(pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        close(fds[0]);
+        return false;
+    }
+
+    handoverFd = fds[0];
+    start_handover();
+    log_message(LOG_UPGRADE, NULL, NULL, NULL, pid);
+
+    pthread_t threadID;
+    pthread_create(&threadID, NULL, handover_thread, NULL);
+    pthread_detach(threadID);
+    return true;
+}
+
+/*
+ * Take over from the server that started this one: say this one is
+ * ready, then take users, waiting games and the listening socket. What
+ * it sends after that goes to handover_thread.
+ * Returns the listening socket
+ */
+int take_over(char* tracePath, char* replayPath, bool useUring) {
+    char* record = (char *)malloc(RECORD_MAX + 1);
+    int fdServer = -1;
+    ssize_t n;
+    int fd;
+
+    if(!conn_send_msg(handoverFd, "H\n", 2, -1) ||
+            conn_recv_msg(handoverFd, record, RECORD_MAX, &fd) != 2 ||
+            record[0] != 'B') {
+        throw_error(ERR_NET);
+    }
+
+    /* The old server has stopped writing its files, so they are ours */
+    start_outputs(tracePath, replayPath, useUring);
+    if(snapshotPath != NULL) {
+        FILE* file = fopen(snapshotPath, "r");
+        if(file != NULL) {
+            if(fscanf(file, "snapshot %lu", &journalNum) != 1) {
+                journalNum = 0;
+            }
+            fclose(file);
+        }
+    }
+
+    while(fdServer < 0) {
+        if((n = conn_recv_msg(handoverFd, record, RECORD_MAX, &fd)) <= 0) {
+            throw_error(ERR_NET);
+        }
+        record[n] = '\0';
+        fdServer = take_record(record, n, fd);
+    }
+    free(record);
+    if(snapshotPath != NULL) {
+        save_snapshot();
+    }
+
+    pthread_t threadID;
+    pthread_create(&threadID, NULL, handover_thread, NULL);
+    pthread_detach(threadID);
+    return fdServer;
+}
+
+/*
+ * Handle the signals every other thread blocks: SIGHUP dumps stats,
+ * SIGTERM drains and SIGUSR2 hands over to a new server, then drains
  */
-void* hup_handler(void *arg) {
-    sigset_t* new = (sigset_t *)arg;
+void* signal_thread(void* arg) {
+    sigset_t* set = (sigset_t *)arg;
+    pthread_t threadID;
+
     while(1) {
-        sigwait(new);
-        print_user_stats(userListHead);
+        int sig;
+        sigwait(set, &sig);
+        switch(sig) {
+            case SIGHUP:
+                dump_stats();
+                break;
+            case SIGUSR2:
+                if(draining) {
+                    break;
+                }
+                if(!upgrade()) {
+                    log_message(LOG_NO_UPGRADE, NULL, NULL, NULL, 0);
+                    break;
+                }
+                /* Fall through */
+            case SIGTERM:
+                if(!draining) {
+                    draining = true;
+                    pthread_create(&threadID, NULL, drain_thread, NULL);
+                    pthread_detach(threadID);
+                }
+                break;
+        }
     }
     return NULL;
 }
@@ -676,21 +3852,147 @@ int main(int argc, char* argv[]) {
     pipeSigAction.sa_handler = SIG_IGN;
     sigaction(SIGPIPE, &pipeSigAction, NULL); //Assume it works
 
-    /* Block SIGHUP for threads */
+    /* Block SIGHUP, SIGTERM and SIGUSR2 for threads */
     sigset_t new;
     sigemptyset(&new);
     sigaddset(&new, SIGHUP);
+    sigaddset(&new, SIGTERM);
+    sigaddset(&new, SIGUSR2);
     pthread_sigmask(SIG_BLOCK, &new, NULL);
     pthread_t hupThreadID;
-    pthread_create(&hupThreadID, NULL, hup_handler, (void *)&new);
+    pthread_create(&hupThreadID, NULL, signal_thread, (void *)&new);
     pthread_detach(hupThreadID);
+    pthread_mutex_init(&handoverMutex, NULL);
+    pthread_mutex_init(&saveMutex, NULL);
+
+    /* Kept as given, as getopt may reorder them */
+    serverArgv = (char **)malloc(sizeof(char *) * (argc + 1));
+    for(int i = 0; i < argc; i++) {
+        serverArgv[i] = strdup(argv[i]);
+    }
+    serverArgv[argc] = NULL;
+
+    /* Started by a server handing over to this one */
+    char* upgrading = getenv("NSERVER_UPGRADE");
+    if(upgrading != NULL) {
+        handoverFd = atoi(upgrading);
+        unsetenv("NSERVER_UPGRADE");
+    }
+
+    /* Options come before the positional params */
+    char* replayPath = NULL;
+    char* tracePath = NULL;
+    bool useUring = false;
+    int nWorkers = 0;   // Not preforking
+    int opt;
+    char* storePath = NULL;
+    while((opt = getopt(argc, argv, "r:s:S:g:ut:d:p:l:e:U:w:D:")) != -1) {
+        switch(opt) {
+            case 'D':
+                if(sscanf(optarg, "%d", &drainSeconds) != 1 ||
+                        drainSeconds < 0) {
+                    throw_error(ERR_TYPE_P);
+                }
+                break;
+            case 'w':
+                if(sscanf(optarg, "%d", &batchMicros) != 1 ||
+                        batchMicros < 0 || batchMicros >= 1000000) {
+                    throw_error(ERR_TYPE_P);
+                }
+                break;
+            case 'e':
+                if(sscanf(optarg, "%d", &idleSeconds) != 1 ||
+                        idleSeconds <= 0) {
+                    throw_error(ERR_TYPE_P);
+                }
+                break;
+            case 'U': {
+                char* comma = strchr(optarg, ',');
+                if(comma != NULL) {
+                    *comma = '\0';
+                    if(sscanf(comma + 1, "%d", &coldSeconds) != 1 ||
+                            coldSeconds < 0) {
+                        throw_error(ERR_TYPE_P);
+                    }
+                }
+                storePath = optarg;
+                break;
+            }
+            case 'l': {
+                double rate;
+                unsigned int burst = LIMIT_BURST;
+                char extra;
+                int n = sscanf(optarg, "%lf,%u%c", &rate, &burst, &extra);
+                if((n != 1 && n != 2) || !limit_init(rate, burst)) {
+                    throw_error(ERR_TYPE_P);
+                }
+                limiting = true;
+                break;
+            }
+            case 'p':
+                if(sscanf(optarg, "%d", &nWorkers) != 1 || nWorkers < 1 ||
+                        nWorkers > SHARED_WORKERS) {
+                    throw_error(ERR_TYPE_P);
+                }
+                break;
+            case 'd':
+                statsPath = optarg;
+                break;
+            case 'r':
+                replayPath = optarg;
+                break;
+            case 's':
+                snapshotPath = optarg;
+                break;
+            case 'S':
+                if(sscanf(optarg, "%d", &snapshotInterval) != 1 ||
+                        snapshotInterval <= 0) {
+                    throw_error(ERR_TYPE_P);
+                }
+                break;
+            case 'g':
+                if(sscanf(optarg, "%d", &graceSeconds) != 1 ||
+                        graceSeconds < 0) {
+                    throw_error(ERR_TYPE_P);
+                }
+                break;
+            case 'u':
+                useUring = true;
+                break;
+            case 't':
+                tracePath = optarg;
+                break;
+            default:
+                throw_error(ERR_NUM_P);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
 
     if(argc != 5) {
 		throw_error(ERR_NUM_P);
     }
 
-	/* Open log file */
-	if((logFile = fopen(argv[1], "w")) == NULL) {
+    /* Workers keep their games to themselves, so can't snapshot them */
+    if(nWorkers > 0 && snapshotPath != NULL) {
+        throw_error(ERR_TYPE_P);
+    }
+
+    /* Nor spill users, who live on in the shared segment */
+    if(nWorkers > 0 && storePath != NULL) {
+        throw_error(ERR_TYPE_P);
+    }
+
+    /* Nor be handed over to */
+    if(nWorkers > 0 && handoverFd >= 0) {
+        throw_error(ERR_TYPE_P);
+    }
+    if(storePath != NULL && (userStore = store_open(storePath)) == NULL) {
+        throw_error(ERR_TYPE_P);
+    }
+
+	/* Open log file, carrying on the old server's if taking over */
+	if((logFile = fopen(argv[1], handoverFd >= 0 ? "a" : "w")) == NULL) {
         throw_error(ERR_TYPE_P);
     }
 	log_message(0, logFile, NULL, NULL, 0); // Initialize the log function
@@ -701,15 +4003,34 @@ int main(int argc, char* argv[]) {
 		throw_error(ERR_TYPE_P);	
 	}
 
-	/* Set max number of games and setup (null terminated) array */
-	gameArray = (Game **)malloc(sizeof(Game *) * (maxGames + 1));
-	gameArray[0] = NULL;
+    ladder_init(&ladder);
+
+	/* Set max number of games and set up the table */
+	table_init(&gameTable, maxGames);
 
-	/* Assume if rules can be opened, it is valid */
-	if((rules = fopen(argv[3], "r")) == NULL) {
+	/* Assume if rules can be opened, they are valid */
+	if(!load_all_rules(argv[3])) {
 		throw_error(ERR_RULES);
 	}
-    pthread_mutex_init(&rulesMutex, NULL);
+
+    if(nWorkers > 0) {
+        /* Workers write to the log too, a line at a time */
+        fcntl(fileno(logFile), F_SETFL, O_APPEND);
+        if((shared = shared_create(maxGames)) == NULL) {
+            throw_error(ERR_TYPE_P);
+        }
+    } else if(handoverFd < 0) {
+        start_outputs(tracePath, replayPath, useUring);
+    }
+
+    /* Pick up where a previous server left off */
+    if(snapshotPath != NULL) {
+        pthread_mutex_init(&journalMutex, NULL);
+        pthread_rwlock_init(&snapshotLock, NULL);
+        if(handoverFd < 0) {
+            restore_state();
+        }
+    }
 	
     /* Convert our ASCII port number to an integer */
     int portnum;
@@ -718,9 +4039,24 @@ int main(int argc, char* argv[]) {
 		throw_error(ERR_TYPE_P);
     }
 
-    int fdServer = open_listen(portnum); // Open a socket for the server
+    /* Open a socket for the server, or take the old server's */
+    int fdServer = handoverFd >= 0 ?
+            take_over(tracePath, replayPath, useUring) :
+            open_listen(portnum);
+    listenFd = fdServer;
+    if(snapshotPath != NULL) {
+        pthread_t snapshotThreadID;
+        pthread_create(&snapshotThreadID, NULL, snapshot_thread, NULL);
+        pthread_detach(snapshotThreadID);
+    }
 	log_message(LOG_START, NULL, NULL, NULL, portnum);
 
-    process_connections(fdServer); // Wait for connections
+    /* Wait for connections */
+    if(nWorkers > 0) {
+        supervise(fdServer, nWorkers, tracePath, replayPath, useUring);
+    } else {
+        start_eviction();
+        process_connections(fdServer);
+    }
     return 0;
 }
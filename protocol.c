@@ -0,0 +1,334 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+/* SIMD is picked at run time, so needs GCC on x86 */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SIMD
+#include <immintrin.h>
+#endif
+
+/* Parsing */
+
+static const char* find_newline_scalar(const char* data, size_t len) {
+	for(size_t i = 0; i < len; i++) {
+		if(data[i] == '\n') {
+			return data + i;
+		}
+	}
+	return NULL;
+}
+
+#ifdef HAVE_SIMD
+static bool useAvx2;	// Set once at startup
+
+__attribute__((constructor)) static void pick_scanner(void) {
+	__builtin_cpu_init();
+	useAvx2 = __builtin_cpu_supports("avx2");
+}
+
+/*
+ * 64 bytes a turn as four 16 byte compares, then 16 at a time
+ */
+__attribute__((target("sse2")))
+static const char* find_newline_sse2(const char* data, size_t len) {
+	const __m128i newlines = _mm_set1_epi8('\n');
+	size_t i = 0;
+
+	for(; i + 64 <= len; i += 64) {
+		const __m128i* chunk = (const __m128i *)(data + i);
+		__m128i a = _mm_cmpeq_epi8(_mm_loadu_si128(chunk), newlines);
+		__m128i b = _mm_cmpeq_epi8(_mm_loadu_si128(chunk + 1), newlines);
+		__m128i c = _mm_cmpeq_epi8(_mm_loadu_si128(chunk + 2), newlines);
+		__m128i d = _mm_cmpeq_epi8(_mm_loadu_si128(chunk + 3), newlines);
+		if(_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b),
+				_mm_or_si128(c, d))) != 0) {
+			uint64_t mask = (uint64_t)(unsigned int)_mm_movemask_epi8(a) |
+					(uint64_t)(unsigned int)_mm_movemask_epi8(b) << 16 |
+					(uint64_t)(unsigned int)_mm_movemask_epi8(c) << 32 |
+					(uint64_t)(unsigned int)_mm_movemask_epi8(d) << 48;
+			return data + i + __builtin_ctzll(mask);
+		}
+	}
+	for(; i + 16 <= len; i += 16) {
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i *)(data + i)), newlines));
+		if(mask != 0) {
+			return data + i + __builtin_ctz(mask);
+		}
+	}
+	return find_newline_scalar(data + i, len - i);
+}
+
+/*
+ * 64 bytes a turn as two 32 byte compares, then 16 at a time. Calling
+ * the SSE2 version for the rest would mix in slow non-VEX instructions.
+ */
+__attribute__((target("avx2")))
+static const char* find_newline_avx2(const char* data, size_t len) {
+	const __m256i newlines = _mm256_set1_epi8('\n');
+	size_t i = 0;
+
+	for(; i + 64 <= len; i += 64) {
+		const __m256i* chunk = (const __m256i *)(data + i);
+		__m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256(chunk), newlines);
+		__m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256(chunk + 1),
+				newlines);
+		if(!_mm256_testz_si256(_mm256_or_si256(a, b),
+				_mm256_or_si256(a, b))) {
+			uint64_t mask = (uint64_t)(unsigned int)_mm256_movemask_epi8(a) |
+					(uint64_t)(unsigned int)_mm256_movemask_epi8(b) << 32;
+			return data + i + __builtin_ctzll(mask);
+		}
+	}
+	for(; i + 16 <= len; i += 16) {
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i *)(data + i)),
+				_mm256_castsi256_si128(newlines)));
+		if(mask != 0) {
+			return data + i + __builtin_ctz(mask);
+		}
+	}
+	return find_newline_scalar(data + i, len - i);
+}
+#endif
+
+/*
+ * Returns the first newline in len bytes of data, NULL if there is none
+ */
+const char* proto_find_newline(const char* data, size_t len) {
+#ifdef HAVE_SIMD
+	return useAvx2 ? find_newline_avx2(data, len) :
+			find_newline_sse2(data, len);
+#else
+	return find_newline_scalar(data, len);
+#endif
+}
+
+/*
+ * Keywords by KEYWORD_HASH, which puts each in its own slot. Adding a
+ * keyword means checking that is still true.
+ */
+#define KEYWORD_SLOTS	16
+#define KEYWORD_HASH(first, len)	(((first) * 6 + (len)) & (KEYWORD_SLOTS - 1))
+
+static const struct {
+	const char* word;
+	size_t len;
+	Command command;
+} keywords[KEYWORD_SLOTS] = {
+	[KEYWORD_HASH('h', 9)] = {"handshake", 9, CMD_HANDSHAKE},
+	[KEYWORD_HASH('h', 5)] = {"hello", 5, CMD_HELLO},
+	[KEYWORD_HASH('r', 6)] = {"resume", 6, CMD_RESUME},
+	[KEYWORD_HASH('t', 5)] = {"token", 5, CMD_TOKEN},
+	[KEYWORD_HASH('s', 10)] = {"startrules", 10, CMD_STARTRULES},
+	[KEYWORD_HASH('e', 8)] = {"endrules", 8, CMD_ENDRULES},
+	[KEYWORD_HASH('m', 3)] = {"map", 3, CMD_MAP},
+	[KEYWORD_HASH('y', 8)] = {"yourmove", 8, CMD_YOURMOVE},
+	[KEYWORD_HASH('r', 7)] = {"request", 7, CMD_REQUEST},
+	[KEYWORD_HASH('r', 8)] = {"response", 8, CMD_RESPONSE},
+	[KEYWORD_HASH('b', 3)] = {"bye", 3, CMD_BYE},
+	[KEYWORD_HASH('t', 3)] = {"top", 3, CMD_TOP},
+	[KEYWORD_HASH('r', 4)] = {"rank", 4, CMD_RANK},
+	[KEYWORD_HASH('m', 9)] = {"multiplex", 9, CMD_MULTIPLEX},
+};
+
+/*
+ * Name the message in line. args is left pointing past the keyword and
+ * the space after it, or at the end of the line if there is nothing more.
+ * Returns CMD_NONE if line isn't a message we know
+ */
+Command proto_command(const char* line, const char** args) {
+	const char* word = line + 1;
+	size_t len = 0;
+
+	if(line[0] != '$') {
+		return CMD_NONE;
+	}
+	while(word[len] != ' ' && word[len] != '\n' && word[len] != '\0') {
+		len++;
+	}
+	if(len == 0) {
+		return CMD_NONE;
+	}
+
+	unsigned int slot = KEYWORD_HASH((unsigned char)word[0], len);
+	if(keywords[slot].len != len ||
+			memcmp(keywords[slot].word, word, len) != 0) {
+		return CMD_NONE;
+	}
+	*args = word + len + (word[len] == ' ');
+	return keywords[slot].command;
+}
+
+/*
+ * Read a decimal number at *p, moving p past it
+ * Returns false if there are no digits or it doesn't fit
+ */
+bool proto_uint(const char** p, unsigned int* value) {
+	const char* c = *p;
+	unsigned int n = 0;
+
+	if(*c < '0' || *c > '9') {
+		return false;
+	}
+	for(; *c >= '0' && *c <= '9'; c++) {
+		unsigned int digit = *c - '0';
+		if(n > (~0u - digit) / 10) {
+			return false;
+		}
+		n = n * 10 + digit;
+	}
+	*value = n;
+	*p = c;
+	return true;
+}
+
+/*
+ * Copy the word at *p into word, moving p past it and one space
+ * Returns false if there is no word or it needs more than size bytes
+ */
+bool proto_word(const char** p, char* word, size_t size) {
+	const char* c = *p;
+	size_t len = 0;
+
+	while(c[len] != ' ' && c[len] != '\n' && c[len] != '\0') {
+		len++;
+	}
+	if(len == 0 || len > size - 1) {
+		return false;
+	}
+	memcpy(word, c, len);
+	word[len] = '\0';
+	*p = c + len + (c[len] == ' ');
+	return true;
+}
+
+/*
+ * Read the "x y" of a $request
+ * Returns false unless args is exactly that, up to the newline
+ */
+bool proto_coords(const char* args, unsigned int* x, unsigned int* y) {
+	if(!proto_uint(&args, x) || *args++ != ' ' || !proto_uint(&args, y)) {
+		return false;
+	}
+	return *args == '\0' || (args[0] == '\n' && args[1] == '\0');
+}
+
+/*
+ * Read the tag of the frame in *line, moving line on to its message,
+ * which is empty if the frame closes the channel
+ * Returns false if line isn't a frame
+ */
+bool proto_untag(const char** line, unsigned int* tag) {
+	const char* p = *line;
+
+	if(*p++ != PROTO_TAG || !proto_uint(&p, tag)) {
+		return false;
+	}
+	if(*p == ' ') {
+		p++;
+	} else if(*p == '\n') {
+		p++;	// Nothing after the tag
+	} else if(*p != '\0') {
+		return false;
+	}
+	*line = p;
+	return true;
+}
+
+/* Reading */
+
+void proto_reader_init(LineReader* reader, int fd) {
+	reader->fd = fd;
+	reader->start = 0;
+	reader->len = 0;
+	reader->eof = false;
+}
+
+/*
+ * Read the next line into line, as fgets would
+ * Returns false if the input ended first
+ */
+bool proto_read_line(LineReader* reader, char* line, size_t size) {
+	while(1) {
+		const char* start = reader->buf + reader->start;
+		size_t avail = reader->len - reader->start;
+		const char* newline = proto_find_newline(start, avail);
+		size_t len;
+
+		if(newline != NULL) {
+			len = newline - start + 1;
+		} else if(avail >= size - 1 || avail == PROTO_BUF ||
+				(reader->eof && avail > 0)) {
+			len = avail;
+		} else if(reader->eof) {
+			return false;
+		} else {
+			/* Only part of a line so far, make room and wait for more */
+			if(reader->start > 0) {
+				memmove(reader->buf, start, avail);
+				reader->start = 0;
+				reader->len = avail;
+			}
+			ssize_t n = read(reader->fd, reader->buf + reader->len,
+					PROTO_BUF - reader->len);
+			if(n > 0) {
+				reader->len += n;
+			} else if(n == 0 || errno != EINTR) {
+				reader->eof = true;
+			}
+			continue;
+		}
+
+		if(len > size - 1) {
+			len = size - 1;
+		}
+		memcpy(line, start, len);
+		line[len] = '\0';
+		reader->start += len;
+		return true;
+	}
+}
+
+/*
+ * Read once from the descriptor, whatever has arrived, for a caller
+ * that polls it and only reads lines that are ready. Does nothing if the
+ * buffer is full.
+ * Returns false if the input has ended
+ */
+bool proto_fill(LineReader* reader) {
+	if(reader->eof) {
+		return false;
+	}
+	if(reader->start > 0) {
+		memmove(reader->buf, reader->buf + reader->start,
+				reader->len - reader->start);
+		reader->len -= reader->start;
+		reader->start = 0;
+	}
+	if(reader->len == PROTO_BUF) {
+		return true;
+	}
+	ssize_t n = read(reader->fd, reader->buf + reader->len,
+			PROTO_BUF - reader->len);
+	if(n > 0) {
+		reader->len += n;
+	} else if(n == 0 || (errno != EINTR && errno != EAGAIN)) {
+		reader->eof = true;
+	}
+	return !reader->eof;
+}
+
+/*
+ * Returns true if proto_read_line can return without reading, so a
+ * caller knows whether it is about to wait for the other end
+ */
+bool proto_line_ready(const LineReader* reader) {
+	return reader->eof || reader->len - reader->start == PROTO_BUF ||
+			proto_find_newline(reader->buf + reader->start,
+					reader->len - reader->start) != NULL;
+}
@@ -0,0 +1,70 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Splitting and naming the messages clients and server exchange.
+ *
+ * Every message is a line starting with a $ keyword. On x86 newlines
+ * are found with AVX2, or SSE2 on CPUs without it, picked at startup;
+ * elsewhere a byte at a time. Keywords are looked up in a
+ * table indexed by a hash of their first letter and length, which has
+ * no collisions among the keywords below, so naming a message costs one
+ * memcmp. Numbers are read without going through stdio.
+ *
+ * After $multiplex a connection carries many games. Every line is then a
+ * frame, "@tag message", the tag being a number the client gives each
+ * game. A frame with no message, "@tag", closes that game's channel.
+ */
+
+typedef enum {
+	CMD_NONE = 0,		// Not a message we know
+	CMD_HANDSHAKE,
+	CMD_HELLO,			// A handshake from a client with the rules already
+	CMD_RESUME,
+	CMD_TOKEN,
+	CMD_STARTRULES,
+	CMD_ENDRULES,
+	CMD_MAP,
+	CMD_YOURMOVE,
+	CMD_REQUEST,
+	CMD_RESPONSE,
+	CMD_BYE,
+	CMD_TOP,			// Ladder queries, answered instead of a handshake
+	CMD_RANK,
+	CMD_MULTIPLEX		// Games after this are sent as tagged frames
+} Command;
+
+#define PROTO_TAG	'@'		// Starts a frame
+
+#define PROTO_BUF	4096	// Input a LineReader holds
+
+/*
+ * Lines read straight from a descriptor, whatever size pieces they
+ * arrive in
+ */
+typedef struct LineReader {
+	int fd;
+	char buf[PROTO_BUF];
+	size_t start;			// Unread input is buf[start .. len)
+	size_t len;
+	bool eof;				// No more input will arrive
+} LineReader;
+
+/* Parsing */
+const char* proto_find_newline(const char* data, size_t len);
+Command proto_command(const char* line, const char** args);
+bool proto_uint(const char** p, unsigned int* value);
+bool proto_word(const char** p, char* word, size_t size);
+bool proto_coords(const char* args, unsigned int* x, unsigned int* y);
+bool proto_untag(const char** line, unsigned int* tag);
+
+/* Reading */
+void proto_reader_init(LineReader* reader, int fd);
+bool proto_read_line(LineReader* reader, char* line, size_t size);
+bool proto_fill(LineReader* reader);
+bool proto_line_ready(const LineReader* reader);
+
+#endif
@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "replay.h"
+#include "protocol.h"
+
+/* Encoding */
+
+/*
+ * 64 bit FNV-1a hash of len bytes of data
+ */
+uint64_t replay_hash(const void* data, size_t len) {
+	const unsigned char* bytes = (const unsigned char *)data;
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/*
+ * Write value as an unsigned LEB128 varint (at most 10 bytes)
+ * Returns the number of bytes written
+ */
+size_t put_varint(unsigned char* out, uint64_t value) {
+	size_t n = 0;
+	while(value >= 0x80) {
+		out[n++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	out[n++] = (unsigned char)value;
+	return n;
+}
+
+/*
+ * Read a varint from at most len bytes of in
+ * Returns the number of bytes read, 0 if in is truncated or malformed
+ */
+size_t get_varint(const unsigned char* in, size_t len, uint64_t* value) {
+	uint64_t result = 0;
+	for(size_t n = 0; n < len && n < 10; n++) {
+		result |= (uint64_t)(in[n] & 0x7f) << (7 * n);
+		if((in[n] & 0x80) == 0) {
+			*value = result;
+			return n + 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Little endian 64 bit integers for the rules hash and the index
+ */
+static void put_u64(unsigned char* out, uint64_t value) {
+	for(int i = 0; i < 8; i++) {
+		out[i] = (unsigned char)(value >> (8 * i));
+	}
+}
+
+static uint64_t get_u64(const unsigned char* in) {
+	uint64_t value = 0;
+	for(int i = 0; i < 8; i++) {
+		value |= (uint64_t)in[i] << (8 * i);
+	}
+	return value;
+}
+
+/* Writing */
+
+static size_t memory = 0;	// Bytes held by games being recorded
+static uint64_t startMs = 0;	// When the first game started recording
+
+static uint64_t now_ms(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void count_memory(size_t before, size_t after) {
+	__atomic_add_fetch(&memory, after - before, __ATOMIC_RELAXED);
+}
+
+/*
+ * Make room for another need bytes at the end of game
+ */
+static void reserve(ReplayGame* game, size_t need) {
+	if(game->len + need > game->size) {
+		size_t before = game->size;
+		while(game->len + need > game->size) {
+			game->size *= 2;
+		}
+		game->data = (unsigned char *)realloc(game->data, game->size);
+		count_memory(before, game->size);
+	}
+}
+
+static void put_string(ReplayGame* game, const char* str, size_t len) {
+	reserve(game, 10 + len);
+	game->len += put_varint(game->data + game->len, len);
+	memcpy(game->data + game->len, str, len);
+	game->len += len;
+}
+
+/*
+ * Note how long it has been since the last record, if it has been a while.
+ * Call with the game locked.
+ */
+static void put_wait(ReplayGame* game, int player) {
+	uint64_t now = now_ms();
+	if(now > game->lastMs) {
+		reserve(game, 11);
+		game->data[game->len++] = (REC_WAIT << 1) | player;
+		game->len += put_varint(game->data + game->len, now - game->lastMs);
+		game->lastMs = now;
+	}
+}
+
+/*
+ * Open (or create) a replay file and its index for appending
+ * Returns NULL if either can't be opened
+ */
+ReplayLog* replay_open(const char* path) {
+	ReplayLog* log = (ReplayLog *)malloc(sizeof(ReplayLog));
+	char* indexPath = (char *)malloc(strlen(path) +
+			strlen(REPLAY_INDEX_EXT) + 1);
+	sprintf(indexPath, "%s%s", path, REPLAY_INDEX_EXT);
+
+	log->data = fopen(path, "ab");
+	log->index = fopen(indexPath, "ab");
+	free(indexPath);
+	if(log->data == NULL || log->index == NULL) {
+		if(log->data != NULL) {
+			fclose(log->data);
+		}
+		if(log->index != NULL) {
+			fclose(log->index);
+		}
+		free(log);
+		return NULL;
+	}
+
+	/* New file gets the magic, old one carries on numbering its games */
+	fseek(log->data, 0, SEEK_END);
+	if(ftell(log->data) == 0) {
+		fwrite(REPLAY_MAGIC, 1, REPLAY_MAGIC_LEN, log->data);
+		fflush(log->data);
+	}
+	fseek(log->index, 0, SEEK_END);
+	log->next = (uint64_t)ftell(log->index) / 8;
+
+	pthread_mutex_init(&log->lock, NULL);
+	return log;
+}
+
+/*
+ * Start recording a new game, played with the rules hashed to rulesHash
+ */
+ReplayGame* replay_start(const char* gameId, uint64_t rulesHash) {
+	ReplayGame* game = (ReplayGame *)malloc(sizeof(ReplayGame));
+	game->size = 256;
+	game->len = 0;
+	game->data = (unsigned char *)malloc(game->size);
+	game->id = (char *)malloc(sizeof(char) * (strlen(gameId) + 1));
+	strcpy(game->id, gameId);
+	game->rulesHash = rulesHash;
+	/* The first game to start is where waits are counted from */
+	uint64_t expected = 0;
+	__atomic_compare_exchange_n(&startMs, &expected, now_ms(), 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	game->lastMs = __atomic_load_n(&startMs, __ATOMIC_RELAXED);
+	count_memory(0, sizeof(ReplayGame) + game->size + strlen(gameId) + 1);
+	pthread_mutex_init(&game->lock, NULL);
+	return game;
+}
+
+void replay_handshake(ReplayGame* game, int player, const char* user) {
+	pthread_mutex_lock(&game->lock);
+	put_wait(game, player);
+	reserve(game, 1);
+	game->data[game->len++] = (REC_HANDSHAKE << 1) | player;
+	put_string(game, user, strlen(user));
+	pthread_mutex_unlock(&game->lock);
+}
+
+/*
+ * Record a line the player sent to their opponent
+ */
+void replay_message(ReplayGame* game, int player, const char* line) {
+	unsigned int x, y;
+	const char* args = "";
+	Command command = proto_command(line, &args);
+
+	pthread_mutex_lock(&game->lock);
+	put_wait(game, player);
+	reserve(game, 21);
+	if(command == CMD_REQUEST && proto_coords(args, &x, &y)) {
+		game->data[game->len++] = (REC_REQUEST << 1) | player;
+		game->len += put_varint(game->data + game->len, x);
+		game->len += put_varint(game->data + game->len, y);
+	} else if(command == CMD_RESPONSE && strcmp(args, "miss\n") == 0) {
+		game->data[game->len++] = (REC_RESPONSE << 1) | player;
+		game->data[game->len++] = RESP_MISS;
+	} else if(command == CMD_RESPONSE && strcmp(args, "hit\n") == 0) {
+		game->data[game->len++] = (REC_RESPONSE << 1) | player;
+		game->data[game->len++] = RESP_HIT;
+	} else if(command == CMD_RESPONSE && strcmp(args, "over\n") == 0) {
+		game->data[game->len++] = (REC_RESPONSE << 1) | player;
+		game->data[game->len++] = RESP_OVER;
+	} else if(command == CMD_YOURMOVE && strcmp(args, "\n") == 0) {
+		game->data[game->len++] = (REC_YOURMOVE << 1) | player;
+	} else if(command == CMD_BYE && strcmp(args, "\n") == 0) {
+		game->data[game->len++] = (REC_BYE << 1) | player;
+	} else {
+		game->data[game->len++] = (REC_TEXT << 1) | player;
+		put_string(game, line, strlen(line));
+	}
+	pthread_mutex_unlock(&game->lock);
+}
+
+/*
+ * Record how the game ended, leaving it to be written
+ */
+void replay_finish(ReplayGame* game, int outcome, int player) {
+	pthread_mutex_lock(&game->lock);
+	reserve(game, 2);
+	game->data[game->len++] = (REC_END << 1) | player;
+	game->data[game->len++] = (unsigned char)outcome;
+	pthread_mutex_unlock(&game->lock);
+}
+
+/*
+ * Append a finished game's records to the log as the next chunk
+ */
+void replay_write(ReplayLog* log, const char* gameId, uint64_t rulesHash,
+		const unsigned char* data, size_t len) {
+	unsigned char head[40];
+	unsigned char offset[8];
+	size_t headLen;
+	size_t idLen = strlen(gameId);
+
+	pthread_mutex_lock(&log->lock);
+
+	/* Chunk header, the length covers everything after itself */
+	unsigned char body[30];
+	size_t bodyLen = put_varint(body, log->next);
+	put_u64(body + bodyLen, rulesHash);
+	bodyLen += 8;
+	bodyLen += put_varint(body + bodyLen, idLen);
+	headLen = put_varint(head, bodyLen + idLen + len);
+	memcpy(head + headLen, body, bodyLen);
+	headLen += bodyLen;
+
+	fseek(log->data, 0, SEEK_END);
+	put_u64(offset, (uint64_t)ftell(log->data));
+	fwrite(head, 1, headLen, log->data);
+	fwrite(gameId, 1, idLen, log->data);
+	fwrite(data, 1, len, log->data);
+	fflush(log->data);
+
+	/* Only index the chunk once it is all there */
+	fwrite(offset, 1, 8, log->index);
+	fflush(log->index);
+	log->next++;
+
+	pthread_mutex_unlock(&log->lock);
+}
+
+/*
+ * Record how the game ended, append it to the log and free it
+ */
+void replay_end(ReplayLog* log, ReplayGame* game, int outcome, int player) {
+	replay_finish(game, outcome, player);
+	replay_write(log, game->id, game->rulesHash, game->data, game->len);
+	replay_drop(game);
+}
+
+/*
+ * Stop recording a game without keeping it
+ */
+void replay_drop(ReplayGame* game) {
+	pthread_mutex_destroy(&game->lock);
+	count_memory(sizeof(ReplayGame) + game->size + strlen(game->id) + 1, 0);
+	free(game->data);
+	free(game->id);
+	free(game);
+}
+
+/*
+ * Returns the bytes held by games still being recorded
+ */
+size_t replay_memory(void) {
+	return __atomic_load_n(&memory, __ATOMIC_RELAXED);
+}
+
+/* Reading */
+
+/*
+ * Returns the number of games in a replay index
+ */
+uint64_t replay_count(FILE* index) {
+	fseek(index, 0, SEEK_END);
+	return (uint64_t)ftell(index) / 8;
+}
+
+/*
+ * Read game number serial into chunk. Lengths in the file are checked
+ * against what is left of it, so a truncated or corrupt file fails to
+ * load rather than asking for more memory than it could hold.
+ * Returns 1 on success, 0 otherwise
+ */
+int replay_load(FILE* data, FILE* index, uint64_t serial, ReplayChunk* chunk) {
+	unsigned char buffer[30];
+	uint64_t offset, len, idLen;
+	size_t n, used;
+	struct stat info;
+
+	if(fseek(index, (long)(serial * 8), SEEK_SET) != 0 ||
+			fread(buffer, 1, 8, index) != 8 ||
+			fstat(fileno(data), &info) != 0) {
+		return 0;
+	}
+	offset = get_u64(buffer);
+
+	if(offset >= (uint64_t)info.st_size ||
+			fseek(data, (long)offset, SEEK_SET) != 0 ||
+			(n = fread(buffer, 1, 10, data)) == 0 ||
+			(used = get_varint(buffer, n, &len)) == 0 ||
+			len > REPLAY_CHUNK_MAX ||
+			len > (uint64_t)info.st_size - offset - used ||
+			(chunk->data = (unsigned char *)malloc(len)) == NULL) {
+		return 0;
+	}
+	fseek(data, (long)(offset + used), SEEK_SET);
+	if(fread(chunk->data, 1, len, data) != len) {
+		free(chunk->data);
+		return 0;
+	}
+	chunk->len = len;
+
+	/* Serial, rules hash then game id */
+	if((used = get_varint(chunk->data, len, &chunk->serial)) == 0 ||
+			used + 8 > len) {
+		free(chunk->data);
+		return 0;
+	}
+	chunk->rulesHash = get_u64(chunk->data + used);
+	used += 8;
+	if((n = get_varint(chunk->data + used, len - used, &idLen)) == 0 ||
+			idLen > len - used - n) {
+		free(chunk->data);
+		return 0;
+	}
+	used += n;
+	chunk->id = (char *)malloc(idLen + 1);
+	memcpy(chunk->id, chunk->data + used, idLen);
+	chunk->id[idLen] = '\0';
+	chunk->pos = used + idLen;
+	return 1;
+}
+
+/*
+ * Decode the next record of chunk into rec
+ * Returns 1 if there was one, 0 at the end of the chunk or on bad data
+ */
+int replay_next(ReplayChunk* chunk, ReplayRecord* rec) {
+	const unsigned char* in = chunk->data + chunk->pos;
+	size_t left = chunk->len - chunk->pos;
+	size_t n, used = 1;
+	uint64_t value;
+
+	if(left == 0) {
+		return 0;
+	}
+	rec->type = in[0] >> 1;
+	rec->player = in[0] & 1;
+
+	switch(rec->type) {
+		case REC_HANDSHAKE:
+		case REC_TEXT:
+			if((n = get_varint(in + used, left - used, &value)) == 0 ||
+					used + n + value > left) {
+				return 0;
+			}
+			rec->text = (const char *)in + used + n;
+			rec->textLen = value;
+			used += n + value;
+			break;
+		case REC_REQUEST:
+			if((n = get_varint(in + used, left - used, &value)) == 0) {
+				return 0;
+			}
+			rec->x = (unsigned int)value;
+			used += n;
+			if((n = get_varint(in + used, left - used, &value)) == 0) {
+				return 0;
+			}
+			rec->y = (unsigned int)value;
+			used += n;
+			break;
+		case REC_RESPONSE:
+		case REC_END:
+			if(left < 2) {
+				return 0;
+			}
+			rec->value = in[used++];
+			break;
+		case REC_WAIT:
+			if((n = get_varint(in + used, left - used, &rec->wait)) == 0) {
+				return 0;
+			}
+			used += n;
+			break;
+		case REC_YOURMOVE:
+		case REC_BYE:
+			break;
+		default:
+			return 0;
+	}
+	chunk->pos += used;
+	return 1;
+}
+
+/*
+ * Turn a record the player sent back into the protocol line
+ * Returns 1 if rec was a protocol message, 0 otherwise
+ */
+int replay_format(const ReplayRecord* rec, char* line, size_t size) {
+	static const char* responses[] = {"miss", "hit", "over"};
+
+	switch(rec->type) {
+		case REC_REQUEST:
+			snprintf(line, size, "$request %u %u\n", rec->x, rec->y);
+			return 1;
+		case REC_RESPONSE:
+			snprintf(line, size, "$response %s\n",
+					responses[rec->value > RESP_OVER ? RESP_OVER : rec->value]);
+			return 1;
+		case REC_YOURMOVE:
+			snprintf(line, size, "$yourmove\n");
+			return 1;
+		case REC_BYE:
+			snprintf(line, size, "$bye\n");
+			return 1;
+		case REC_TEXT:
+			snprintf(line, size, "%.*s", (int)rec->textLen, rec->text);
+			return 1;
+	}
+	return 0;
+}
+
+void replay_free(ReplayChunk* chunk) {
+	free(chunk->data);
+	free(chunk->id);
+}
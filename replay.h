@@ -0,0 +1,128 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Replay files record every game the server relays.
+ *
+ * The data file starts with REPLAY_MAGIC and is then only ever appended to.
+ * Each finished game is written as one chunk:
+ *     varint  length of the rest of the chunk
+ *     varint  serial number of the game (0, 1, 2, ...)
+ *     8 bytes rules hash (little endian)
+ *     string  game id
+ *     records until the end of the chunk
+ * Strings are a varint length followed by the bytes (no terminator).
+ * Every record starts with a tag byte: (type << 1) | player.
+ *
+ * A REC_WAIT goes before any record that came a millisecond or more after
+ * the one before it, so a game can be played back at the pace it was
+ * played. The wait before a game's first record is from when the server
+ * started recording, so games also start back at the pace they started.
+ * Files from before waits were recorded play back flat out.
+ *
+ * The index file (data file name + ".idx") holds one 8 byte little endian
+ * offset per chunk, so game n is found at offset 8 * n of the index.
+ */
+
+#define REPLAY_MAGIC	"NRPL\1"
+#define REPLAY_MAGIC_LEN	5
+#define REPLAY_INDEX_EXT	".idx"
+#define REPLAY_CHUNK_MAX	(1 << 24)	// Longest chunk a load believes
+
+/* Record types */
+#define REC_HANDSHAKE	1	// string user id
+#define REC_REQUEST		2	// varint x, varint y
+#define REC_RESPONSE	3	// byte RESP_*
+#define REC_YOURMOVE	4	// nothing
+#define REC_BYE			5	// nothing
+#define REC_TEXT		6	// string, anything else the player sent
+#define REC_END			7	// byte END_*, player is the winner or quitter
+#define REC_WAIT		8	// varint milliseconds since the last record
+
+/* Responses */
+#define RESP_MISS	0
+#define RESP_HIT	1
+#define RESP_OVER	2
+
+/* Ways a game can end */
+#define END_WIN		0	// player won
+#define END_DISCON	1	// player disconnected
+
+/*
+ * Records of a single game, kept in memory until the game is over
+ */
+typedef struct ReplayGame {
+	unsigned char* data;	// Encoded records
+	size_t len;				// Bytes used in data
+	size_t size;			// Bytes allocated for data
+	char* id;				// Game id
+	uint64_t rulesHash;		// Hash of the rules the game is played with
+	uint64_t lastMs;		// When the last record was made
+	pthread_mutex_t lock;	// Both players append to the same game
+} ReplayGame;
+
+/*
+ * An open replay file that finished games are appended to
+ */
+typedef struct ReplayLog {
+	FILE* data;				// The chunks
+	FILE* index;			// Offset of each chunk
+	uint64_t next;			// Serial number of the next game written
+	pthread_mutex_t lock;	// Lock before appending
+} ReplayLog;
+
+/*
+ * A decoded record
+ */
+typedef struct ReplayRecord {
+	int type;				// REC_*
+	int player;				// 0 or 1
+	unsigned int x, y;		// For REC_REQUEST
+	int value;				// RESP_* or END_*
+	uint64_t wait;			// For REC_WAIT, in milliseconds
+	const char* text;		// For REC_HANDSHAKE and REC_TEXT, not terminated
+	size_t textLen;
+} ReplayRecord;
+
+/*
+ * A chunk read back from a replay file
+ */
+typedef struct ReplayChunk {
+	unsigned char* data;	// The whole chunk
+	size_t len;
+	size_t pos;				// Where the next record starts
+	uint64_t serial;
+	uint64_t rulesHash;
+	char* id;				// Game id
+} ReplayChunk;
+
+/* Encoding */
+uint64_t replay_hash(const void* data, size_t len);
+size_t put_varint(unsigned char* out, uint64_t value);
+size_t get_varint(const unsigned char* in, size_t len, uint64_t* value);
+
+/* Writing */
+ReplayLog* replay_open(const char* path);
+ReplayGame* replay_start(const char* gameId, uint64_t rulesHash);
+void replay_handshake(ReplayGame* game, int player, const char* user);
+void replay_message(ReplayGame* game, int player, const char* line);
+void replay_finish(ReplayGame* game, int outcome, int player);
+void replay_write(ReplayLog* log, const char* gameId, uint64_t rulesHash,
+		const unsigned char* data, size_t len);
+void replay_end(ReplayLog* log, ReplayGame* game, int outcome, int player);
+void replay_drop(ReplayGame* game);
+size_t replay_memory(void);
+
+/* Reading */
+uint64_t replay_count(FILE* index);
+int replay_load(FILE* data, FILE* index, uint64_t serial, ReplayChunk* chunk);
+int replay_next(ReplayChunk* chunk, ReplayRecord* rec);
+int replay_format(const ReplayRecord* rec, char* line, size_t size);
+void replay_free(ReplayChunk* chunk);
+
+#endif
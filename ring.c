@@ -0,0 +1,79 @@
+#include <string.h>
+
+#include "ring.h"
+
+/*
+ * The producer publishes a frame by storing head after filling the slot,
+ * the consumer frees one by storing tail after it is done with the slot.
+ * Each side loads the other's counter with acquire so it sees the slot
+ * contents that went with it.
+ */
+#define LOAD(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+void ring_init(Ring* ring) {
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+/*
+ * Queue a copy of frame, cut to RING_FRAME - 1 characters
+ * Returns false if the ring is full
+ */
+bool ring_push(Ring* ring, const char* frame) {
+	unsigned int head = ring->head;
+
+	if(head - LOAD(&ring->tail) >= RING_SIZE) {
+		return false;
+	}
+	char* slot = ring->frames[head % RING_SIZE];
+	strncpy(slot, frame, RING_FRAME);
+	slot[RING_FRAME - 1] = '\0';
+	STORE(&ring->head, head + 1);
+	return true;
+}
+
+/*
+ * Returns the number of frames ever pushed
+ */
+unsigned int ring_pushed(Ring* ring) {
+	return LOAD(&ring->head);
+}
+
+/*
+ * Returns the number of frames waiting to be sent
+ */
+unsigned int ring_pending(Ring* ring) {
+	return LOAD(&ring->head) - ring->tail;
+}
+
+/*
+ * Returns the oldest frame not yet sent, NULL if there is none
+ */
+const char* ring_peek(Ring* ring) {
+	if(ring_pending(ring) == 0) {
+		return NULL;
+	}
+	return ring->frames[ring->tail % RING_SIZE];
+}
+
+/*
+ * Mark the frame from ring_peek as sent
+ */
+void ring_pop(Ring* ring) {
+	STORE(&ring->tail, ring->tail + 1);
+}
+
+/*
+ * Go back to sending from frame number to
+ * Returns false if that frame has already been overwritten
+ */
+bool ring_rewind(Ring* ring, unsigned int to) {
+	unsigned int head = LOAD(&ring->head);
+
+	if(to > head || head - to >= RING_SIZE) {
+		return false;
+	}
+	STORE(&ring->tail, to);
+	return true;
+}
@@ -0,0 +1,39 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+
+/*
+ * A bounded queue of outgoing messages with one producer and one consumer.
+ *
+ * head and tail only ever count up and are the only state the two sides
+ * share, so neither needs a lock. Frame n lives in slot n % RING_SIZE.
+ * Frames that have been sent stay in their slot until it is reused, so
+ * after a reconnect the consumer can move tail back and send them again.
+ *
+ * Several threads may push to the same ring if they hold a common lock
+ * while they do, and ring_rewind must not race a push.
+ */
+
+#define RING_SIZE		16	// Frames held, a power of two
+#define RING_FRAME		80	// Longest frame, including the terminator
+
+typedef struct Ring {
+	char frames[RING_SIZE][RING_FRAME];
+	unsigned int head;		// Frames pushed, only the producer writes it
+	unsigned int tail;		// Frames sent, only the consumer writes it
+} Ring;
+
+void ring_init(Ring* ring);
+
+/* Producer */
+bool ring_push(Ring* ring, const char* frame);
+unsigned int ring_pushed(Ring* ring);
+
+/* Consumer */
+unsigned int ring_pending(Ring* ring);
+const char* ring_peek(Ring* ring);
+void ring_pop(Ring* ring);
+bool ring_rewind(Ring* ring, unsigned int to);
+
+#endif
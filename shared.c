@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "shared.h"
+#include "ladder.h"
+
+#define LOAD(p)			__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v)		__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ADD(p, v)		__atomic_add_fetch(p, v, __ATOMIC_RELAXED)
+#define CAS(p, old, v)	__atomic_compare_exchange_n(p, old, v, false, \
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+/*
+ * Map a segment the processes forked from this one will share
+ * Returns NULL if it can't be mapped
+ */
+Shared* shared_create(int maxGames) {
+	size_t size = sizeof(Shared) + sizeof(SharedGame) * maxGames +
+			sizeof(SharedUser) * SHARED_USERS;
+	char* base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(base == MAP_FAILED) {
+		return NULL;
+	}
+
+	/* Fresh pages are zero, so every slot starts free */
+	Shared* shared = (Shared *)base;
+	shared->maxGames = maxGames;
+	shared->games = (SharedGame *)(base + sizeof(Shared));
+	shared->users = (SharedUser *)(base + sizeof(Shared) +
+			sizeof(SharedGame) * maxGames);
+	return shared;
+}
+
+/* Users */
+
+static uint32_t hash_id(const char* id) {
+	uint32_t hash = 2166136261u;
+	for(; *id != '\0'; id++) {
+		hash ^= (unsigned char)*id;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Mark a user changed so whoever ranks users knows to look again
+ */
+static void touch(Shared* shared, SharedUser* user) {
+	STORE(&user->gen, ADD(&shared->userGen, 1));
+}
+
+/*
+ * Find a user, adding them with rating if they are new, worker being the
+ * one asking (-1 for the supervisor)
+ * Returns NULL if id is too long or the table is full
+ */
+SharedUser* shared_user(Shared* shared, const char* id, int rating,
+		int worker) {
+	if(strlen(id) >= SHARED_ID_LEN) {
+		return NULL;
+	}
+	uint32_t slot = hash_id(id);
+	for(int probe = 0; probe < SHARED_USERS; probe++, slot++) {
+		SharedUser* user = &shared->users[slot & (SHARED_USERS - 1)];
+		unsigned int state = LOAD(&user->state);
+
+		if(state == SLOT_FREE) {
+			if(CAS(&user->state, &state, SLOT_CLAIMED + worker + 1)) {
+				strcpy(user->id, id);
+				user->rating = rating;
+				STORE(&user->state, SLOT_USED);
+				touch(shared, user);
+				return user;
+			}
+			/* Lost the race, state now says who won */
+		}
+		while(state >= SLOT_CLAIMED) {
+			/* A strcpy, or until a dead claimer's slot is made free */
+			sched_yield();
+			state = LOAD(&user->state);
+		}
+		if(state == SLOT_FREE) {
+			/* Its claimer died, so try for it again */
+			slot--;
+			probe--;
+			continue;
+		}
+		if(strcmp(user->id, id) == 0) {
+			return user;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Returns the user called id, NULL if there isn't one
+ */
+SharedUser* shared_find_user(Shared* shared, const char* id) {
+	uint32_t slot = hash_id(id);
+	for(int probe = 0; probe < SHARED_USERS; probe++, slot++) {
+		SharedUser* user = &shared->users[slot & (SHARED_USERS - 1)];
+		unsigned int state;
+
+		while((state = LOAD(&user->state)) >= SLOT_CLAIMED) {
+			sched_yield();
+		}
+		if(state == SLOT_FREE) {
+			return NULL;
+		}
+		if(strcmp(user->id, id) == 0) {
+			return user;
+		}
+	}
+	return NULL;
+}
+
+void shared_count_disconnect(Shared* shared, SharedUser* user) {
+	ADD(&user->disconns, 1);
+	touch(shared, user);
+}
+
+/*
+ * Count a game and move the points between the players
+ * Returns the points that moved
+ */
+int shared_result(Shared* shared, SharedUser* winner, SharedUser* loser) {
+	int change = elo_change(LOAD(&winner->rating), LOAD(&loser->rating));
+
+	ADD(&winner->won, 1);
+	ADD(&loser->lost, 1);
+	ADD(&winner->rating, change);
+	ADD(&loser->rating, -change);
+	touch(shared, winner);
+	touch(shared, loser);
+	return change;
+}
+
+/* Games */
+
+/*
+ * Register a game run by worker
+ * Returns its slot, NULL if maxGames are already running
+ */
+SharedGame* shared_game_claim(Shared* shared, const char* id, int worker) {
+	int n = LOAD(&shared->nGames);
+	do {
+		if(n >= shared->maxGames) {
+			return NULL;
+		}
+	} while(!CAS(&shared->nGames, &n, n + 1));
+
+	/* Having counted it in, there has to be a free slot */
+	while(1) {
+		for(int i = 0; i < shared->maxGames; i++) {
+			SharedGame* game = &shared->games[i];
+			int owner = 0;
+			if(CAS(&game->owner, &owner, worker + 1)) {
+				snprintf(game->id, SHARED_ID_LEN, "%s", id);
+				game->players[0][0] = '\0';
+				game->players[1][0] = '\0';
+				game->rules[0] = '\0';
+				game->moves = 0;
+				STORE(&game->ready, true);
+				return game;
+			}
+		}
+	}
+}
+
+void shared_game_release(Shared* shared, SharedGame* game) {
+	STORE(&game->ready, false);
+	STORE(&game->owner, 0);
+	ADD(&shared->nGames, -1);
+}
+
+/*
+ * Give back the slots of every game a worker that has died was running,
+ * and free any user slot it had claimed but not yet filled in
+ */
+void shared_release_worker(Shared* shared, int worker) {
+	for(int i = 0; i < shared->maxGames; i++) {
+		if(LOAD(&shared->games[i].owner) == worker + 1) {
+			shared_game_release(shared, &shared->games[i]);
+		}
+	}
+	for(int i = 0; i < SHARED_USERS; i++) {
+		unsigned int state = SLOT_CLAIMED + worker + 1;
+		CAS(&shared->users[i].state, &state, SLOT_FREE);
+	}
+}
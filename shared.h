@@ -0,0 +1,71 @@
+#ifndef SHARED_H
+#define SHARED_H
+
+#include <stdbool.h>
+
+/*
+ * Games and user stats shared by the processes of a preforked server
+ * (nserver -p).
+ *
+ * The segment is mapped before the workers are forked, so it sits at the
+ * same address in all of them and plain pointers into it work anywhere.
+ * Nothing in it is locked: slots are claimed with compare and swap, and
+ * counters change with atomic adds, so a worker that dies part way
+ * through leaves nothing held. Its games are then given back by
+ * shared_release_worker.
+ *
+ * Users are found by hashing their id into an open addressed table and
+ * are never removed. Game slots carry the worker running the game, and a
+ * user slot being claimed carries the worker writing its id, so a slot a
+ * dead worker was half way through is made free again rather than left
+ * for everyone probing past it to wait on.
+ */
+
+#define SHARED_ID_LEN	80			// Longest id, including the terminator
+#define SHARED_USERS	(1 << 16)	// User slots, a power of two
+#define SHARED_WORKERS	16			// Most workers, one hex digit each
+
+/* States of a user slot */
+#define SLOT_FREE		0
+#define SLOT_USED		1
+#define SLOT_CLAIMED	2			// Id being written, plus the worker + 1
+
+typedef struct SharedUser {
+	unsigned int state;				// SLOT_*
+	char id[SHARED_ID_LEN];			// Never changes once SLOT_USED
+	int won, lost, disconns, rating;
+	unsigned int gen;				// Value of userGen after the last change
+} SharedUser;
+
+typedef struct SharedGame {
+	int owner;						// Worker running the game plus 1, 0 if free
+	bool ready;						// Filled in and can be read
+	char id[SHARED_ID_LEN];
+	char players[2][SHARED_ID_LEN];	// Empty for an empty seat
+	char rules[SHARED_ID_LEN];
+	int moves;						// Requests answered so far
+} SharedGame;
+
+typedef struct Shared {
+	int maxGames;
+	int nGames;						// Slots claimed, never more than maxGames
+	unsigned int userGen;			// Bumped by every change to a user
+	SharedGame* games;				// maxGames slots
+	SharedUser* users;				// SHARED_USERS slots
+} Shared;
+
+Shared* shared_create(int maxGames);
+
+/* Users */
+SharedUser* shared_user(Shared* shared, const char* id, int rating,
+		int worker);
+SharedUser* shared_find_user(Shared* shared, const char* id);
+void shared_count_disconnect(Shared* shared, SharedUser* user);
+int shared_result(Shared* shared, SharedUser* winner, SharedUser* loser);
+
+/* Games */
+SharedGame* shared_game_claim(Shared* shared, const char* id, int worker);
+void shared_game_release(Shared* shared, SharedGame* game);
+void shared_release_worker(Shared* shared, int worker);
+
+#endif
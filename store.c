@@ -0,0 +1,118 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "store.h"
+
+#define STORE_MAGIC		"NUS1"
+#define STORE_PROBES	64		// Slots looked at before giving up
+
+/* The header takes the first record's worth of space */
+typedef struct StoreHeader {
+	char magic[4];
+	unsigned int count;
+} StoreHeader;
+
+static uint32_t hash_id(const char* id) {
+	uint32_t hash = 2166136261u;
+	for(; *id != '\0'; id++) {
+		hash ^= (unsigned char)*id;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static off_t slot_offset(uint32_t slot) {
+	return (off_t)sizeof(StoredUser) * (1 + (slot & (STORE_SLOTS - 1)));
+}
+
+/*
+ * Read a slot. Those never written read as free.
+ */
+static bool read_slot(UserStore* store, uint32_t slot, StoredUser* user) {
+	ssize_t n = pread(store->fd, user, sizeof(StoredUser), slot_offset(slot));
+	if(n == 0) {
+		memset(user, 0, sizeof(StoredUser));	// Past the end of the file
+		return true;
+	}
+	return n == (ssize_t)sizeof(StoredUser);
+}
+
+/*
+ * Open the store at path, making it if there isn't one
+ * Returns NULL if it can't be opened or isn't a store
+ */
+UserStore* store_open(const char* path) {
+	StoreHeader header;
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(fd < 0) {
+		return NULL;
+	}
+
+	ssize_t n = pread(fd, &header, sizeof(header), 0);
+	if(n == 0) {
+		memcpy(header.magic, STORE_MAGIC, 4);
+		header.count = 0;
+		n = pwrite(fd, &header, sizeof(header), 0);
+	}
+	if(n != (ssize_t)sizeof(header) ||
+			memcmp(header.magic, STORE_MAGIC, 4) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	UserStore* store = (UserStore *)malloc(sizeof(UserStore));
+	store->fd = fd;
+	store->count = header.count;
+	return store;
+}
+
+/*
+ * Look up the user called id
+ * Returns false if they aren't stored
+ */
+bool store_get(UserStore* store, const char* id, StoredUser* user) {
+	uint32_t slot = hash_id(id);
+	for(int probe = 0; probe < STORE_PROBES; probe++, slot++) {
+		if(!read_slot(store, slot, user) || user->id[0] == '\0') {
+			return false;
+		}
+		if(strncmp(user->id, id, STORE_ID_LEN) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Keep a user's stats, replacing any kept before
+ * Returns false if there is no room for them or the write failed
+ */
+bool store_put(UserStore* store, const StoredUser* user) {
+	StoredUser found;
+	uint32_t slot = hash_id(user->id);
+
+	for(int probe = 0; probe < STORE_PROBES; probe++, slot++) {
+		if(!read_slot(store, slot, &found)) {
+			return false;
+		}
+		bool fresh = found.id[0] == '\0';
+		if(!fresh && strncmp(found.id, user->id, STORE_ID_LEN) != 0) {
+			continue;
+		}
+		if(pwrite(store->fd, user, sizeof(StoredUser), slot_offset(slot)) !=
+				(ssize_t)sizeof(StoredUser)) {
+			return false;
+		}
+		if(fresh) {
+			StoreHeader header = {STORE_MAGIC, ++store->count};
+			if(pwrite(store->fd, &header, sizeof(header), 0) < 0) {
+				/* The count is only for stats */
+			}
+		}
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,35 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdbool.h>
+
+/*
+ * Stats of users not held in memory (nserver -U).
+ *
+ * The file is a header then a fixed table of STORE_SLOTS records, found
+ * by a hash of the id and probed in order, so a user is found in a read
+ * or two however many are stored. The table is never written out in
+ * full, so the file stays sparse and only slots in use take disk space.
+ * Records are only ever added or overwritten, never removed.
+ *
+ * Reads may come from any thread, writes from one at a time.
+ */
+
+#define STORE_SLOTS		(1 << 20)	// Records, a power of two
+#define STORE_ID_LEN	80			// Longest id, including the terminator
+
+typedef struct StoredUser {
+	char id[STORE_ID_LEN];			// Empty for a free slot
+	int won, lost, disconns, rating;
+} StoredUser;
+
+typedef struct UserStore {
+	int fd;
+	unsigned int count;				// Slots in use
+} UserStore;
+
+UserStore* store_open(const char* path);
+bool store_get(UserStore* store, const char* id, StoredUser* user);
+bool store_put(UserStore* store, const StoredUser* user);
+
+#endif
@@ -0,0 +1,585 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "strategy.h"
+
+#define HIT_WEIGHT	8		// Extra a placement scores for each hit it covers
+#define PLACE_TRIES	32		// Random placements tried for a ship in a sample
+#define CLOCK_EVERY	16		// Samples between looks at the clock
+
+/* Grids */
+
+static bool has(const uint64_t* grid, unsigned int cell) {
+	return grid[cell / 64] >> (cell % 64) & 1;
+}
+
+static void put(uint64_t* grid, unsigned int cell) {
+	grid[cell / 64] |= (uint64_t)1 << (cell % 64);
+}
+
+static bool overlaps(const uint64_t* a, const uint64_t* b,
+		unsigned int words) {
+	uint64_t common = 0;
+	for(unsigned int w = 0; w < words; w++) {
+		common |= a[w] & b[w];
+	}
+	return common != 0;
+}
+
+static unsigned int count_common(const uint64_t* a, const uint64_t* b,
+		unsigned int words) {
+	unsigned int n = 0;
+	for(unsigned int w = 0; w < words; w++) {
+		n += __builtin_popcountll(a[w] & b[w]);
+	}
+	return n;
+}
+
+static bool unknown(const Strategy* s, unsigned int cell) {
+	return !has(s->hits, cell) && !has(s->misses, cell);
+}
+
+/* Scores */
+
+/*
+ * Add weight to the score of every cell in the first n words of mask.
+ * Each set bit of weight is carried up the planes from its own, a word of
+ * cells at a time. Planes are words apart.
+ */
+static void tally_add(uint64_t* planes, unsigned int words,
+		const uint64_t* mask, unsigned int n, unsigned int weight) {
+	for(unsigned int bit = 0; bit < STRATEGY_PLANES && weight >> bit != 0;
+			bit++) {
+		if((weight >> bit & 1) == 0) {
+			continue;
+		}
+		for(unsigned int w = 0; w < n; w++) {
+			uint64_t carry = mask[w];
+			for(unsigned int k = bit; carry != 0 && k < STRATEGY_PLANES; k++) {
+				uint64_t* plane = &planes[k * words + w];
+				uint64_t next = *plane & carry;
+				*plane ^= carry;
+				carry = next;
+			}
+		}
+	}
+}
+
+/*
+ * Returns the unknown cell with the highest score summed over n tallies
+ * laid end to end, s->cells if every score is 0
+ */
+static unsigned int best_cell(const Strategy* s, const uint64_t* planes,
+		unsigned int n) {
+	unsigned int words = s->words, best = s->cells;
+	unsigned long bestScore = 0;
+
+	for(unsigned int cell = 0; cell < s->cells; cell++) {
+		if(!unknown(s, cell)) {
+			continue;
+		}
+		unsigned long score = 0;
+		for(unsigned int t = 0; t < n; t++) {
+			const uint64_t* tally = planes + t * STRATEGY_PLANES * words;
+			for(unsigned int k = 0; k < STRATEGY_PLANES; k++) {
+				score += (unsigned long)has(tally + k * words, cell) << k;
+			}
+		}
+		if(score > bestScore) {
+			best = cell;
+			bestScore = score;
+		}
+	}
+	return best;
+}
+
+/* Placements */
+
+/*
+ * Work out every placement of each length of ship on the board
+ */
+static void find_placements(Strategy* s) {
+	unsigned int w = s->width, h = s->height, words = s->words;
+
+	s->kindOf = (unsigned int *)malloc(sizeof(unsigned int) * s->nShips);
+	s->kindLengths = (unsigned int *)malloc(sizeof(unsigned int) * s->nShips);
+	s->kindShips = (unsigned int *)calloc(s->nShips, sizeof(unsigned int));
+	for(unsigned int i = 0; i < s->nShips; i++) {
+		unsigned int k = 0;
+		while(k < s->nKinds && s->kindLengths[k] != s->lengths[i]) {
+			k++;
+		}
+		if(k == s->nKinds) {
+			s->kindLengths[s->nKinds++] = s->lengths[i];
+		}
+		s->kindOf[i] = k;
+		s->kindShips[k]++;
+	}
+
+	s->masks = (uint64_t **)malloc(sizeof(uint64_t *) * s->nKinds);
+	s->spans = (unsigned int **)malloc(sizeof(unsigned int *) * s->nKinds);
+	s->nMasks = (unsigned int *)calloc(s->nKinds, sizeof(unsigned int));
+	s->fits = (unsigned int **)malloc(sizeof(unsigned int *) * s->nKinds);
+	s->nFits = (unsigned int *)calloc(s->nKinds, sizeof(unsigned int));
+	for(unsigned int k = 0; k < s->nKinds; k++) {
+		unsigned int len = s->kindLengths[k], n = 0;
+		if(len > 0 && len <= w) {
+			n += h * (w - len + 1);
+		}
+		if(len > 1 && len <= h) {
+			n += w * (h - len + 1);
+		}
+		s->masks[k] = (uint64_t *)calloc((size_t)n * words + 1,
+				sizeof(uint64_t));
+		s->spans[k] = (unsigned int *)malloc(sizeof(unsigned int) * 2 * n + 1);
+		s->fits[k] = (unsigned int *)malloc(sizeof(unsigned int) * n + 1);
+
+		for(unsigned int y = 0; len > 0 && y < h; y++) {
+			for(unsigned int x = 0; x < w; x++) {
+				unsigned int* span;
+				if(x + len <= w) {
+					uint64_t* mask = s->masks[k] + s->nMasks[k] * words;
+					span = s->spans[k] + 2 * s->nMasks[k]++;
+					for(unsigned int i = 0; i < len; i++) {
+						put(mask, y * w + x + i);
+					}
+					span[0] = (y * w + x) / 64;
+					span[1] = (y * w + x + len - 1) / 64 - span[0] + 1;
+				}
+				if(len > 1 && y + len <= h) {
+					uint64_t* mask = s->masks[k] + s->nMasks[k] * words;
+					span = s->spans[k] + 2 * s->nMasks[k]++;
+					for(unsigned int i = 0; i < len; i++) {
+						put(mask, (y + i) * w + x);
+					}
+					span[0] = (y * w + x) / 64;
+					span[1] = ((y + len - 1) * w + x) / 64 - span[0] + 1;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Keep the placements that miss every miss
+ */
+static void find_fits(Strategy* s) {
+	for(unsigned int k = 0; k < s->nKinds; k++) {
+		s->nFits[k] = 0;
+		for(unsigned int p = 0; p < s->nMasks[k]; p++) {
+			unsigned int from = s->spans[k][2 * p];
+			if(!overlaps(s->masks[k] + p * s->words + from, s->misses + from,
+					s->spans[k][2 * p + 1])) {
+				s->fits[k][s->nFits[k]++] = p;
+			}
+		}
+	}
+}
+
+/* Sampling */
+
+static uint64_t next_random(uint64_t* state) {
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 2685821657736338717ull;
+}
+
+static unsigned int random_below(uint64_t* state, unsigned int n) {
+	return (unsigned int)(((next_random(state) >> 32) * n) >> 32);
+}
+
+/*
+ * One thread's share of the fleets sampled for a guess
+ */
+typedef struct Sampler {
+	const Strategy* s;
+	uint64_t random;
+	uint64_t* planes;				// Times each cell was covered
+	uint64_t* fleet;				// Cells of the fleet being placed
+	unsigned int* order;			// Ships not yet placed
+	unsigned long accepted;			// Fleets that fit
+	unsigned long limit;			// Most fleets to sample
+	struct timespec deadline;
+} Sampler;
+
+/*
+ * Put placement p of kind k in the fleet
+ */
+static void add_placement(Sampler* m, unsigned int k, unsigned int p) {
+	const Strategy* s = m->s;
+	const uint64_t* mask = s->masks[k] + p * s->words;
+
+	for(unsigned int w = s->spans[k][2 * p];
+			w < s->spans[k][2 * p] + s->spans[k][2 * p + 1]; w++) {
+		m->fleet[w] |= mask[w];
+	}
+}
+
+/*
+ * Place one of the left ships not yet placed through cell, taking it out
+ * of order
+ * Returns false if none fits there
+ */
+static bool cover(Sampler* m, unsigned int cell, unsigned int* left) {
+	const Strategy* s = m->s;
+	unsigned int start = random_below(&m->random, *left);
+
+	for(unsigned int t = 0; t < *left; t++) {
+		unsigned int j = (start + t) % *left;
+		unsigned int k = s->kindOf[m->order[j]];
+		unsigned int chosen = 0, seen = 0;
+
+		for(unsigned int f = 0; f < s->nFits[k]; f++) {
+			unsigned int p = s->fits[k][f];
+			const uint64_t* mask = s->masks[k] + p * s->words;
+			if(has(mask, cell) && !overlaps(mask + s->spans[k][2 * p],
+					m->fleet + s->spans[k][2 * p], s->spans[k][2 * p + 1]) &&
+					random_below(&m->random, ++seen) == 0) {
+				chosen = p;
+			}
+		}
+		if(seen > 0) {
+			add_placement(m, k, chosen);
+			m->order[j] = m->order[--*left];
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Place a ship of kind k anywhere it fits
+ * Returns false if no try found room for it
+ */
+static bool place_anywhere(Sampler* m, unsigned int k) {
+	const Strategy* s = m->s;
+
+	for(unsigned int t = 0; t < PLACE_TRIES && s->nFits[k] > 0; t++) {
+		unsigned int p = s->fits[k][random_below(&m->random, s->nFits[k])];
+		unsigned int from = s->spans[k][2 * p];
+		if(!overlaps(s->masks[k] + p * s->words + from, m->fleet + from,
+				s->spans[k][2 * p + 1])) {
+			add_placement(m, k, p);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Lay out a whole fleet that fits what is known: ships through the hits
+ * first, then the rest wherever they go
+ * Returns false if this try didn't make one
+ */
+static bool sample_fleet(Sampler* m) {
+	const Strategy* s = m->s;
+	unsigned int left = 0;
+
+	memset(m->fleet, 0, sizeof(uint64_t) * s->words);
+	for(unsigned int i = 0; i < s->nShips; i++) {
+		if(s->lengths[i] > 0) {
+			m->order[left++] = i;
+		}
+	}
+
+	for(unsigned int w = 0; w < s->words; w++) {
+		uint64_t open;
+		while((open = s->hits[w] & ~m->fleet[w]) != 0) {
+			if(left == 0 ||
+					!cover(m, w * 64 + __builtin_ctzll(open), &left)) {
+				return false;
+			}
+		}
+	}
+	while(left > 0) {
+		if(!place_anywhere(m, s->kindOf[m->order[--left]])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool past(const struct timespec* deadline) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec &&
+			now.tv_nsec >= deadline->tv_nsec);
+}
+
+static void* sample_thread(void* arg) {
+	Sampler* m = (Sampler *)arg;
+	unsigned long tries = 0;
+
+	while(m->accepted < m->limit) {
+		if(tries++ % CLOCK_EVERY == 0 && past(&m->deadline)) {
+			break;
+		}
+		if(sample_fleet(m)) {
+			tally_add(m->planes, m->s->words, m->fleet, m->s->words, 1);
+			m->accepted++;
+		}
+	}
+	return NULL;
+}
+
+/* Picking */
+
+static unsigned int pick_sweep(Strategy* s) {
+	return s->next++ % s->cells;
+}
+
+/*
+ * Returns the first unknown cell, or the next in reading order if there
+ * is none
+ */
+static unsigned int first_unknown(Strategy* s) {
+	for(unsigned int cell = 0; cell < s->cells; cell++) {
+		if(unknown(s, cell)) {
+			return cell;
+		}
+	}
+	return pick_sweep(s);
+}
+
+static unsigned int pick_parity(Strategy* s) {
+	static const int dx[4] = {1, -1, 0, 0};
+	static const int dy[4] = {0, 0, 1, -1};
+	unsigned int w = s->width, h = s->height;
+	unsigned int best = s->cells, bestScore = 0, spacing = 0;
+
+	/* Finish off what was hit */
+	for(unsigned int cell = 0; cell < s->cells; cell++) {
+		if(!has(s->hits, cell)) {
+			continue;
+		}
+		int x = cell % w, y = cell / w;
+		for(unsigned int d = 0; d < 4; d++) {
+			int nx = x + dx[d], ny = y + dy[d];
+			int bx = x - dx[d], by = y - dy[d];
+			if(nx < 0 || ny < 0 || nx >= (int)w || ny >= (int)h ||
+					!unknown(s, ny * w + nx)) {
+				continue;
+			}
+			unsigned int score = 1 + (bx >= 0 && by >= 0 && bx < (int)w &&
+					by < (int)h && has(s->hits, by * w + bx));
+			if(score > bestScore) {
+				best = ny * w + nx;
+				bestScore = score;
+			}
+		}
+	}
+	if(best < s->cells) {
+		return best;
+	}
+
+	/* Hunt on a checkerboard no ship longer than one can slip through */
+	for(unsigned int i = 0; i < s->nShips; i++) {
+		if(s->lengths[i] > 1 && (spacing == 0 || s->lengths[i] < spacing)) {
+			spacing = s->lengths[i];
+		}
+	}
+	if(spacing == 0) {
+		spacing = 1;
+	}
+	for(unsigned int cell = 0; cell < s->cells; cell++) {
+		if(unknown(s, cell) && (cell % w + cell / w) % spacing == 0) {
+			return cell;
+		}
+	}
+	return first_unknown(s);
+}
+
+static unsigned int pick_density(Strategy* s) {
+	uint64_t* planes = (uint64_t *)calloc(STRATEGY_PLANES * s->words,
+			sizeof(uint64_t));
+
+	find_fits(s);
+	for(unsigned int k = 0; k < s->nKinds; k++) {
+		for(unsigned int f = 0; f < s->nFits[k]; f++) {
+			unsigned int p = s->fits[k][f];
+			unsigned int from = s->spans[k][2 * p], n = s->spans[k][2 * p + 1];
+			const uint64_t* mask = s->masks[k] + p * s->words + from;
+			tally_add(planes + from, s->words, mask, n, s->kindShips[k] *
+					(1 + HIT_WEIGHT * count_common(mask, s->hits + from, n)));
+		}
+	}
+	unsigned int cell = best_cell(s, planes, 1);
+	free(planes);
+	return cell < s->cells ? cell : first_unknown(s);
+}
+
+static unsigned int pick_montecarlo(Strategy* s) {
+	unsigned int n = s->threads, words = s->words, i;
+	Sampler* samplers = (Sampler *)calloc(n, sizeof(Sampler));
+	pthread_t* threads = (pthread_t *)malloc(sizeof(pthread_t) * n);
+	bool* started = (bool *)calloc(n, sizeof(bool));
+	uint64_t* planes = (uint64_t *)calloc((size_t)n * STRATEGY_PLANES * words,
+			sizeof(uint64_t));
+	unsigned long accepted = 0;
+	struct timespec deadline;
+
+	find_fits(s);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += s->budget / 1000;
+	deadline.tv_nsec += (long)(s->budget % 1000) * 1000000;
+	if(deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	for(i = 0; i < n; i++) {
+		Sampler* m = &samplers[i];
+		m->s = s;
+		m->random = (s->seed ^ (i + 1) * 0x9e3779b97f4a7c15ull) | 1;
+		m->planes = planes + (size_t)i * STRATEGY_PLANES * words;
+		m->fleet = (uint64_t *)malloc(sizeof(uint64_t) * words);
+		m->order = (unsigned int *)malloc(sizeof(unsigned int) * s->nShips +
+				1);
+		m->limit = STRATEGY_SAMPLES / n;
+		m->deadline = deadline;
+	}
+	next_random(&s->seed);
+
+	/* This thread samples too, alongside the others */
+	for(i = 1; i < n; i++) {
+		started[i] = pthread_create(&threads[i], NULL, sample_thread,
+				&samplers[i]) == 0;
+	}
+	sample_thread(&samplers[0]);
+	for(i = 0; i < n; i++) {
+		if(started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+		accepted += samplers[i].accepted;
+		free(samplers[i].fleet);
+		free(samplers[i].order);
+	}
+
+	unsigned int cell = accepted > 0 ? best_cell(s, planes, n) : s->cells;
+	free(planes);
+	free(started);
+	free(threads);
+	free(samplers);
+
+	/* No fleet fitted in time, so go by single ships */
+	return cell < s->cells ? cell : pick_density(s);
+}
+
+/*
+ * Strategies by name. placed is set for those that work from the
+ * placements, which play as parity on boards too big to keep them for.
+ */
+static const struct {
+	const char* name;
+	unsigned int (*pick)(Strategy* s);
+	bool placed;
+} strategies[] = {
+	{"sweep", pick_sweep, false},
+	{"parity", pick_parity, false},
+	{"density", pick_density, true},
+	{"montecarlo", pick_montecarlo, true},
+};
+
+#define N_STRATEGIES (sizeof(strategies) / sizeof(strategies[0]))
+
+/*
+ * Returns the kind of strategy called name, -1 if there is none
+ */
+int strategy_find(const char* name) {
+	for(unsigned int i = 0; i < N_STRATEGIES; i++) {
+		if(strcmp(strategies[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Start a strategy of kind for a game by the given rules, with budget
+ * milliseconds and up to threads threads for each guess
+ */
+void strategy_init(Strategy* s, int kind, unsigned int width,
+		unsigned int height, unsigned int nShips, const unsigned int* lengths,
+		unsigned int budget, unsigned int threads) {
+	struct timespec now;
+
+	memset(s, 0, sizeof(Strategy));
+	s->kind = kind;
+	s->width = width;
+	s->height = height;
+	s->cells = width * height;
+	s->words = (s->cells + 63) / 64;
+	s->nShips = nShips;
+	s->lengths = (unsigned int *)malloc(sizeof(unsigned int) * nShips + 1);
+	memcpy(s->lengths, lengths, sizeof(unsigned int) * nShips);
+	s->hits = (uint64_t *)calloc(s->words, sizeof(uint64_t));
+	s->misses = (uint64_t *)calloc(s->words, sizeof(uint64_t));
+	s->last = s->cells;
+	s->budget = budget > 0 ? budget : 1;
+	s->threads = threads < 1 ? 1 :
+			threads > STRATEGY_THREADS ? STRATEGY_THREADS : threads;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	s->seed = ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec) | 1;
+
+	if(strategies[kind].placed && s->cells <= STRATEGY_CELLS) {
+		find_placements(s);
+	}
+}
+
+void strategy_free(Strategy* s) {
+	free(s->lengths);
+	free(s->hits);
+	free(s->misses);
+	for(unsigned int k = 0; k < s->nKinds; k++) {
+		free(s->masks[k]);
+		free(s->spans[k]);
+		free(s->fits[k]);
+	}
+	free(s->kindOf);
+	free(s->kindLengths);
+	free(s->kindShips);
+	free(s->masks);
+	free(s->spans);
+	free(s->nMasks);
+	free(s->fits);
+	free(s->nFits);
+}
+
+/*
+ * Pick the next cell to guess
+ */
+void strategy_guess(Strategy* s, unsigned int* x, unsigned int* y) {
+	unsigned int cell;
+
+	if(strategies[s->kind].placed && s->nKinds == 0) {
+		cell = pick_parity(s);
+	} else {
+		cell = strategies[s->kind].pick(s);
+	}
+	s->last = cell;
+	*x = cell % s->width;
+	*y = cell / s->width;
+}
+
+/*
+ * Learn whether the last guess was a hit
+ */
+void strategy_result(Strategy* s, bool hit) {
+	if(s->last < s->cells) {
+		put(hit ? s->hits : s->misses, s->last);
+	}
+}
+
+/*
+ * Learn what a guess made before this strategy started found at x, y
+ */
+void strategy_learn(Strategy* s, unsigned int x, unsigned int y, bool hit) {
+	if(x < s->width && y < s->height) {
+		put(hit ? s->hits : s->misses, y * s->width + x);
+	}
+}
@@ -0,0 +1,79 @@
+#ifndef STRATEGY_H
+#define STRATEGY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Guesses for a client with nobody at the keyboard (nclient --strategy).
+ *
+ * A strategy knows only what its own guesses found: each cell of the
+ * opponent's grid is unknown, a miss or a hit, and the fleet is the ships
+ * the rules list. The protocol doesn't say which ship was hit or when one
+ * sinks, so a hit only says some ship covers the cell.
+ *
+ *   sweep       every cell in reading order
+ *   parity      a checkerboard spaced by the shortest ship longer than
+ *               one, but first the cells next to hits, in line with
+ *               another hit before the rest
+ *   density     the cell covered by most placements of single ships that
+ *               miss every miss, placements through hits counting more
+ *   montecarlo  the cell covered most often by whole fleets that fit
+ *               every miss and every hit, sampled by several threads for
+ *               as long as the budget allows
+ *
+ * Grids are bitmasks, a bit a cell in reading order, so a placement is
+ * checked against the misses, the hits or the rest of a fleet 64 cells
+ * at a time. Scores are kept bit sliced, bit k of every cell's count in
+ * a mask of its own, so adding a placement to them is a few word
+ * operations however long the ship is. Placements are worked out once,
+ * for boards of up to STRATEGY_CELLS cells; on bigger boards density and
+ * montecarlo play as parity does.
+ *
+ * A strategy is added by writing its pick function and putting it in the
+ * table in strategy.c.
+ */
+
+#define STRATEGY_CELLS		4096	// Biggest board placements are kept for
+#define STRATEGY_PLANES		24		// Bits in a cell's score
+#define STRATEGY_SAMPLES	100000	// Most fleets sampled for a guess
+#define STRATEGY_THREADS	16		// Most threads sampling them
+#define STRATEGY_BUDGET		50		// Milliseconds a guess takes if not given
+
+typedef struct Strategy {
+	int kind;						// Index in the table of strategies
+	unsigned int width, height;
+	unsigned int cells;
+	unsigned int words;				// uint64_t in a grid
+	unsigned int nShips;
+	unsigned int* lengths;			// Of each ship
+	uint64_t* hits;					// Cells guessed and hit
+	uint64_t* misses;				// Cells guessed and missed
+	unsigned int last;				// Cell guessed last, awaiting its result
+	unsigned int next;				// Next cell in reading order
+	unsigned int budget;			// Milliseconds a guess may take
+	unsigned int threads;			// Threads a guess may use
+	uint64_t seed;					// For sampling, moved on every guess
+
+	/* Placements, by ship length, if kept */
+	unsigned int nKinds;			// Lengths, 0 if none are kept
+	unsigned int* kindLengths;
+	unsigned int* kindShips;		// Ships of that length
+	unsigned int* kindOf;			// By ship
+	uint64_t** masks;				// Every placement on the board
+	unsigned int** spans;			// First word of each and words it takes
+	unsigned int* nMasks;
+	unsigned int** fits;			// Placements clear of the misses
+	unsigned int* nFits;
+} Strategy;
+
+int strategy_find(const char* name);
+void strategy_init(Strategy* s, int kind, unsigned int width,
+		unsigned int height, unsigned int nShips, const unsigned int* lengths,
+		unsigned int budget, unsigned int threads);
+void strategy_free(Strategy* s);
+void strategy_guess(Strategy* s, unsigned int* x, unsigned int* y);
+void strategy_result(Strategy* s, bool hit);
+void strategy_learn(Strategy* s, unsigned int x, unsigned int y, bool hit);
+
+#endif
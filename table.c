@@ -0,0 +1,167 @@
+#include <stdlib.h>
+
+#include "table.h"
+
+/*
+ * Handles are handed out in order, so spread them over the index
+ */
+static uint32_t home_of(const GameTable* table, uint32_t id) {
+	return (id * 2654435761u) & table->mask;
+}
+
+void table_init(GameTable* table, unsigned int max) {
+	unsigned int slots = 2;
+	while(slots < 2 * max) {
+		slots *= 2;
+	}
+	table->max = max;
+	table->count = 0;
+	table->high = 0;
+	table->mask = slots - 1;
+	table->index = (uint32_t *)calloc(slots, sizeof(uint32_t));
+	table->spare = (uint32_t *)malloc(sizeof(uint32_t) * max);
+	table->nSpare = 0;
+	table->ids = (uint32_t *)malloc(sizeof(uint32_t) * max);
+	table->phases = (uint8_t *)malloc(sizeof(uint8_t) * max);
+	table->since = (uint32_t *)malloc(sizeof(uint32_t) * max);
+	table->rules = (uint8_t *)malloc(sizeof(uint8_t) * max);
+	table->flags = (uint8_t *)malloc(sizeof(uint8_t) * max);
+	table->turns = (uint8_t *)malloc(sizeof(uint8_t) * max);
+	table->active = (uint8_t *)malloc(sizeof(uint8_t) * max);
+	table->players = (uint32_t (*)[2])malloc(sizeof(uint32_t[2]) * max);
+	table->conns = (int32_t (*)[2])malloc(sizeof(int32_t[2]) * max);
+	table->tokens = (uint64_t (*)[2])malloc(sizeof(uint64_t[2]) * max);
+	table->games = (void **)malloc(sizeof(void *) * max);
+	for(int i = 0; i < TABLE_SHARDS; i++) {
+		pthread_mutex_init(&table->locks[i], NULL);
+		pthread_cond_init(&table->conds[i], NULL);
+	}
+}
+
+void table_free(GameTable* table) {
+	free(table->index);
+	free(table->spare);
+	free(table->ids);
+	free(table->phases);
+	free(table->since);
+	free(table->rules);
+	free(table->flags);
+	free(table->turns);
+	free(table->active);
+	free(table->players);
+	free(table->conns);
+	free(table->tokens);
+	free(table->games);
+	for(int i = 0; i < TABLE_SHARDS; i++) {
+		pthread_mutex_destroy(&table->locks[i]);
+		pthread_cond_destroy(&table->conds[i]);
+	}
+}
+
+/*
+ * Returns the index slot pointing at entry
+ */
+static unsigned int slot_of(const GameTable* table, unsigned int entry) {
+	unsigned int slot = home_of(table, table->ids[entry]);
+	while(table->index[slot] != entry + 1) {
+		slot = (slot + 1) & table->mask;
+	}
+	return slot;
+}
+
+/*
+ * Add a game waiting for players, with nobody in it
+ * Returns its entry, -1 if the table is full
+ */
+int table_add(GameTable* table, uint32_t id, uint32_t now, uint8_t rules) {
+	if(table->count == table->max) {
+		return -1;
+	}
+	unsigned int entry = table->nSpare > 0 ? table->spare[--table->nSpare] :
+			table->high++;
+	unsigned int slot = home_of(table, id);
+
+	table->count++;
+	while(table->index[slot] != 0) {
+		slot = (slot + 1) & table->mask;
+	}
+	table->index[slot] = entry + 1;
+	table->ids[entry] = id;
+	table->phases[entry] = TABLE_WAITING;
+	table->since[entry] = now;
+	table->rules[entry] = rules;
+	table->flags[entry] = 0;
+	table->turns[entry] = 0;
+	table->active[entry] = 0;
+	for(int i = 0; i < 2; i++) {
+		table->players[entry][i] = 0;
+		table->conns[entry][i] = -1;
+		table->tokens[entry][i] = 0;
+	}
+	table->games[entry] = NULL;
+	return entry;
+}
+
+/*
+ * Take out a game, leaving its entry free to be handed out again
+ */
+void table_remove(GameTable* table, unsigned int entry) {
+	unsigned int slot = slot_of(table, entry);
+
+	/* Shift back whatever was probed past this slot */
+	unsigned int next = (slot + 1) & table->mask;
+	while(table->index[next] != 0) {
+		unsigned int home = home_of(table, table->ids[table->index[next] - 1]);
+		if(((next - home) & table->mask) >= ((next - slot) & table->mask)) {
+			table->index[slot] = table->index[next];
+			slot = next;
+		}
+		next = (next + 1) & table->mask;
+	}
+	table->index[slot] = 0;
+
+	table->phases[entry] = TABLE_FREE;
+	table->spare[table->nSpare++] = entry;
+	table->count--;
+}
+
+/*
+ * Returns the entry of the game called id that isn't over, -1 if none
+ */
+int table_find(const GameTable* table, uint32_t id) {
+	unsigned int slot = home_of(table, id);
+
+	for(; table->index[slot] != 0; slot = (slot + 1) & table->mask) {
+		unsigned int entry = table->index[slot] - 1;
+		if(table->ids[entry] == id && table->phases[entry] != TABLE_OVER) {
+			return entry;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Returns the lock guarding what changes in play in the game at entry
+ */
+pthread_mutex_t* table_lock(GameTable* table, unsigned int entry) {
+	return &table->locks[entry & (TABLE_SHARDS - 1)];
+}
+
+/*
+ * Returns what threads waiting for the game at entry to start wait on,
+ * with its table_lock
+ */
+pthread_cond_t* table_cond(GameTable* table, unsigned int entry) {
+	return &table->conds[entry & (TABLE_SHARDS - 1)];
+}
+
+/*
+ * Returns the bytes the table takes, whatever it holds
+ */
+size_t table_memory(const GameTable* table) {
+	size_t perEntry = sizeof(uint32_t) * 3 + sizeof(uint8_t) * 5 +
+			sizeof(uint32_t[2]) + sizeof(int32_t[2]) + sizeof(uint64_t[2]) +
+			sizeof(void *);
+	return sizeof(uint32_t) * (table->mask + 1) + perEntry * table->max +
+			(sizeof(pthread_mutex_t) + sizeof(pthread_cond_t)) * TABLE_SHARDS;
+}
@@ -0,0 +1,81 @@
+#ifndef TABLE_H
+#define TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * The games a server is running, kept as a struct of arrays.
+ *
+ * All a game is until it has moves to keep sits in arrays of its own, a
+ * few bytes a field: its id, phase, rules, players and their sockets and
+ * resume tokens, whose turn it is. Only a game with moves, outboxes, a
+ * replay or a shared slot has a record of its own, so a game waiting for
+ * players takes nothing from the heap.
+ *
+ * A game keeps its entry for as long as it is in the table, so the entry
+ * is how the server refers to it. Entries given back are handed out
+ * again first, which keeps the used ones low: walking every game is a
+ * walk from 0 to high, passing over free entries.
+ *
+ * Games are found by their interned id through an open addressed index,
+ * twice as big as the table can get, probed linearly and kept free of
+ * tombstones by shifting entries back when one is removed. More than one
+ * game may have the same id, but only one that isn't over.
+ *
+ * Adding, removing, finding and the phases are guarded by one lock the
+ * callers share. What changes in play (flags, turns, active, sockets,
+ * tokens and the game's record) is guarded by the game's shard lock,
+ * taken after the shared one if both are held. A thread waiting for a
+ * game to start waits on its shard's condition variable.
+ */
+
+/* Phases of a game */
+#define TABLE_WAITING	0			// Waiting for players
+#define TABLE_PLAYING	1
+#define TABLE_OVER		2			// Finished, players leaving
+#define TABLE_FREE		3			// Not a game
+
+/* Flags of a game */
+#define TABLE_STARTED	1			// Both players are in
+#define TABLE_ENDED		2			// Finished or expired, players leaving
+
+#define TABLE_SHARDS	256			// Locks games are spread over, a power of two
+
+typedef struct GameTable {
+	unsigned int max;				// Most games it holds
+	unsigned int count;				// Games it holds
+	unsigned int high;				// Entries ever handed out
+	unsigned int mask;				// Index slots less one
+	uint32_t* index;				// Entry plus 1 by id hash, 0 if empty
+	uint32_t* spare;				// Entries given back, to hand out again
+	unsigned int nSpare;
+
+	/* By entry */
+	uint32_t* ids;					// Interned, see intern.h
+	uint8_t* phases;				// TABLE_* phase
+	uint32_t* since;				// When it was made, in seconds
+	uint8_t* rules;					// Which rule set it is played by
+	uint8_t* flags;					// TABLE_STARTED, TABLE_ENDED
+	uint8_t* turns;					// Which player may send next
+	uint8_t* active;				// Threads still playing it
+	uint32_t (*players)[2];			// Interned user ids, 0 for an empty seat
+	int32_t (*conns)[2];			// Each seat's socket, -1 if none
+	uint64_t (*tokens)[2];			// Each seat's resume token, 0 if none
+	void** games;					// The game's record, NULL if it has none
+
+	pthread_mutex_t locks[TABLE_SHARDS];
+	pthread_cond_t conds[TABLE_SHARDS];
+} GameTable;
+
+void table_init(GameTable* table, unsigned int max);
+void table_free(GameTable* table);
+int table_add(GameTable* table, uint32_t id, uint32_t now, uint8_t rules);
+void table_remove(GameTable* table, unsigned int entry);
+int table_find(const GameTable* table, uint32_t id);
+pthread_mutex_t* table_lock(GameTable* table, unsigned int entry);
+pthread_cond_t* table_cond(GameTable* table, unsigned int entry);
+size_t table_memory(const GameTable* table);
+
+#endif
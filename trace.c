@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+#define TAG_MARK	" #"
+#define TAG_DIGITS	16
+
+/*
+ * One hop of a move
+ */
+typedef struct TraceEvent {
+	const char* name;		// What happened, a string constant
+	uint64_t id;			// The move
+	uint64_t ts;			// Nanoseconds on CLOCK_MONOTONIC
+	unsigned long tid;		// Thread it happened on
+	char flow;				// FLOW_*
+} TraceEvent;
+
+bool traceOn = false;
+static TraceEvent* events = NULL;
+static size_t used = 0;		// Slots handed out, can go past TRACE_MAX
+static uint32_t lastId = 0;
+static FILE* traceFile = NULL;
+static char process[80];	// Name shown in the viewer
+
+/*
+ * Start recording hops, written to path at exit
+ * Returns false if path can't be written
+ */
+bool trace_open(const char* path, const char* name) {
+	if((traceFile = fopen(path, "w")) == NULL) {
+		return false;
+	}
+	events = (TraceEvent *)malloc(sizeof(TraceEvent) * TRACE_MAX);
+	snprintf(process, sizeof(process), "%s", name);
+	for(char* c = process; *c != '\0'; c++) {
+		if(*c == '"' || *c == '\\') {
+			*c = '_';	// Keep the JSON valid
+		}
+	}
+	traceOn = true;
+	atexit(trace_close);
+	return true;
+}
+
+/*
+ * Returns an id no other process on this machine will use
+ */
+uint64_t trace_new_id(void) {
+	return ((uint64_t)getpid() << 32) |
+			__atomic_add_fetch(&lastId, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Record a hop. Threads only share the slot counter, so this never
+ * waits for another thread.
+ */
+void trace_event(const char* name, uint64_t id, char flow) {
+	size_t slot = __atomic_fetch_add(&used, 1, __ATOMIC_RELAXED);
+	struct timespec now;
+
+	if(slot >= TRACE_MAX) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	events[slot].name = name;
+	events[slot].id = id;
+	events[slot].ts = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+	events[slot].tid = (unsigned long)pthread_self();
+	events[slot].flow = flow;
+}
+
+/*
+ * Write everything recorded as Chrome trace events. Each hop is a short
+ * slice, with a flow event on it so the viewer joins up the move.
+ */
+void trace_close(void) {
+	if(!traceOn) {
+		return;
+	}
+	traceOn = false;
+
+	size_t n = used < TRACE_MAX ? used : TRACE_MAX;
+	int pid = (int)getpid();
+	fprintf(traceFile, "{\"displayTimeUnit\": \"ns\", "
+			"\"otherData\": {\"dropped\": %lu}, \"traceEvents\": [\n",
+			(unsigned long)(used - n));
+	fprintf(traceFile, "{\"name\": \"process_name\", \"ph\": \"M\", "
+			"\"pid\": %d, \"args\": {\"name\": \"%s\"}}", pid, process);
+	for(size_t i = 0; i < n; i++) {
+		TraceEvent* e = &events[i];
+		double ts = e->ts / 1000.0;
+		fprintf(traceFile, ",\n{\"name\": \"%s\", \"cat\": \"move\", "
+				"\"ph\": \"X\", \"ts\": %.3f, \"dur\": 1, \"pid\": %d, "
+				"\"tid\": %lu, \"args\": {\"move\": \"%016llx\"}}",
+				e->name, ts, pid, e->tid, (unsigned long long)e->id);
+		fprintf(traceFile, ",\n{\"name\": \"move\", \"cat\": \"move\", "
+				"\"ph\": \"%c\", \"id\": \"0x%llx\", \"ts\": %.3f, "
+				"\"pid\": %d, \"tid\": %lu%s}", e->flow,
+				(unsigned long long)e->id, ts, pid, e->tid,
+				e->flow == FLOW_END ? ", \"bp\": \"e\"" : "");
+	}
+	fprintf(traceFile, "\n]}\n");
+	fclose(traceFile);
+	free(events);
+}
+
+/* Tags */
+
+/*
+ * Returns where the tag in line starts, NULL if it hasn't got one
+ */
+static const char* find_tag(const char* line) {
+	const char* tag = strstr(line, TAG_MARK);
+	if(tag == NULL) {
+		return NULL;
+	}
+	for(int i = 0; i < TAG_DIGITS; i++) {
+		char c = tag[2 + i];
+		if(!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+			return NULL;
+		}
+	}
+	if(tag[2 + TAG_DIGITS] != '\n' && tag[2 + TAG_DIGITS] != '\0') {
+		return NULL;
+	}
+	return tag;
+}
+
+/*
+ * Returns the move a line is tagged with, 0 if none
+ */
+uint64_t trace_peek(const char* line) {
+	const char* tag = find_tag(line);
+	return tag ? strtoull(tag + 2, NULL, 16) : 0;
+}
+
+/*
+ * Take the tag off a line, keeping its newline
+ * Returns the move it was tagged with, 0 if none
+ */
+uint64_t trace_split(char* line) {
+	char* tag = (char *)find_tag(line);
+	if(tag == NULL) {
+		return 0;
+	}
+	uint64_t id = strtoull(tag + 2, NULL, 16);
+	strcpy(tag, tag[2 + TAG_DIGITS] == '\n' ? "\n" : "");
+	return id;
+}
+
+/*
+ * Tag a line with move id, writing the result to out
+ * Returns the tagged line, or line itself if id is 0
+ */
+const char* trace_join(const char* line, char* out, size_t size,
+		uint64_t id) {
+	if(id == 0) {
+		return line;
+	}
+	size_t len = strlen(line);
+	int newline = len > 0 && line[len - 1] == '\n';
+	snprintf(out, size, "%.*s" TAG_MARK "%016llx%s", (int)len - newline, line,
+			(unsigned long long)id, newline ? "\n" : "");
+	return out;
+}
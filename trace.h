@@ -0,0 +1,48 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Tracing a move from one player's guess, through the server and the
+ * opponent, back to the answer.
+ *
+ * A client started with tracing gives each move an id and tags its
+ * $request with it as " #<16 hex digits>" before the newline. The server
+ * relays the tag and the opponent answers with the same tag, so every
+ * hop can be matched up. Tags are stripped before a message is acted on,
+ * so untraced clients and servers play along with traced ones.
+ *
+ * Each process keeps its hops in memory and writes them at exit in the
+ * Chrome trace event format. Timestamps come from CLOCK_MONOTONIC, so
+ * files from processes on the same machine line up and can be merged:
+ *     jq -s '{traceEvents: map(.traceEvents) | add}' *.json
+ * Hops of one move are joined by flow arrows in the viewer.
+ */
+
+#define TRACE_MAX	(1 << 18)	// Hops kept, later ones are dropped
+
+/* Where a hop sits in its move */
+#define FLOW_START	's'
+#define FLOW_STEP	't'
+#define FLOW_END	'f'
+
+extern bool traceOn;
+
+/* Costs one test when tracing is off */
+#define TRACE(name, id, flow) \
+	do { if(traceOn && (id) != 0) trace_event(name, id, flow); } while(0)
+
+bool trace_open(const char* path, const char* process);
+uint64_t trace_new_id(void);
+void trace_event(const char* name, uint64_t id, char flow);
+void trace_close(void);
+
+/* Tags */
+uint64_t trace_peek(const char* line);
+uint64_t trace_split(char* line);
+const char* trace_join(const char* line, char* out, size_t size, uint64_t id);
+
+#endif